@@ -0,0 +1,1005 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/**
+ * SPI LED chipset wire encodings
+ *
+ * LPD8806  GRB, 7 bits per component with MSB set, one zero byte per 32
+ *          LEDs latches
+ * WS2801   RGB, 8 bits, latches after 500 us of idle clock
+ * APA102   (and SK9822) 32 zero bits start frame, per LED 0xE0 | 5 bit
+ *          brightness followed by BGR, zero bytes as end frame to clock
+ *          data through the chain. 16 bit chains are mapped to the
+ *          brightness/PWM pair that resolves the value best (HDR)
+ * P9813    32 zero bits start frame, per LED flag byte (0b11 + inverted
+ *          two MSBs of B, G, R) followed by BGR, 32 zero bits end frame
+ *
+ * 16 bit chains for chipsets without brightness field are temporally
+ * dithered to the wire depth (spi_dither()) and then encoded like 8 bit
+ * chains.
+ */
+
+#include <string.h>
+#include <math.h>
+#include "encoder.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+/* SSSE3 kernels are built for the target & picked at runtime */
+#if defined(__SSSE3__) || (defined(__SSE2__) && defined(__GNUC__))
+#define SPI_SSSE3
+#include <tmmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+
+
+/******************************************************************************
+ * frame start/end
+ ******************************************************************************/
+
+/** no frame start/end */
+static size_t _frame_none(uint8_t * out, size_t pixels)
+{
+        (void) out;
+        (void) pixels;
+        return 0;
+}
+
+
+/** 32 zero bits */
+static size_t _frame_zero32(uint8_t * out, size_t pixels)
+{
+        (void) pixels;
+        if(out)
+                memset(out, 0, 4);
+        return 4;
+}
+
+
+/** one zero byte per 32 LEDs */
+static size_t _lpd8806_end(uint8_t * out, size_t pixels)
+{
+        size_t size = (pixels + 31) / 32;
+        if(out)
+                memset(out, 0, size);
+        return size;
+}
+
+
+/**
+ * APA102 needs one extra clock edge per 2 LEDs to push data through,
+ * SK9822 additionally needs a 32 bit reset frame. Zeros work for both.
+ */
+static size_t _apa102_end(uint8_t * out, size_t pixels)
+{
+        size_t size = 4 + (pixels + 15) / 16;
+        if(out)
+                memset(out, 0, size);
+        return size;
+}
+
+
+
+
+/******************************************************************************
+ * scalar encoders
+ ******************************************************************************/
+
+/** 3 bytes per pixel or raw values */
+static void _encode3_scalar(const SpiEncoder * e, uint8_t * out,
+                            const uint8_t * in, size_t n)
+{
+        size_t i;
+
+        if(!e->rgb)
+        {
+                for(i = 0; i < n; i++)
+                        out[i] = e->lut[in[i]];
+                return;
+        }
+
+        for(i = 0; i < n; i++, in += 3, out += 3)
+        {
+                out[0] = e->lut[in[e->idx[0]]];
+                out[1] = e->lut[in[e->idx[1]]];
+                out[2] = e->lut[in[e->idx[2]]];
+        }
+}
+
+
+/** header byte + 3 bytes per pixel */
+static void _encode4_scalar(const SpiEncoder * e, uint8_t * out,
+                            const uint8_t * in, size_t n)
+{
+        size_t i;
+        for(i = 0; i < n; i++, in += 3, out += 4)
+        {
+                out[0] = e->header;
+                out[1] = e->lut[in[e->idx[0]]];
+                out[2] = e->lut[in[e->idx[1]]];
+                out[3] = e->lut[in[e->idx[2]]];
+        }
+}
+
+
+/** P9813 flag byte + BGR */
+static void _p9813_scalar(const SpiEncoder * e, uint8_t * out,
+                          const uint8_t * in, size_t n)
+{
+        size_t i;
+        for(i = 0; i < n; i++, in += 3, out += 4)
+        {
+                uint8_t b = e->lut[in[e->idx[0]]];
+                uint8_t g = e->lut[in[e->idx[1]]];
+                uint8_t r = e->lut[in[e->idx[2]]];
+
+                out[0] = 0xc0 |
+                        ((~b >> 6) & 3) << 4 | ((~g >> 6) & 3) << 2 |
+                        ((~r >> 6) & 3);
+                out[1] = b;
+                out[2] = g;
+                out[3] = r;
+        }
+}
+
+
+
+
+/******************************************************************************
+ * vectorized encoders (without gamma/scale)
+ *
+ * each returns the amount of pixels (or raw values) done, the rest is
+ * encoded by the scalar version
+ ******************************************************************************/
+
+#if defined(SPI_SSSE3)
+
+/** CPU can run SSSE3 kernels */
+static inline bool _ssse3(void)
+{
+#if defined(__SSSE3__)
+        return true;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+
+/** LPD8806: shuffle 4 pixels per iteration, 16 bytes loaded & stored */
+__attribute__ ((target("ssse3")))
+static size_t _lpd8806_ssse3(const SpiEncoder * e, uint8_t * out,
+                             const uint8_t * in, size_t n)
+{
+        const __m128i shuffle = _mm_loadu_si128((const __m128i *) e->shuffle);
+        const __m128i msb = _mm_set1_epi8((char) 0x80);
+        const __m128i mask = _mm_set1_epi8(0x7f);
+        size_t i;
+
+        for(i = 0; i + 6 <= n; i += 4)
+        {
+                __m128i v = _mm_loadu_si128((const __m128i *) (in + i * 3));
+                v = _mm_shuffle_epi8(v, shuffle);
+                v = _mm_and_si128(_mm_srli_epi16(v, 1), mask);
+                _mm_storeu_si128((__m128i *) (out + i * 3),
+                                 _mm_or_si128(v, msb));
+        }
+
+        return i;
+}
+
+
+/** WS2801: shuffle 4 pixels per iteration */
+__attribute__ ((target("ssse3")))
+static size_t _ws2801_ssse3(const SpiEncoder * e, uint8_t * out,
+                            const uint8_t * in, size_t n)
+{
+        const __m128i shuffle = _mm_loadu_si128((const __m128i *) e->shuffle);
+        size_t i;
+
+        for(i = 0; i + 6 <= n; i += 4)
+        {
+                __m128i v = _mm_loadu_si128((const __m128i *) (in + i * 3));
+                _mm_storeu_si128((__m128i *) (out + i * 3),
+                                 _mm_shuffle_epi8(v, shuffle));
+        }
+
+        return i;
+}
+
+
+/** APA102: shuffle 4 pixels per iteration, 16 bytes loaded & stored */
+__attribute__ ((target("ssse3")))
+static size_t _apa102_ssse3(const SpiEncoder * e, uint8_t * out,
+                            const uint8_t * in, size_t n)
+{
+        const __m128i shuffle = _mm_loadu_si128((const __m128i *) e->shuffle);
+        const __m128i header = _mm_set1_epi32(e->header);
+        size_t i;
+
+        for(i = 0; i + 6 <= n; i += 4)
+        {
+                __m128i v = _mm_loadu_si128((const __m128i *) (in + i * 3));
+                v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), header);
+                _mm_storeu_si128((__m128i *) (out + i * 4), v);
+        }
+
+        return i;
+}
+
+
+/**
+ * P9813: shuffle 4 pixels per iteration. Each pixel then is one
+ * little-endian 32 bit word (flag | B << 8 | G << 16 | R << 24), inverted
+ * 2 MSBs of every component are moved to the flag byte with 32 bit
+ * shifts (SSE2)
+ */
+__attribute__ ((target("ssse3")))
+static size_t _p9813_ssse3(const SpiEncoder * e, uint8_t * out,
+                           const uint8_t * in, size_t n)
+{
+        const __m128i shuffle = _mm_loadu_si128((const __m128i *) e->shuffle);
+        const __m128i ones = _mm_set1_epi32(-1);
+        const __m128i msbs = _mm_set1_epi32(0x03030300);
+        const __m128i flag = _mm_set1_epi32(0xc0);
+        size_t i;
+
+        for(i = 0; i + 6 <= n; i += 4)
+        {
+                __m128i v = _mm_loadu_si128((const __m128i *) (in + i * 3));
+                v = _mm_shuffle_epi8(v, shuffle);
+
+                __m128i t = _mm_and_si128(_mm_srli_epi32
+                                          (_mm_xor_si128(v, ones), 6), msbs);
+                __m128i f = _mm_or_si128(flag, _mm_srli_epi32(t, 24));
+                f = _mm_or_si128(f,
+                                 _mm_and_si128(_mm_srli_epi32(t, 4),
+                                               _mm_set1_epi32(0x30)));
+                f = _mm_or_si128(f,
+                                 _mm_and_si128(_mm_srli_epi32(t, 14),
+                                               _mm_set1_epi32(0x0c)));
+
+                _mm_storeu_si128((__m128i *) (out + i * 4),
+                                 _mm_or_si128(v, f));
+        }
+
+        return i;
+}
+
+#endif /* SPI_SSSE3 */
+
+
+/** LPD8806: reorder, shift right & set MSB */
+static size_t _lpd8806_simd(const SpiEncoder * e, uint8_t * out,
+                            const uint8_t * in, size_t n)
+{
+        size_t i = 0;
+
+#if defined(__ARM_NEON)
+        const uint8x16_t msb = vdupq_n_u8(0x80);
+
+        if(e->rgb)
+        {
+                for(; i + 16 <= n; i += 16)
+                {
+                        uint8x16x3_t px = vld3q_u8(in + i * 3);
+                        uint8x16x3_t o;
+                        o.val[0] =
+                                vorrq_u8(vshrq_n_u8(px.val[e->idx[0]], 1), msb);
+                        o.val[1] =
+                                vorrq_u8(vshrq_n_u8(px.val[e->idx[1]], 1), msb);
+                        o.val[2] =
+                                vorrq_u8(vshrq_n_u8(px.val[e->idx[2]], 1), msb);
+                        vst3q_u8(out + i * 3, o);
+                }
+        }
+        else
+        {
+                for(; i + 16 <= n; i += 16)
+                        vst1q_u8(out + i,
+                                 vorrq_u8(vshrq_n_u8(vld1q_u8(in + i), 1),
+                                          msb));
+        }
+#elif defined(__SSE2__)
+        const __m128i msb = _mm_set1_epi8((char) 0x80);
+        const __m128i mask = _mm_set1_epi8(0x7f);
+
+        if(e->ordered)
+        {
+                size_t bytes = e->rgb ? n * 3 : n;
+                for(; i + 16 <= bytes; i += 16)
+                {
+                        __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+                        v = _mm_and_si128(_mm_srli_epi16(v, 1), mask);
+                        _mm_storeu_si128((__m128i *) (out + i),
+                                         _mm_or_si128(v, msb));
+                }
+                return e->rgb ? i / 3 : i;
+        }
+#if defined(SPI_SSSE3)
+        if(_ssse3())
+                i = _lpd8806_ssse3(e, out, in, n);
+#endif
+#else
+        (void) e;
+        (void) out;
+        (void) in;
+        (void) n;
+#endif
+
+        return i;
+}
+
+
+/** WS2801: reorder only */
+static size_t _ws2801_simd(const SpiEncoder * e, uint8_t * out,
+                           const uint8_t * in, size_t n)
+{
+        if(e->ordered)
+        {
+                memcpy(out, in, e->rgb ? n * 3 : n);
+                return n;
+        }
+
+        size_t i = 0;
+
+#if defined(__ARM_NEON)
+        for(; i + 16 <= n; i += 16)
+        {
+                uint8x16x3_t px = vld3q_u8(in + i * 3);
+                uint8x16x3_t o;
+                o.val[0] = px.val[e->idx[0]];
+                o.val[1] = px.val[e->idx[1]];
+                o.val[2] = px.val[e->idx[2]];
+                vst3q_u8(out + i * 3, o);
+        }
+#elif defined(SPI_SSSE3)
+        if(_ssse3())
+                i = _ws2801_ssse3(e, out, in, n);
+#else
+        (void) out;
+        (void) in;
+        (void) n;
+#endif
+
+        return i;
+}
+
+
+/** APA102: header byte & reorder 3 to 4 bytes */
+static size_t _apa102_simd(const SpiEncoder * e, uint8_t * out,
+                           const uint8_t * in, size_t n)
+{
+        size_t i = 0;
+
+#if defined(__ARM_NEON)
+        const uint8x16_t header = vdupq_n_u8(e->header);
+
+        for(; i + 16 <= n; i += 16)
+        {
+                uint8x16x3_t px = vld3q_u8(in + i * 3);
+                uint8x16x4_t o;
+                o.val[0] = header;
+                o.val[1] = px.val[e->idx[0]];
+                o.val[2] = px.val[e->idx[1]];
+                o.val[3] = px.val[e->idx[2]];
+                vst4q_u8(out + i * 4, o);
+        }
+#elif defined(SPI_SSSE3)
+        if(_ssse3())
+                i = _apa102_ssse3(e, out, in, n);
+#else
+        (void) e;
+        (void) out;
+        (void) in;
+        (void) n;
+#endif
+
+        return i;
+}
+
+
+/** P9813: reorder 3 to 4 bytes & calculate flag byte */
+static size_t _p9813_simd(const SpiEncoder * e, uint8_t * out,
+                          const uint8_t * in, size_t n)
+{
+        size_t i = 0;
+
+#if defined(__ARM_NEON)
+        const uint8x16_t flag = vdupq_n_u8(0xc0);
+
+        for(; i + 16 <= n; i += 16)
+        {
+                uint8x16x3_t px = vld3q_u8(in + i * 3);
+                uint8x16x4_t o;
+                o.val[1] = px.val[e->idx[0]];
+                o.val[2] = px.val[e->idx[1]];
+                o.val[3] = px.val[e->idx[2]];
+
+                uint8x16_t f = vorrq_u8(flag,
+                                        vshlq_n_u8(vshrq_n_u8
+                                                   (vmvnq_u8(o.val[1]), 6),
+                                                   4));
+                f = vorrq_u8(f,
+                             vshlq_n_u8(vshrq_n_u8(vmvnq_u8(o.val[2]), 6), 2));
+                o.val[0] = vorrq_u8(f, vshrq_n_u8(vmvnq_u8(o.val[3]), 6));
+                vst4q_u8(out + i * 4, o);
+        }
+#elif defined(SPI_SSSE3)
+        if(_ssse3())
+                i = _p9813_ssse3(e, out, in, n);
+#else
+        (void) e;
+        (void) out;
+        (void) in;
+        (void) n;
+#endif
+
+        return i;
+}
+
+
+
+
+/******************************************************************************
+ * APA102 brightness
+ ******************************************************************************/
+
+/**
+ * encode n 16 bit pixels choosing brightness per pixel so its largest
+ * component uses as much of the 8 bit PWM range as possible
+ *
+ * @param gain 5 bit gain per pixel or NULL
+ */
+void spi_encode_hdr(const SpiEncoder * e, uint8_t * out, const uint16_t * in,
+                    const uint8_t * gain, size_t n)
+{
+        size_t i;
+        for(i = 0; i < n; i++, in += 3, out += 4)
+        {
+                uint32_t v[3];
+                int k;
+                for(k = 0; k < 3; k++)
+                        v[k] = in[e->idx[k]];
+
+                if(gain && gain[i] != 31)
+                {
+                        for(k = 0; k < 3; k++)
+                                v[k] = v[k] * gain[i] / 31;
+                }
+
+                uint32_t max = v[0] > v[1] ? v[0] : v[1];
+                if(v[2] > max)
+                        max = v[2];
+
+                uint8_t b = e->hdr_brightness[max >> 6];
+                uint32_t mul = e->hdr_mul[b];
+
+                out[0] = 0xe0 | b;
+                for(k = 0; k < 3; k++)
+                {
+                        uint32_t pwm = (v[k] * mul + 0x8000) >> 16;
+                        out[1 + k] = pwm > 255 ? 255 : pwm;
+                }
+        }
+}
+
+
+/** overwrite brightness of n encoded pixels with 5 bit gain per pixel */
+void spi_encode_brightness(const SpiEncoder * e, uint8_t * out,
+                           const uint8_t * gain, size_t n)
+{
+        if(!e->chipset->brightness)
+                return;
+
+        size_t i;
+        for(i = 0; i < n; i++)
+                out[i * 4] = 0xe0 | gain[i];
+}
+
+
+/** build brightness & PWM tables for 16 bit values with scale applied */
+static void _hdr_tables(SpiEncoder * e, float scale)
+{
+        int i;
+        for(i = 0; i < 1024; i++)
+        {
+                /* largest value falling into this entry */
+                double max = scale * ((i << 6) | 63);
+                int b = (int) (max * 31 / 65535 + 0.999999);
+                e->hdr_brightness[i] = b < 1 ? 1 : (b > 31 ? 31 : b);
+        }
+
+        e->hdr_mul[0] = 0;
+        for(i = 1; i < 32; i++)
+                e->hdr_mul[i] =
+                        (uint32_t) (scale * 255.0 * 31 * 65536 /
+                                    (i * 65535.0) + 0.5);
+}
+
+
+
+
+/******************************************************************************
+ * temporal dithering
+ ******************************************************************************/
+
+/**
+ * quantize n 16 bit values to the wire depth of the chipset, carrying the
+ * quantization error of every value over to the next call (error
+ * accumulation). Output is 8 bit, ready for spi_encode() with a linear
+ * table.
+ */
+void spi_dither_scalar(const SpiEncoder * e, uint8_t * out,
+                       const uint16_t * in, uint16_t * err, size_t n)
+{
+        const int lshift = e->chipset->lut_shift;
+        const int shift = 8 + lshift;
+        const uint32_t mask = (1 << shift) - 1;
+
+        size_t i;
+        for(i = 0; i < n; i++)
+        {
+                uint32_t v = (uint32_t) in[i] + err[i];
+                if(v > 0xffff)
+                        v = 0xffff;
+
+                err[i] = v & mask;
+                out[i] = (v >> shift) << lshift;
+        }
+}
+
+
+/** vectorized spi_dither_scalar() */
+void spi_dither(const SpiEncoder * e, uint8_t * out, const uint16_t * in,
+                uint16_t * err, size_t n)
+{
+        size_t i = 0;
+
+#if defined(__ARM_NEON)
+        const int lshift = e->chipset->lut_shift;
+        const int shift = 8 + lshift;
+        const int16x8_t rcount = vdupq_n_s16(-shift);
+        const int16x8_t lcount = vdupq_n_s16(lshift);
+        const uint16x8_t mask = vdupq_n_u16((1 << shift) - 1);
+
+        for(; i + 8 <= n; i += 8)
+        {
+                uint16x8_t v = vqaddq_u16(vld1q_u16(in + i),
+                                          vld1q_u16(err + i));
+                vst1q_u16(err + i, vandq_u16(v, mask));
+                uint16x8_t q = vshlq_u16(vshlq_u16(v, rcount), lcount);
+                vst1_u8(out + i, vmovn_u16(q));
+        }
+#elif defined(__SSE2__)
+        const int lshift = e->chipset->lut_shift;
+        const int shift = 8 + lshift;
+        const __m128i rcount = _mm_cvtsi32_si128(shift);
+        const __m128i lcount = _mm_cvtsi32_si128(lshift);
+        const __m128i mask = _mm_set1_epi16((1 << shift) - 1);
+
+        for(; i + 16 <= n; i += 16)
+        {
+                __m128i a = _mm_adds_epu16(_mm_loadu_si128
+                                           ((const __m128i *) (in + i)),
+                                           _mm_loadu_si128((const __m128i *)
+                                                           (err + i)));
+                __m128i b = _mm_adds_epu16(_mm_loadu_si128
+                                           ((const __m128i *) (in + i + 8)),
+                                           _mm_loadu_si128((const __m128i *)
+                                                           (err + i + 8)));
+
+                _mm_storeu_si128((__m128i *) (err + i), _mm_and_si128(a, mask));
+                _mm_storeu_si128((__m128i *) (err + i + 8),
+                                 _mm_and_si128(b, mask));
+
+                a = _mm_sll_epi16(_mm_srl_epi16(a, rcount), lcount);
+                b = _mm_sll_epi16(_mm_srl_epi16(b, rcount), lcount);
+                _mm_storeu_si128((__m128i *) (out + i),
+                                 _mm_packus_epi16(a, b));
+        }
+#endif
+
+        spi_dither_scalar(e, out + i, in + i, err + i, n - i);
+}
+
+
+
+
+/******************************************************************************
+ * change detection
+ ******************************************************************************/
+
+/**
+ * compare n bytes of in with shadow in blocks of SPI_BLOCK_SIZE bytes (the
+ * last one may be shorter). Changed blocks are copied to shadow and get
+ * flag set in stale (one byte per block).
+ *
+ * @result amount of changed blocks
+ */
+size_t spi_shadow_update_scalar(uint8_t * shadow, const uint8_t * in,
+                                size_t n, uint8_t * stale, uint8_t flag)
+{
+        size_t changed = 0, i;
+        for(i = 0; i < n; i += SPI_BLOCK_SIZE)
+        {
+                size_t len = n - i < SPI_BLOCK_SIZE ? n - i : SPI_BLOCK_SIZE;
+                if(memcmp(shadow + i, in + i, len) == 0)
+                        continue;
+
+                memcpy(shadow + i, in + i, len);
+                stale[i / SPI_BLOCK_SIZE] |= flag;
+                changed++;
+        }
+
+        return changed;
+}
+
+
+/** vectorized spi_shadow_update_scalar() */
+size_t spi_shadow_update(uint8_t * shadow, const uint8_t * in, size_t n,
+                         uint8_t * stale, uint8_t flag)
+{
+        size_t changed = 0, i = 0;
+
+#if defined(__ARM_NEON)
+        for(; i + SPI_BLOCK_SIZE <= n; i += SPI_BLOCK_SIZE)
+        {
+                uint8x16x4_t a = vld4q_u8(in + i);
+                uint8x16x4_t b = vld4q_u8(shadow + i);
+                uint8x16_t d = vorrq_u8(vorrq_u8(veorq_u8(a.val[0], b.val[0]),
+                                                 veorq_u8(a.val[1], b.val[1])),
+                                        vorrq_u8(veorq_u8(a.val[2], b.val[2]),
+                                                 veorq_u8(a.val[3], b.val[3])));
+                uint64x2_t d64 = vreinterpretq_u64_u8(d);
+                if((vgetq_lane_u64(d64, 0) | vgetq_lane_u64(d64, 1)) == 0)
+                        continue;
+
+                vst4q_u8(shadow + i, a);
+                stale[i / SPI_BLOCK_SIZE] |= flag;
+                changed++;
+        }
+#elif defined(__SSE2__)
+        for(; i + SPI_BLOCK_SIZE <= n; i += SPI_BLOCK_SIZE)
+        {
+                const __m128i *a = (const __m128i *) (in + i);
+                __m128i *b = (__m128i *) (shadow + i);
+                __m128i a0 = _mm_loadu_si128(a), a1 = _mm_loadu_si128(a + 1);
+                __m128i a2 = _mm_loadu_si128(a + 2), a3 = _mm_loadu_si128(a + 3);
+
+                __m128i eq = _mm_and_si128(
+                        _mm_and_si128(_mm_cmpeq_epi8(a0, _mm_loadu_si128(b)),
+                                      _mm_cmpeq_epi8(a1,
+                                                     _mm_loadu_si128(b + 1))),
+                        _mm_and_si128(_mm_cmpeq_epi8(a2,
+                                                     _mm_loadu_si128(b + 2)),
+                                      _mm_cmpeq_epi8(a3,
+                                                     _mm_loadu_si128(b + 3))));
+                if(_mm_movemask_epi8(eq) == 0xffff)
+                        continue;
+
+                _mm_storeu_si128(b, a0);
+                _mm_storeu_si128(b + 1, a1);
+                _mm_storeu_si128(b + 2, a2);
+                _mm_storeu_si128(b + 3, a3);
+                stale[i / SPI_BLOCK_SIZE] |= flag;
+                changed++;
+        }
+#endif
+
+        return changed + spi_shadow_update_scalar(shadow + i, in + i, n - i,
+                                                  stale + i / SPI_BLOCK_SIZE,
+                                                  flag);
+}
+
+
+
+
+/******************************************************************************
+ * encoders
+ ******************************************************************************/
+
+/** encode with vector kernel if possible, rest with scalar version */
+static void _encode(const SpiEncoder * e, uint8_t * out, const uint8_t * in,
+                    size_t n,
+                    size_t (*simd) (const SpiEncoder *, uint8_t *,
+                                    const uint8_t *, size_t))
+{
+        /* gamma/scale table can't be vectorized */
+        size_t done = e->linear ? simd(e, out, in, n) : 0;
+
+        size_t in_unit = e->rgb ? 3 : 1;
+        size_t out_unit = e->rgb ? e->chipset->bytes_per_pixel : 1;
+
+        e->chipset->encode_scalar(e, out + done * out_unit, in + done * in_unit,
+                                  n - done);
+}
+
+
+static void _lpd8806_encode(const SpiEncoder * e, uint8_t * out,
+                            const uint8_t * in, size_t n)
+{
+        _encode(e, out, in, n, _lpd8806_simd);
+}
+
+
+static void _ws2801_encode(const SpiEncoder * e, uint8_t * out,
+                           const uint8_t * in, size_t n)
+{
+        _encode(e, out, in, n, _ws2801_simd);
+}
+
+
+static void _apa102_encode(const SpiEncoder * e, uint8_t * out,
+                           const uint8_t * in, size_t n)
+{
+        _encode(e, out, in, n, _apa102_simd);
+}
+
+
+static void _p9813_encode(const SpiEncoder * e, uint8_t * out,
+                          const uint8_t * in, size_t n)
+{
+        _encode(e, out, in, n, _p9813_simd);
+}
+
+
+/** all supported chipsets */
+static const SpiChipset _chipsets[] = {
+        {
+         .name = "lpd8806",
+         .bytes_per_pixel = 3,
+         .order = {1, 0, 2},
+         .raw = true,
+         .lut_or = 0x80,
+         .lut_shift = 1,
+         .start = _frame_none,
+         .encode = _lpd8806_encode,
+         .encode_scalar = _encode3_scalar,
+         .end = _lpd8806_end,
+         .latch_us = 0,
+         .probe_mask = 0x7f,
+         },
+        {
+         .name = "ws2801",
+         .bytes_per_pixel = 3,
+         .order = {0, 1, 2},
+         .raw = true,
+         .start = _frame_none,
+         .encode = _ws2801_encode,
+         .encode_scalar = _encode3_scalar,
+         .end = _frame_none,
+         .latch_us = 500,
+         },
+        {
+         .name = "apa102",
+         .bytes_per_pixel = 4,
+         .order = {2, 1, 0},
+         .start = _frame_zero32,
+         .encode = _apa102_encode,
+         .encode_scalar = _encode4_scalar,
+         .end = _apa102_end,
+         .brightness = true,
+         },
+        {
+         .name = "sk9822",
+         .bytes_per_pixel = 4,
+         .order = {2, 1, 0},
+         .start = _frame_zero32,
+         .encode = _apa102_encode,
+         .encode_scalar = _encode4_scalar,
+         .end = _apa102_end,
+         .brightness = true,
+         },
+        {
+         .name = "p9813",
+         .bytes_per_pixel = 4,
+         .order = {2, 1, 0},
+         .start = _frame_zero32,
+         .encode = _p9813_encode,
+         .encode_scalar = _p9813_scalar,
+         .end = _frame_zero32,
+         },
+};
+
+
+
+
+/** get chipset by name, NULL if unknown */
+const SpiChipset *spi_chipset_find(const char *name)
+{
+        unsigned int i;
+        for(i = 0; i < sizeof(_chipsets) / sizeof(_chipsets[0]); i++)
+        {
+                if(strcmp(_chipsets[i].name, name) == 0)
+                        return &_chipsets[i];
+        }
+
+        return NULL;
+}
+
+
+/** get n'th chipset, NULL if n is out of range */
+const SpiChipset *spi_chipset_get(unsigned int n)
+{
+        if(n >= sizeof(_chipsets) / sizeof(_chipsets[0]))
+                return NULL;
+
+        return &_chipsets[n];
+}
+
+
+/**
+ * initialize encoder for a chipset & chain pixel-format (e.g. "RGB u8")
+ *
+ * @result false if chipset can't handle format. Non-RGB formats are encoded
+ *         in chain order by chipsets supporting it.
+ */
+bool spi_encoder_init(SpiEncoder * e, const SpiChipset * c,
+                      const char *format)
+{
+        memset(e, 0, sizeof(SpiEncoder));
+        e->chipset = c;
+        e->header = 0xff;
+
+        /* component letters are in front of the first space */
+        const char *r = strchr(format, 'R');
+        const char *g = strchr(format, 'G');
+        const char *b = strchr(format, 'B');
+        const char *space = strchr(format, ' ');
+
+        /* 16 bit components are mapped (HDR) or dithered */
+        bool wide = strstr(format, "u16") != NULL;
+
+        uint8_t in[3] = { 0, 1, 2 };
+        if(space && space - format == 3 && r && g && b &&
+           r < space && g < space && b < space)
+        {
+                e->rgb = true;
+                in[0] = r - format;
+                in[1] = g - format;
+                in[2] = b - format;
+        }
+
+        int k;
+        for(k = 0; k < 3; k++)
+                e->idx[k] = in[c->order[k]];
+
+        e->ordered = !e->rgb ||
+                (e->idx[0] == 0 && e->idx[1] == 1 && e->idx[2] == 2);
+
+        /* reorder 4 pixels at a time */
+        int i;
+        memset(e->shuffle, 0x80, sizeof(e->shuffle));
+        for(i = 0; i < 4; i++)
+        {
+                if(c->bytes_per_pixel == 4)
+                {
+                        /* leading byte is zeroed */
+                        for(k = 0; k < 3; k++)
+                                e->shuffle[i * 4 + 1 + k] = i * 3 + e->idx[k];
+                }
+                else
+                {
+                        for(k = 0; k < 3; k++)
+                                e->shuffle[i * 3 + k] = i * 3 + e->idx[k];
+                }
+        }
+
+        if(wide && c->brightness)
+        {
+                e->hdr = true;
+                spi_encoder_set_lut(e, 1.0, 1.0);
+                return e->rgb;
+        }
+
+        e->dither = wide;
+        spi_encoder_set_lut(e, 1.0, 1.0);
+
+        return e->rgb || c->raw;
+}
+
+
+/** build lookup table applying gamma & scale (0.0 - 1.0) */
+void spi_encoder_set_lut(SpiEncoder * e, float gamma, float scale)
+{
+        if(scale < 0)
+                scale = 0;
+        if(scale > 1)
+                scale = 1;
+
+        /* dithered values are already at wire depth */
+        if(e->dither)
+        {
+                gamma = 1.0;
+                scale = 1.0;
+        }
+
+        e->linear = (gamma == 1.0 && scale == 1.0);
+
+        int v;
+        for(v = 0; v < 256; v++)
+        {
+                float f = scale * powf(v / 255.0f, gamma) * 255.0f + 0.5f;
+                e->lut[v] = e->chipset->lut_or |
+                        (((uint8_t) f) >> e->chipset->lut_shift);
+        }
+
+        /* HDR ignores gamma, 16 bit chains are expected to be corrected */
+        if(e->chipset->brightness)
+                _hdr_tables(e, scale);
+}
+
+
+/** encode n pixels (or raw values) from in to out */
+void spi_encode(const SpiEncoder * e, uint8_t * out, const uint8_t * in,
+                size_t n)
+{
+        if(e->hdr)
+        {
+                spi_encode_hdr(e, out, (const uint16_t *) in, NULL, n);
+                return;
+        }
+
+        e->chipset->encode(e, out, in, n);
+}
+
+
+/** reference implementation of spi_encode() */
+void spi_encode_scalar(const SpiEncoder * e, uint8_t * out,
+                       const uint8_t * in, size_t n)
+{
+        if(e->hdr)
+        {
+                spi_encode_hdr(e, out, (const uint16_t *) in, NULL, n);
+                return;
+        }
+
+        e->chipset->encode_scalar(e, out, in, n);
+}
@@ -0,0 +1,147 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+#ifndef _NL_PLUGIN_SPI_ENCODER
+#define _NL_PLUGIN_SPI_ENCODER
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/** granularity of change detection (bytes of chain) */
+#define SPI_BLOCK_SIZE  64
+
+
+typedef struct _SpiChipset SpiChipset;
+
+
+/** converts chain data to what LEDs expect on the wire */
+typedef struct
+{
+        /** chipset we encode for */
+        const SpiChipset               *chipset;
+        /** chain buffer holds RGB pixels (otherwise raw values) */
+        bool                            rgb;
+        /** input component sent at each wire position */
+        uint8_t                         idx[3];
+        /** input is already in wire order */
+        bool                            ordered;
+        /** pshufb control to reorder 4 pixels to wire layout */
+        uint8_t                         shuffle[16];
+        /** value -> wire byte */
+        uint8_t                         lut[256];
+        /** lut applies no gamma/scale */
+        bool                            linear;
+        /** leading byte of 4 byte pixels (APA102 brightness) */
+        uint8_t                         header;
+        /** 16 bit chain mapped to brightness & PWM */
+        bool                            hdr;
+        /** brightness for the largest component of a pixel (>> 6) */
+        uint8_t                         hdr_brightness[1024];
+        /** 16 bit value * hdr_mul[brightness] >> 16 = PWM value */
+        uint32_t                        hdr_mul[32];
+        /** 16 bit chain is temporally dithered to wire depth */
+        bool                            dither;
+} SpiEncoder;
+
+
+/** encode n pixels (or raw values) from in to out */
+typedef void                    (*SpiEncodeFunc) (const SpiEncoder * e, uint8_t * out, const uint8_t * in, size_t n);
+
+/** write frame start/end for amount of pixels to out (if not NULL) and return its size */
+typedef size_t                  (*SpiFrameFunc) (uint8_t * out, size_t pixels);
+
+
+/** description of one kind of SPI LED controller */
+struct _SpiChipset
+{
+        /** name used in "chipset" property */
+        const char                     *name;
+        /** bytes per pixel on the wire */
+        size_t                          bytes_per_pixel;
+        /** component (0 = R, 1 = G, 2 = B) at each wire position */
+        uint8_t                         order[3];
+        /** non-RGB formats can be sent value by value */
+        bool                            raw;
+        /** wire byte = lut_or | (value >> lut_shift) */
+        uint8_t                         lut_or;
+        uint8_t                         lut_shift;
+        /** frame start */
+        SpiFrameFunc                    start;
+        /** pixel encoder (vectorized where possible) */
+        SpiEncodeFunc                   encode;
+        /** reference pixel encoder */
+        SpiEncodeFunc                   encode_scalar;
+        /** frame end */
+        SpiFrameFunc                    end;
+        /** idle time after a frame before the next one (microseconds) */
+        unsigned int                    latch_us;
+        /** leading byte of pixel holds 5 bit brightness (APA102) */
+        bool                            brightness;
+        /** clock probe pattern bytes are masked with this, so the chain
+            ignores them (0 = chain would light up, no probing) */
+        uint8_t                         probe_mask;
+};
+
+
+const SpiChipset               *spi_chipset_find(const char *name);
+const SpiChipset               *spi_chipset_get(unsigned int n);
+
+bool                            spi_encoder_init(SpiEncoder * e, const SpiChipset * c, const char *format);
+void                            spi_encoder_set_lut(SpiEncoder * e, float gamma, float scale);
+
+void                            spi_encode(const SpiEncoder * e, uint8_t * out, const uint8_t * in, size_t n);
+void                            spi_encode_scalar(const SpiEncoder * e, uint8_t * out, const uint8_t * in, size_t n);
+void                            spi_encode_hdr(const SpiEncoder * e, uint8_t * out, const uint16_t * in, const uint8_t * gain, size_t n);
+void                            spi_dither(const SpiEncoder * e, uint8_t * out, const uint16_t * in, uint16_t * err, size_t n);
+void                            spi_dither_scalar(const SpiEncoder * e, uint8_t * out, const uint16_t * in, uint16_t * err, size_t n);
+void                            spi_encode_brightness(const SpiEncoder * e, uint8_t * out, const uint8_t * gain, size_t n);
+
+size_t                          spi_shadow_update(uint8_t * shadow, const uint8_t * in, size_t n, uint8_t * stale, uint8_t flag);
+size_t                          spi_shadow_update_scalar(uint8_t * shadow, const uint8_t * in, size_t n, uint8_t * stale, uint8_t flag);
+
+
+#endif /* _NL_PLUGIN_SPI_ENCODER */
@@ -46,12 +46,101 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <linux/spi/spidev.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <niftyled.h>
 #include "config.h"
 #include "lpd8806-spi.h"
+#include "encoder.h"
+
+
+
+/** default spidev buffer size if it can't be read from sysfs */
+#define SPI_BUFSIZ_DEFAULT      4096
+/** sysfs file holding the spidev buffer size */
+#define SPI_BUFSIZ_PATH         "/sys/module/spidev/parameters/bufsiz"
+/** maximum amount of transfers in one SPI_IOC_MESSAGE() */
+#define SPI_TRANSFERS_MAX       64
+/** clock to start probing with (Hz) */
+#define SPI_PROBE_START         100000
+/** bytes of test pattern sent per probe step */
+#define SPI_PROBE_SIZE          1024
+/** rounds a probe step must pass */
+#define SPI_PROBE_ROUNDS        3
+/** maximum amount of SPI devices driven by one hardware */
+#define SPI_BUSES_MAX           8
+/** default interval unchanged frames are still sent at (ms) */
+#define REFRESH_INTERVAL_DEFAULT 1000
+/** default refresh rate of dithered output (Hz) */
+#define DITHER_RATE_DEFAULT     400
+/** devices id "*" picks from */
+#define SPI_DEVICE_GLOB         "/dev/spidev*"
+/** environment variable overriding SPI_CACHE_PATH */
+#define SPI_CACHE_ENV           "NFT_SPI_CACHE"
+/** devices picked for id "*" per hardware name ("<name>\t<device>" lines) */
+#define SPI_CACHE_PATH          "/var/tmp/niftyled-spi_lpd8806.cache"
+/** maximum size of cache file */
+#define SPI_CACHE_MAX           16384
+
+
+
+/** what to do if a frame is shown while the previous one is still sent */
+typedef enum
+{
+        /** wait for writer to finish previous frame */
+        QUEUE_BLOCK = 0,
+        /** skip this frame */
+        QUEUE_DROP,
+} QueuePolicy;
+
+
+struct priv;
+
+
+/** one spidev device driving a contiguous segment of the chain */
+typedef struct
+{
+        /* private info of hardware this bus belongs to */
+        struct priv *p;
+        /* path of spidev device */
+        char path[256];
+        /* LEDs requested for this bus in id (0 = share remaining LEDs) */
+        LedCount requested;
+        /* file descriptor for SPI device */
+        int fd;
+        /* first pixel of chain on this bus */
+        LedCount first;
+        /* amount of pixels on this bus */
+        LedCount count;
+        /* encoded segment as it's sent on the wire (front & back buffer) */
+        uint8_t *txBuffer[2];
+        /* size of frame start in txBuffer (bytes) */
+        size_t txStart;
+        /* size of frame start & encoded segment in txBuffer (bytes) */
+        size_t txSize;
+        /* size of frame end following the segment in txBuffer (bytes) */
+        size_t latchSize;
+        /* SPI writer thread */
+        pthread_t writer;
+        /* writer thread is running */
+        bool writerRunning;
+        /* front buffer is handed off to writer and not written yet */
+        bool txPending;
+        /* dithered segment (8 bit, chain order) */
+        uint8_t *dither;
+        /* writer reads front source buffer to dither it */
+        bool dithering;
+        /* time of next dithered refresh */
+        struct timespec next;
+        /* result of last transfer by writer thread */
+        NftResult txResult;
+} SpiBus;
 
 
 
@@ -61,40 +150,924 @@ struct priv
 {
         /* LedHardware descriptor for this plugin */
         LedHardware *hw;
-        /* id - for our plugin, path to tty */
+        /* id - for our plugin, comma separated list of spidev devices */
         char id[1024];
         /* amount of LEDs connected to SPI port */
         LedCount ledcount;
-        /* file descriptor for SPI device */
-        int fd;
-        /* SPI buffers */
+        /* SPI devices the chain is split across */
+        SpiBus bus[SPI_BUSES_MAX];
+        /* amount of SPI devices in use */
+        int buses;
+        /* buses waiting for the others to finish data before latching */
+        int latchWait;
+        /* SPI settings (speed & delay are applied per transfer) */
         uint8_t spiMode;
         uint8_t spiBPW;
         uint16_t spiDelay;
         uint32_t spiSpeed;
-        uint8_t *txBuffer;
+        /* index of buffer _send() encodes into */
+        int back;
+        /* chain as of last _send() to find changed blocks */
+        uint8_t *shadow;
+        /* per SPI_BLOCK_SIZE block of chain: bit n set if buffer n needs
+           it re-encoded */
+        uint8_t *stale;
+        /* LEDs (components) of chain encoded as one pixel */
+        size_t pixelLeds;
+        /* bytes per pixel of chain */
+        size_t pixelBytes;
+        /* pixels of chain (set in _send()) */
+        LedCount pixels;
+        /* anything changed since last frame was handed off */
+        bool changed;
+        /* unchanged frames are still sent this often (ms, 0 = always) */
+        unsigned int refreshInterval;
+        /* when last frame was handed off */
+        struct timespec lastFrame;
+        /* size of chain buffer txBuffers were set up for (bytes) */
+        size_t chainSize;
+        /* max. bytes spidev accepts per ioctl */
+        size_t spiBufsiz;
+        /* send chain & latch with one SPI message */
+        bool singleIoctl;
+        /* txBuffer holds the whole chain encoded with current settings */
+        bool txValid;
+        /* kind of LEDs connected */
+        const SpiChipset *chipset;
+        /* pixel-format of chain (set in _spi_init()) */
+        char format[64];
+        /* chain -> wire conversion */
+        SpiEncoder encoder;
+        /* 16 bit chain copy to dither from (front & back buffer) */
+        uint16_t *src[2];
+        /* accumulated dither error per component */
+        uint16_t *err;
+        /* refresh rate of dithered output (Hz) */
+        unsigned int ditherRate;
+        /* dithering writers pause while settings change */
+        bool ditherHold;
+        /* 5 bit gain per pixel (NULL if gain was never set) */
+        uint8_t *gain;
+        /* amount of entries in gain */
+        LedCount gainCount;
+        /* gamma correction exponent */
+        float gamma;
+        /* brightness scale (0.0 - 1.0) */
+        float scale;
+        /* hardware is initialized and writer threads are running */
+        bool running;
+        /* protects everything shared with writer threads */
+        pthread_mutex_t lock;
+        /* signals frame handed off to writers or frame written */
+        pthread_cond_t cond;
+        /* what to do if writer is busy */
+        QueuePolicy queuePolicy;
+        /* highest clock to probe with loopback (0 = no probing) */
+        uint32_t probeMax;
+        /* frames skipped because writer was busy */
+        unsigned long droppedFrames;
+};
+
+
+
+
+/** read maximum message size of spidev driver */
+static size_t spiBufsiz(void)
+{
+        size_t bufsiz = SPI_BUFSIZ_DEFAULT;
+
+        FILE *f;
+        if(!(f = fopen(SPI_BUFSIZ_PATH, "r")))
+                return bufsiz;
+
+        if(fscanf(f, "%zu", &bufsiz) != 1 || bufsiz == 0)
+                bufsiz = SPI_BUFSIZ_DEFAULT;
+
+        fclose(f);
+
+        return bufsiz;
+}
+
+
+/** submit list of transfers in one SPI message */
+static NftResult spiTxMessage(int fd, struct spi_ioc_transfer *tr,
+                              unsigned int n)
+{
+        if(n == 0)
+                return NFT_SUCCESS;
+
+        if(ioctl(fd, SPI_IOC_MESSAGE(n), tr) < 1)
+        {
+                NFT_LOG_PERROR("Failed to send SPI message:");
+                return NFT_FAILURE;
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * send data followed by latch, packing as many transfers of at most bufsiz
+ * bytes into one ioctl as the spidev driver accepts (it limits the sum of
+ * all transfers in one message to bufsiz)
+ */
+static NftResult spiTxFrame(int fd, size_t bufsiz,
+                            const struct spi_ioc_transfer *tmpl,
+                            uint8_t * data, size_t len,
+                            uint8_t * latch, size_t latchlen)
+{
+        struct spi_ioc_transfer tr[SPI_TRANSFERS_MAX];
+        unsigned int n = 0;
+        size_t total = 0;
+
+        struct
+        {
+                uint8_t *buf;
+                size_t len;
+        } segment[2] =
+        {
+                { data, len },
+                { latch, latchlen },
+        };
+
+        int s;
+        for(s = 0; s < 2; s++)
+        {
+                uint8_t *buf = segment[s].buf;
+                size_t left = segment[s].len;
+
+                while(left > 0)
+                {
+                        /* message full? */
+                        if(n == SPI_TRANSFERS_MAX || total == bufsiz)
+                        {
+                                if(!spiTxMessage(fd, tr, n))
+                                        return NFT_FAILURE;
+
+                                n = 0;
+                                total = 0;
+                        }
+
+                        size_t chunk = left;
+                        if(chunk > bufsiz - total)
+                                chunk = bufsiz - total;
+
+                        tr[n] = *tmpl;
+                        tr[n].tx_buf = (unsigned long) buf;
+                        tr[n].len = chunk;
+                        tr[n].cs_change = false;
+                        n++;
+
+                        total += chunk;
+                        buf += chunk;
+                        left -= chunk;
+                }
+        }
+
+        return spiTxMessage(fd, tr, n);
+}
+
+
+/** transfer descriptor with current settings (lock must be held) */
+static void spiTemplate(struct priv *p, struct spi_ioc_transfer *tmpl)
+{
+        memset(tmpl, 0, sizeof(struct spi_ioc_transfer));
+
+        tmpl->speed_hz = p->spiSpeed;
+        tmpl->delay_usecs = p->spiDelay;
+        tmpl->bits_per_word = p->spiBPW;
+}
+
+
+/**
+ * find highest clock that transfers data without errors. MOSI must be
+ * looped back to MISO. Speeds are ramped up from SPI_PROBE_START to max.
+ * The pattern is masked with the chipset's probe_mask, e.g. LPD8806 chains
+ * take bytes with MSB cleared as reset and stay dark. (writer must be idle
+ * & lock must be held)
+ *
+ * @result highest passing clock in Hz or 0 if no clock passed
+ */
+static uint32_t spiProbe(struct priv *p, SpiBus * bus, uint32_t max)
+{
+        uint8_t tx[SPI_PROBE_SIZE], rx[SPI_PROBE_SIZE];
+        uint8_t mask = p->encoder.chipset->probe_mask;
+        uint32_t good = 0;
+
+        /* alternating bits & pseudo random data */
+        unsigned int seed = 0x1d872b41;
+        size_t i;
+        for(i = 0; i < sizeof(tx); i++)
+        {
+                seed = seed * 1103515245 + 12345;
+                tx[i] = mask & ((i & 1) ? (seed >> 16) :
+                                ((i & 2) ? 0xaa : 0x55));
+        }
+
+        size_t len = sizeof(tx) < p->spiBufsiz ? sizeof(tx) : p->spiBufsiz;
+
+        struct spi_ioc_transfer tr;
+        spiTemplate(p, &tr);
+        tr.tx_buf = (unsigned long) tx;
+        tr.rx_buf = (unsigned long) rx;
+        tr.len = len;
+        tr.delay_usecs = 0;
+
+        uint32_t speed = SPI_PROBE_START < max ? SPI_PROBE_START : max;
+        for(;;)
+        {
+                tr.speed_hz = speed;
+
+                int round;
+                for(round = 0; round < SPI_PROBE_ROUNDS; round++)
+                {
+                        memset(rx, 0xff, sizeof(rx));
+
+                        if(ioctl(bus->fd, SPI_IOC_MESSAGE(1), &tr) < 1)
+                        {
+                                NFT_LOG_PERROR("Failed to send SPI probe:");
+                                return good;
+                        }
+
+                        if(memcmp(tx, rx, len) != 0)
+                                break;
+                }
+
+                if(round < SPI_PROBE_ROUNDS)
+                {
+                        NFT_LOG(L_DEBUG,
+                                "SPI \"%s\" failed readback at %u Hz",
+                                bus->path, speed);
+                        break;
+                }
+
+                NFT_LOG(L_DEBUG, "SPI \"%s\" passed readback at %u Hz",
+                        bus->path, speed);
+                good = speed;
+
+                if(speed >= max)
+                        break;
+
+                /* ramp up by 25% */
+                speed += speed / 4;
+                if(speed > max)
+                        speed = max;
+        }
+
+        return good;
+}
+
+
+/**
+ * probe clock of all buses and use highest one stable on every bus
+ * (lock must be held)
+ */
+static NftResult spiProbeApply(struct priv *p)
+{
+        uint32_t speed = p->probeMax;
+
+        /* any pattern would show up on the LEDs */
+        if(!p->encoder.chipset->probe_mask)
+        {
+                NFT_LOG(L_ERROR,
+                        "SPI \"%s\": chipset \"%s\" can't be probed without lighting up LEDs",
+                        p->id, p->encoder.chipset->name);
+                return NFT_FAILURE;
+        }
+
+        int i;
+        for(i = 0; i < p->buses; i++)
+        {
+                uint32_t s = spiProbe(p, &p->bus[i], speed);
+                if(s == 0)
+                {
+                        NFT_LOG(L_ERROR,
+                                "SPI \"%s\": loopback readback failed at every clock. Is MOSI connected to MISO?",
+                                p->bus[i].path);
+                        return NFT_FAILURE;
+                }
+
+                /* next bus doesn't need to go higher */
+                speed = s;
+        }
+
+        NFT_LOG(L_INFO, "SPI \"%s\": highest stable clock is %u Hz", p->id,
+                speed);
+        p->spiSpeed = speed;
+
+        return NFT_SUCCESS;
+}
+
+
+/** mark blocks of pixel for re-encoding in both buffers */
+static void spiStale(struct priv *p, LedCount pixel)
+{
+        if(!p->stale || (pixel + 1) * p->pixelBytes > p->chainSize)
+                return;
+
+        size_t first = pixel * p->pixelBytes / SPI_BLOCK_SIZE;
+        size_t last = ((pixel + 1) * p->pixelBytes - 1) / SPI_BLOCK_SIZE;
+        for(; first <= last; first++)
+                p->stale[first] = 3;
+
+        p->changed = true;
+}
+
+
+/** resize gain array to pixels, new pixels get full gain */
+static NftResult spiGainResize(struct priv *p, LedCount pixels)
+{
+        if(p->gainCount == pixels)
+                return NFT_SUCCESS;
+
+        uint8_t *gain;
+        if(!(gain = realloc(p->gain, pixels + 1)))
+        {
+                NFT_LOG_PERROR("realloc");
+                return NFT_FAILURE;
+        }
+
+        if(pixels > p->gainCount)
+                memset(gain + p->gainCount, 31, pixels - p->gainCount);
+
+        p->gain = gain;
+        p->gainCount = pixels;
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * set gain of one LED using the 5 bit brightness of APA102 class chips.
+ * That's one brightness per pixel, taken from the gain of its first
+ * component.
+ */
+static NftResult spiSetGain(struct priv *p, LedCount pos, LedGain gain)
+{
+        if(!p->encoder.chipset->brightness)
+        {
+                NFT_LOG(L_WARNING,
+                        "Chipset \"%s\" has no per-LED brightness. Ignoring gain.",
+                        p->encoder.chipset->name);
+                return NFT_SUCCESS;
+        }
+
+        if(pos >= p->ledcount)
+        {
+                NFT_LOG(L_ERROR, "LED %d out of range (%d LEDs)", pos,
+                        p->ledcount);
+                return NFT_FAILURE;
+        }
+
+        LedCount pixel = pos / p->pixelLeds;
+        LedCount pixels = p->ledcount / p->pixelLeds;
+        if(pos % p->pixelLeds != 0 || pixel >= pixels)
+        {
+                NFT_LOG(L_DEBUG,
+                        "LED %d is no first component of a pixel. Ignoring gain.",
+                        pos);
+                return NFT_SUCCESS;
+        }
+
+        if(!spiGainResize(p, pixels))
+                return NFT_FAILURE;
+
+        /* scale gain from (0x0 - 0xffff) to (0x0 - 0x1f) */
+        p->gain[pixel] =
+                (uint8_t) ((gain * 31 + LED_GAIN_MAX / 2) / LED_GAIN_MAX);
+
+        /* re-encode pixel in both buffers */
+        spiStale(p, pixel);
+
+        return NFT_SUCCESS;
+}
+
+
+/** add nanoseconds to timespec */
+static void spiTimeAdd(struct timespec *t, long ns)
+{
+        t->tv_nsec += ns;
+        while(t->tv_nsec >= 1000000000)
+        {
+                t->tv_nsec -= 1000000000;
+                t->tv_sec++;
+        }
+}
+
+
+/** time for next dithered refresh of bus? (lock must be held) */
+static bool spiDitherDue(struct priv *p, SpiBus * bus)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if(now.tv_sec < bus->next.tv_sec ||
+           (now.tv_sec == bus->next.tv_sec &&
+            now.tv_nsec < bus->next.tv_nsec))
+                return false;
+
+        /* keep rate, don't try to catch up when we're behind */
+        long period = 1000000000 / p->ditherRate;
+        spiTimeAdd(&bus->next, period);
+        if(now.tv_sec > bus->next.tv_sec ||
+           (now.tv_sec == bus->next.tv_sec &&
+            now.tv_nsec > bus->next.tv_nsec))
+        {
+                bus->next = now;
+                spiTimeAdd(&bus->next, period);
+        }
+
+        return true;
+}
+
+
+/** dither segment of bus from 16 bit source and encode it to txBuffer[0] */
+static void spiDither(struct priv *p, SpiBus * bus, const uint16_t * src)
+{
+        size_t first = bus->first * p->pixelLeds;
+        size_t n = bus->count * p->pixelLeds;
+
+        spi_dither(&p->encoder, bus->dither, src + first, p->err + first, n);
+        spi_encode(&p->encoder, bus->txBuffer[0] + bus->txStart, bus->dither,
+                   p->encoder.rgb ? bus->count : n);
+}
+
+
+/**
+ * write frames handed off by _show(). 16 bit chains are dithered and
+ * written continuously at dither rate instead.
+ */
+static void *spiWriter(void *arg)
+{
+        SpiBus *bus = arg;
+        struct priv *p = bus->p;
+
+        pthread_mutex_lock(&p->lock);
+
+        while(bus->writerRunning)
+        {
+                uint8_t *tx;
+                bool dithered = false;
+
+                if(p->encoder.dither && p->chainSize && !p->ditherHold)
+                {
+                        if(!spiDitherDue(p, bus))
+                        {
+                                pthread_cond_timedwait(&p->cond, &p->lock,
+                                                       &bus->next);
+                                continue;
+                        }
+
+                        /* txBuffer[0] is ours until txPending is cleared */
+                        bus->txPending = true;
+                        bus->dithering = true;
+                        const uint16_t *src = p->src[!p->back];
+
+                        pthread_mutex_unlock(&p->lock);
+                        spiDither(p, bus, src);
+                        pthread_mutex_lock(&p->lock);
+
+                        bus->dithering = false;
+                        pthread_cond_broadcast(&p->cond);
+
+                        tx = bus->txBuffer[0];
+                        dithered = true;
+                }
+                else if(bus->txPending)
+                {
+                        /* front buffer is ours until txPending is cleared */
+                        tx = bus->txBuffer[!p->back];
+                }
+                else
+                {
+                        pthread_cond_wait(&p->cond, &p->lock);
+                        continue;
+                }
+
+                size_t size = bus->txSize;
+                size_t latch = bus->latchSize;
+                bool single = p->singleIoctl && (p->buses == 1 || dithered);
+                unsigned int latch_us = p->encoder.chipset->latch_us;
+                struct spi_ioc_transfer tmpl;
+                spiTemplate(p, &tmpl);
+
+                pthread_mutex_unlock(&p->lock);
+
+                NftResult r;
+                if(single)
+                {
+                        r = spiTxFrame(bus->fd, p->spiBufsiz, &tmpl,
+                                       tx, size, tx + size, latch);
+                }
+                else
+                {
+                        r = spiTxFrame(bus->fd, p->spiBufsiz, &tmpl,
+                                       tx, size, NULL, 0);
+
+                        /* latch together with all other buses (dithered
+                         * refreshes of buses run independently) */
+                        if(!dithered)
+                        {
+                                pthread_mutex_lock(&p->lock);
+                                if(--p->latchWait == 0)
+                                        pthread_cond_broadcast(&p->cond);
+                                while(p->latchWait > 0)
+                                        pthread_cond_wait(&p->cond, &p->lock);
+                                pthread_mutex_unlock(&p->lock);
+                        }
+
+                        if(r)
+                                r = spiTxFrame(bus->fd, p->spiBufsiz, &tmpl,
+                                               NULL, 0, tx + size, latch);
+                }
+
+                /* some chipsets latch after the clock idled for a while */
+                if(latch_us)
+                {
+                        struct timespec t = {
+                                .tv_sec = latch_us / 1000000,
+                                .tv_nsec = (latch_us % 1000000) * 1000,
+                        };
+                        nanosleep(&t, NULL);
+                }
+
+                pthread_mutex_lock(&p->lock);
+
+                if(!r)
+                        bus->txResult = NFT_FAILURE;
+                bus->txPending = false;
+                pthread_cond_broadcast(&p->cond);
+        }
+
+        pthread_mutex_unlock(&p->lock);
+
+        return NULL;
+}
+
+
+/** any writer still busy with a frame? (lock must be held) */
+static bool spiWriterBusy(struct priv *p)
+{
+        int i;
+        for(i = 0; i < p->buses; i++)
+        {
+                if(p->bus[i].txPending)
+                        return true;
+        }
+
+        return false;
+}
+
+
+/** wait until no writer reads the front source buffer (lock must be held) */
+static void spiDitherWait(struct priv *p)
+{
+        int i;
+        for(i = 0; i < p->buses; i++)
+        {
+                while(p->bus[i].dithering)
+                        pthread_cond_wait(&p->cond, &p->lock);
+        }
+}
+
+
+/** wait until writer threads finished pending frame (lock must be held) */
+static void spiWriterWait(struct priv *p)
+{
+        /* dithering writers would start over right away */
+        p->ditherHold = true;
+        while(spiWriterBusy(p))
+                pthread_cond_wait(&p->cond, &p->lock);
+        p->ditherHold = false;
+        pthread_cond_broadcast(&p->cond);
+}
+
+
+/**
+ * split id into buses. Devices are separated by ",", each may be followed
+ * by ":<ledcount>" to give it a fixed amount of LEDs
+ */
+static NftResult spiBusParse(struct priv *p, const char *id)
+{
+        p->buses = 0;
+
+        const char *s = id;
+        while(*s)
+        {
+                size_t len = strcspn(s, ",");
+
+                if(p->buses >= SPI_BUSES_MAX)
+                {
+                        NFT_LOG(L_ERROR, "More than %d SPI devices in \"%s\"",
+                                SPI_BUSES_MAX, id);
+                        return NFT_FAILURE;
+                }
+
+                SpiBus *bus = &p->bus[p->buses];
+                memset(bus, 0, sizeof(SpiBus));
+                bus->p = p;
+                bus->fd = -1;
+
+                /* path[:ledcount] */
+                size_t plen = strcspn(s, ":,");
+                if(plen == 0 || plen >= sizeof(bus->path))
+                {
+                        NFT_LOG(L_ERROR, "Invalid SPI device in \"%s\"", id);
+                        return NFT_FAILURE;
+                }
+                memcpy(bus->path, s, plen);
+                bus->path[plen] = '\0';
+
+                if(plen < len)
+                {
+                        char *end;
+                        long n = strtol(s + plen + 1, &end, 10);
+                        if(end != s + len || n <= 0)
+                        {
+                                NFT_LOG(L_ERROR,
+                                        "Invalid ledcount for \"%s\" in \"%s\"",
+                                        bus->path, id);
+                                return NFT_FAILURE;
+                        }
+                        bus->requested = (LedCount) n;
+                }
+
+                p->buses++;
+
+                s += len;
+                if(*s == ',')
+                        s++;
+        }
+
+        if(p->buses == 0)
+        {
+                NFT_LOG(L_ERROR, "No SPI device in \"%s\"", id);
+                return NFT_FAILURE;
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * assign contiguous segments of chain to buses. Buses without fixed
+ * ledcount share the remaining pixels evenly.
+ */
+static NftResult spiBusSegments(struct priv *p, LedCount pixels)
+{
+        LedCount fixed = 0;
+        int shared = 0;
+
+        int i;
+        for(i = 0; i < p->buses; i++)
+        {
+                LedCount requested = p->bus[i].requested;
+                if(requested % p->pixelLeds != 0)
+                {
+                        NFT_LOG(L_ERROR,
+                                "%d LEDs of \"%s\" are no whole pixels (%zu LEDs each)",
+                                requested, p->bus[i].path, p->pixelLeds);
+                        return NFT_FAILURE;
+                }
+
+                if(requested)
+                        fixed += requested / p->pixelLeds;
+                else
+                        shared++;
+        }
+
+        if(fixed > pixels || (shared == 0 && fixed != pixels))
+        {
+                NFT_LOG(L_ERROR,
+                        "LEDs assigned to SPI devices (%zu) don't match chain (%zu LEDs)",
+                        fixed * p->pixelLeds, pixels * p->pixelLeds);
+                return NFT_FAILURE;
+        }
+
+        LedCount first = 0;
+        int s = 0;
+        for(i = 0; i < p->buses; i++)
+        {
+                SpiBus *bus = &p->bus[i];
+
+                if(bus->requested)
+                {
+                        bus->count = bus->requested / p->pixelLeds;
+                }
+                else
+                {
+                        LedCount rest = pixels - fixed;
+                        bus->count = rest * (s + 1) / shared -
+                                rest * s / shared;
+                        s++;
+                }
+
+                bus->first = first;
+                first += bus->count;
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * open spidev device and lock it, so other hardwares (even in other
+ * processes) skip it. Returns -1 with errno EWOULDBLOCK if it's busy.
+ */
+static int spiDeviceClaim(const char *path)
+{
+        int fd;
+        if((fd = open(path, O_RDWR)) == -1)
+                return -1;
+
+        if(flock(fd, LOCK_EX | LOCK_NB) != 0)
+        {
+                int e = errno;
+                close(fd);
+                errno = e;
+                return -1;
+        }
+
+        return fd;
+}
+
+
+/**
+ * find cache line ("<name>\t<device>") of name and return its device,
+ * or if device is given, find line of device and return its name
+ */
+static const char *spiCacheGet(const char *cache, const char *name,
+                               const char *device)
+{
+        const char *line = cache;
+        while(*line)
+        {
+                size_t len = strcspn(line, "\n");
+                const char *tab = memchr(line, '\t', len);
+
+                if(tab && device)
+                {
+                        size_t dlen = len - (tab + 1 - line);
+                        if(strlen(device) == dlen &&
+                           strncmp(tab + 1, device, dlen) == 0)
+                                return line;
+                }
+                else if(tab && (size_t) (tab - line) == strlen(name) &&
+                        strncmp(line, name, tab - line) == 0)
+                {
+                        return tab + 1;
+                }
+
+                line += len + (line[len] == '\n');
+        }
+
+        return NULL;
+}
+
+
+/**
+ * pick device for id "*". Tries the device this hardware got last time
+ * first, then devices no other hardware was assigned to, then the rest.
+ * Busy devices are skipped. The cache file is locked meanwhile, so
+ * hardwares initialized concurrently get different devices.
+ *
+ * @param path is set to the device picked
+ * @result locked fd of device or -1
+ */
+static int spiAutodetect(struct priv *p, char *path, size_t size)
+{
+        const char *name = led_hardware_get_name(p->hw);
+        const char *cachePath = getenv(SPI_CACHE_ENV);
+        if(!cachePath)
+                cachePath = SPI_CACHE_PATH;
+
+        /* read cache */
+        char cache[SPI_CACHE_MAX];
+        ssize_t len = 0;
+        int cfd;
+        if((cfd = open(cachePath, O_RDWR | O_CREAT, 0644)) == -1 ||
+           flock(cfd, LOCK_EX) != 0 ||
+           (len = read(cfd, cache, sizeof(cache) - 1)) < 0)
+        {
+                NFT_LOG(L_WARNING, "Can't use device cache \"%s\"",
+                        cachePath);
+                NFT_LOG_PERROR("open()");
+                len = 0;
+        }
+        cache[len] = '\0';
+
+        glob_t g;
+        if(glob(SPI_DEVICE_GLOB, 0, NULL, &g) != 0)
+                g.gl_pathc = 0;
+
+        /* mine first, then unassigned, then assigned to other hardware */
+        const char *mine = name ? spiCacheGet(cache, name, NULL) : NULL;
+        size_t mlen = mine ? strcspn(mine, "\n") : 0;
+
+        int fd = -1, rank;
+        size_t i;
+        for(rank = 0; rank < 3 && fd == -1; rank++)
+        {
+                for(i = 0; i < g.gl_pathc && fd == -1; i++)
+                {
+                        const char *dev = g.gl_pathv[i];
+                        bool isMine = mine && strlen(dev) == mlen &&
+                                strncmp(dev, mine, mlen) == 0;
+                        int r = isMine ? 0 :
+                                spiCacheGet(cache, NULL, dev) ? 2 : 1;
+
+                        if(r != rank || strlen(dev) >= size)
+                                continue;
+
+                        if((fd = spiDeviceClaim(dev)) != -1)
+                                strcpy(path, dev);
+                        else if(errno == EWOULDBLOCK)
+                                NFT_LOG(L_DEBUG, "Skipping busy \"%s\"",
+                                        dev);
+                }
+        }
+
+        globfree(&g);
+
+        /* remember assignment, dropping old lines of name & device */
+        if(fd != -1 && name && cfd != -1)
+        {
+                char *line = cache, *out = cache, *end = cache + len;
+                while(line < end)
+                {
+                        size_t l = strcspn(line, "\n");
+                        bool nl = line[l] == '\n';
+                        char *tab = memchr(line, '\t', l);
+
+                        bool drop = !tab ||
+                                ((size_t) (tab - line) == strlen(name) &&
+                                 strncmp(line, name, tab - line) == 0) ||
+                                (strlen(path) == (size_t) (line + l - tab - 1)
+                                 && strncmp(tab + 1, path,
+                                            line + l - tab - 1) == 0);
+                        if(!drop)
+                        {
+                                memmove(out, line, l);
+                                out += l;
+                                *out++ = '\n';
+                        }
+
+                        line += l + nl;
+                }
 
-};
+                int n = snprintf(out, sizeof(cache) - (out - cache),
+                                 "%s\t%s\n", name, path);
+                size_t total = out - cache;
+                if(n > 0 && (size_t) n < sizeof(cache) - total)
+                        total += n;
 
+                if(lseek(cfd, 0, SEEK_SET) != 0 ||
+                   ftruncate(cfd, 0) != 0 ||
+                   write(cfd, cache, total) != (ssize_t) total)
+                {
+                        NFT_LOG(L_WARNING, "Failed to write \"%s\"",
+                                cachePath);
+                }
+        }
 
+        if(cfd != -1)
+                close(cfd);
 
+        return fd;
+}
 
-/** send/receive SPI data */
-NftResult spiTxData(int fd, uint8_t * tx, uint32_t len)
-{
-        /* SPI transfer descriptor */
-        struct spi_ioc_transfer tr;
 
-        /* zero initialize */
-        memset(&tr, 0, sizeof(struct spi_ioc_transfer));
+/** open spidev device and configure it */
+static NftResult spiBusOpen(struct priv *p, SpiBus * bus)
+{
+        /* autodetected devices are open already */
+        if(bus->fd == -1 && (bus->fd = spiDeviceClaim(bus->path)) == -1)
+        {
+                if(errno == EWOULDBLOCK)
+                {
+                        NFT_LOG(L_ERROR,
+                                "\"%s\" is used by another hardware",
+                                bus->path);
+                        return NFT_FAILURE;
+                }
 
-        tr.tx_buf = (unsigned long) tx;
-        tr.len = len;
-        tr.cs_change = false;
+                NFT_LOG(L_ERROR, "Failed to open port \"%s\"", bus->path);
+                NFT_LOG_PERROR("open()");
+                return NFT_FAILURE;
+        }
 
-        if(ioctl(fd, SPI_IOC_MESSAGE(1), &tr) < 1)
+        /* Set SPI parameters */
+        if(ioctl(bus->fd, SPI_IOC_WR_MODE, &p->spiMode) < 0 ||
+           ioctl(bus->fd, SPI_IOC_RD_MODE, &p->spiMode) < 0 ||
+           ioctl(bus->fd, SPI_IOC_WR_BITS_PER_WORD, &p->spiBPW) < 0 ||
+           ioctl(bus->fd, SPI_IOC_RD_BITS_PER_WORD, &p->spiBPW) < 0 ||
+           ioctl(bus->fd, SPI_IOC_WR_MAX_SPEED_HZ, &p->spiSpeed) < 0 ||
+           ioctl(bus->fd, SPI_IOC_RD_MAX_SPEED_HZ, &p->spiSpeed) < 0)
         {
-                NFT_LOG_PERROR("Failed to send SPI message:");
+                NFT_LOG(L_ERROR, "Failed to configure \"%s\"", bus->path);
+                NFT_LOG_PERROR("ioctl()");
+                close(bus->fd);
+                bus->fd = -1;
                 return NFT_FAILURE;
         }
 
@@ -102,6 +1075,47 @@ NftResult spiTxData(int fd, uint8_t * tx, uint32_t len)
 }
 
 
+/** stop writers, close devices and free buffers of all buses */
+static void spiBusCloseAll(struct priv *p)
+{
+        /* let writers finish last frame and stop them */
+        pthread_mutex_lock(&p->lock);
+        spiWriterWait(p);
+
+        bool running[SPI_BUSES_MAX];
+        int i;
+        for(i = 0; i < p->buses; i++)
+        {
+                running[i] = p->bus[i].writerRunning;
+                p->bus[i].writerRunning = false;
+        }
+        p->running = false;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+
+        for(i = 0; i < p->buses; i++)
+        {
+                SpiBus *bus = &p->bus[i];
+
+                if(running[i])
+                        pthread_join(bus->writer, NULL);
+
+                if(bus->fd != -1)
+                        close(bus->fd);
+                bus->fd = -1;
+
+                free(bus->txBuffer[0]);
+                free(bus->txBuffer[1]);
+                free(bus->dither);
+                bus->txBuffer[0] = bus->txBuffer[1] = NULL;
+                bus->dither = NULL;
+        }
+
+        p->buses = 0;
+        p->chainSize = 0;
+}
+
+
 /******************************************************************************/
 
 /**
@@ -140,10 +1154,28 @@ static NftResult _init(void **privdata, LedHardware * h)
 
         /* defaults */
         p->ledcount = 0;
+        p->pixelLeds = 1;
         p->spiMode = SPI_MODE_0;
         p->spiBPW = 8;
         p->spiDelay = 0;
         p->spiSpeed = 500000;
+        p->spiBufsiz = SPI_BUFSIZ_DEFAULT;
+        p->queuePolicy = QUEUE_BLOCK;
+        pthread_mutex_init(&p->lock, NULL);
+        p->ditherRate = DITHER_RATE_DEFAULT;
+        p->refreshInterval = REFRESH_INTERVAL_DEFAULT;
+
+        /* writers wait with timeout for dithered refresh */
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&p->cond, &attr);
+        pthread_condattr_destroy(&attr);
+        p->singleIoctl = true;
+        p->gamma = 1.0;
+        p->scale = 1.0;
+        p->chipset = spi_chipset_find("lpd8806");
+        spi_encoder_init(&p->encoder, p->chipset, "RGB u8");
 
         /* 
          * register some dynamic properties for this plugin - those will be
@@ -155,6 +1187,33 @@ static NftResult _init(void **privdata, LedHardware * h)
         if(!led_hardware_plugin_prop_register
            (h, "spi_delay", LED_HW_CUSTOM_PROP_INT))
                 return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "chipset", LED_HW_CUSTOM_PROP_STRING))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "gamma", LED_HW_CUSTOM_PROP_FLOAT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "scale", LED_HW_CUSTOM_PROP_FLOAT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "single_ioctl", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "queue_policy", LED_HW_CUSTOM_PROP_STRING))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "dropped_frames", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "spi_probe", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "dither_rate", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "refresh_interval", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
 
 
         return NFT_SUCCESS;
@@ -178,6 +1237,26 @@ static void _deinit(void *privdata)
         /* unregister or settings-handlers */
         led_hardware_plugin_prop_unregister(p->hw, "spi_speed");
         led_hardware_plugin_prop_unregister(p->hw, "spi_delay");
+        led_hardware_plugin_prop_unregister(p->hw, "chipset");
+        led_hardware_plugin_prop_unregister(p->hw, "gamma");
+        led_hardware_plugin_prop_unregister(p->hw, "scale");
+        led_hardware_plugin_prop_unregister(p->hw, "single_ioctl");
+        led_hardware_plugin_prop_unregister(p->hw, "queue_policy");
+        led_hardware_plugin_prop_unregister(p->hw, "dropped_frames");
+        led_hardware_plugin_prop_unregister(p->hw, "spi_probe");
+        led_hardware_plugin_prop_unregister(p->hw, "dither_rate");
+        led_hardware_plugin_prop_unregister(p->hw, "refresh_interval");
+
+        /* free gain & dither buffers */
+        free(p->gain);
+        free(p->src[0]);
+        free(p->src[1]);
+        free(p->err);
+        free(p->shadow);
+        free(p->stale);
+
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
 
         /* free structure we allocated in _init() */
         free(privdata);
@@ -204,10 +1283,10 @@ static NftResult _spi_init(void *privdata, const char *id)
         int components_per_pixel = led_pixel_format_get_n_components(format);
         int bytes_per_component = bytes_per_pixel / components_per_pixel;
 
-        if(bytes_per_component != 1)
+        if(bytes_per_component != 1 && bytes_per_component != 2)
         {
                 NFT_LOG(L_ERROR,
-                        "We need a format with 8 bits per pixel-component. Format %s has %d bytes-per-pixel and %d components-per-pixel.",
+                        "We need a format with 8 or 16 bits per pixel-component. Format %s has %d bytes-per-pixel and %d components-per-pixel.",
                         fmtstring, bytes_per_pixel, components_per_pixel);
                 return NFT_FAILURE;
         }
@@ -215,15 +1294,50 @@ static NftResult _spi_init(void *privdata, const char *id)
 
         NFT_LOG(L_DEBUG, "Using \"%s\" as pixel-format", fmtstring);
 
+        /* setup wire encoding */
+        if(!spi_encoder_init(&p->encoder, p->chipset, fmtstring))
+        {
+                NFT_LOG(L_ERROR,
+                        "Chipset \"%s\" can't handle format \"%s\" (16 bit formats need per-LED brightness, 4 byte chipsets need RGB)",
+                        p->chipset->name, fmtstring);
+                return NFT_FAILURE;
+        }
+        if(p->encoder.hdr)
+                NFT_LOG(L_INFO,
+                        "Mapping 16 bit values to brightness & PWM (gamma is not applied)");
+        if(p->encoder.dither)
+                NFT_LOG(L_INFO,
+                        "Dithering 16 bit values at %u Hz (gamma & scale are not applied)",
+                        p->ditherRate);
+        if(!p->encoder.rgb)
+                NFT_LOG(L_WARNING,
+                        "\"%s\" is no RGB format. Sending components in chain order.",
+                        fmtstring);
+        spi_encoder_set_lut(&p->encoder, p->gamma, p->scale);
+        strncpy(p->format, fmtstring, sizeof(p->format) - 1);
+
+        /* RGB pixels are encoded as a whole, raw values one by one */
+        p->pixelLeds = p->encoder.rgb ? (size_t) components_per_pixel : 1;
+        p->chainSize = 0;
+        p->txValid = false;
+
 
         /* 
-         * check if id = "*" in this case we should try to automagically find our device,
-         * we'll just use a default in this case 
-         * @todo cycle through all devices 
+         * check if id = "*" in this case we should try to automagically
+         * find our device: first free spidev, the same as last time if
+         * possible
          */
+        int autofd = -1;
         if(strcmp(id, "*") == 0)
         {
-                strncpy(p->id, "/dev/spidev0.0", sizeof(p->id));
+                if((autofd = spiAutodetect(p, p->id, sizeof(p->id))) == -1)
+                {
+                        NFT_LOG(L_ERROR, "No free SPI device found (%s)",
+                                SPI_DEVICE_GLOB);
+                        return NFT_FAILURE;
+                }
+
+                NFT_LOG(L_INFO, "Using \"%s\"", p->id);
         }
         else
         {
@@ -231,37 +1345,67 @@ static NftResult _spi_init(void *privdata, const char *id)
                 strncpy(p->id, id, sizeof(p->id));
         }
 
-        /* open SPI port */
-        if((p->fd = open(p->id, O_RDWR)) == -1)
+        /* one bus per device in id */
+        if(!spiBusParse(p, p->id))
         {
-                NFT_LOG(L_ERROR, "Failed to open port \"%s\"", p->id);
-                NFT_LOG_PERROR("open()");
+                if(autofd != -1)
+                        close(autofd);
                 return NFT_FAILURE;
         }
+        p->bus[0].fd = autofd;
 
+        /* open SPI ports */
+        int i;
+        for(i = 0; i < p->buses; i++)
+        {
+                if(!spiBusOpen(p, &p->bus[i]))
+                {
+                        spiBusCloseAll(p);
+                        return NFT_FAILURE;
+                }
+        }
 
-        /* Set SPI parameters */
-        if(ioctl(p->fd, SPI_IOC_WR_MODE, &p->spiMode) < 0)
-                return NFT_FAILURE;
-
-        if(ioctl(p->fd, SPI_IOC_RD_MODE, &p->spiMode) < 0)
-                return NFT_FAILURE;
-
-        if(ioctl(p->fd, SPI_IOC_WR_BITS_PER_WORD, &p->spiBPW) < 0)
-                return NFT_FAILURE;
+        /* transfers per ioctl are limited by the driver */
+        p->spiBufsiz = spiBufsiz();
 
-        if(ioctl(p->fd, SPI_IOC_RD_BITS_PER_WORD, &p->spiBPW) < 0)
-                return NFT_FAILURE;
+        /* find highest stable clock? */
+        if(p->probeMax)
+        {
+                pthread_mutex_lock(&p->lock);
+                NftResult r = spiProbeApply(p);
+                pthread_mutex_unlock(&p->lock);
 
-        if(ioctl(p->fd, SPI_IOC_WR_MAX_SPEED_HZ, &p->spiSpeed) < 0)
-                return NFT_FAILURE;
+                if(!r)
+                {
+                        spiBusCloseAll(p);
+                        return NFT_FAILURE;
+                }
+        }
 
-        if(ioctl(p->fd, SPI_IOC_RD_MAX_SPEED_HZ, &p->spiSpeed) < 0)
-                return NFT_FAILURE;
+        /* start writer threads */
+        p->latchWait = 0;
+        for(i = 0; i < p->buses; i++)
+        {
+                SpiBus *bus = &p->bus[i];
+                bus->writerRunning = true;
+                bus->txPending = false;
+                bus->txResult = NFT_SUCCESS;
+                if(pthread_create(&bus->writer, NULL, spiWriter, bus) != 0)
+                {
+                        NFT_LOG(L_ERROR,
+                                "Failed to start SPI writer thread for \"%s\"",
+                                bus->path);
+                        bus->writerRunning = false;
+                        spiBusCloseAll(p);
+                        return NFT_FAILURE;
+                }
+        }
+        p->running = true;
 
         NFT_LOG(L_DEBUG,
-                "SPI \"%d\" initialized (mode: %d, bits-per-word: %d, speed-hz: %d)",
-                p->spiMode, p->spiBPW, p->spiSpeed);
+                "SPI \"%s\" initialized (devices: %d, mode: %d, bits-per-word: %d, speed-hz: %d, bufsiz: %zu)",
+                p->id, p->buses, p->spiMode, p->spiBPW, p->spiSpeed,
+                p->spiBufsiz);
 
         return NFT_SUCCESS;
 }
@@ -276,10 +1420,7 @@ static void _spi_deinit(void *privdata)
 
         struct priv *p = privdata;
 
-        close(p->fd);
-
-        /* free buffer */
-        // free(p->txBuffer);
+        spiBusCloseAll(p);
 }
 
 
@@ -320,8 +1461,14 @@ NftResult _get_handler(void *privdata, LedPluginParam o,
                                 "Getting gain of LED %d from LDP8806 hardware (%s)",
                                 data->gain.pos, p->id);
 
-                        /* @todo */
-                        data->gain.value = 0;
+                        /* LEDs never set have full gain, components share
+                           the brightness of their pixel */
+                        LedCount pixel = data->gain.pos / p->pixelLeds;
+                        if(pixel < p->gainCount)
+                                data->gain.value = (LedGain)
+                                        (p->gain[pixel] * LED_GAIN_MAX / 31);
+                        else
+                                data->gain.value = LED_GAIN_MAX;
                         return NFT_SUCCESS;
                 }
 
@@ -344,6 +1491,70 @@ NftResult _get_handler(void *privdata, LedPluginParam o,
                                 data->custom.valuesize = sizeof(uint16_t);
                                 return NFT_SUCCESS;
                         }
+                        else if(strcmp(data->custom.name, "chipset") == 0)
+                        {
+                                data->custom.value.s =
+                                        (char *) p->chipset->name;
+                                data->custom.valuesize =
+                                        strlen(data->custom.value.s) + 1;
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "gamma") == 0)
+                        {
+                                data->custom.value.f = p->gamma;
+                                data->custom.valuesize = sizeof(float);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "scale") == 0)
+                        {
+                                data->custom.value.f = p->scale;
+                                data->custom.valuesize = sizeof(float);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "single_ioctl") == 0)
+                        {
+                                data->custom.value.i = p->singleIoctl;
+                                data->custom.valuesize = sizeof(int);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "queue_policy") == 0)
+                        {
+                                data->custom.value.s =
+                                        (char *) (p->queuePolicy ==
+                                                  QUEUE_DROP ? "drop" :
+                                                  "block");
+                                data->custom.valuesize =
+                                        strlen(data->custom.value.s) + 1;
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "dropped_frames") ==
+                                0)
+                        {
+                                pthread_mutex_lock(&p->lock);
+                                data->custom.value.i = (int) p->droppedFrames;
+                                pthread_mutex_unlock(&p->lock);
+                                data->custom.valuesize = sizeof(int);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "spi_probe") == 0)
+                        {
+                                data->custom.value.i = (int) p->probeMax;
+                                data->custom.valuesize = sizeof(int);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "dither_rate") == 0)
+                        {
+                                data->custom.value.i = (int) p->ditherRate;
+                                data->custom.valuesize = sizeof(int);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "refresh_interval")
+                                == 0)
+                        {
+                                data->custom.value.i = (int) p->refreshInterval;
+                                data->custom.valuesize = sizeof(int);
+                                return NFT_SUCCESS;
+                        }
                         else
                         {
                                 NFT_LOG(L_ERROR,
@@ -386,21 +1597,24 @@ NftResult _set_handler(void *privdata, LedPluginParam o,
 
                 case LED_HW_LEDCOUNT:
                 {
-                        /* resize buffer */
-                        /* if(!(p->txBuffer = realloc(p->txBuffer,
-                         * data->ledcount))) { NFT_LOG_PERROR("realloc");
-                         * return NFT_FAILURE; } */
+                        /* txBuffer is resized upon next _send() */
+                        p->txValid = false;
 
                         /* save ledcount */
                         p->ledcount = data->ledcount;
 
+                        /* keep gains of remaining pixels */
+                        if(p->gain)
+                                return spiGainResize(p, p->ledcount /
+                                                     p->pixelLeds);
+
                         return NFT_SUCCESS;
                 }
 
                 case LED_HW_GAIN:
                 {
-                        NFT_TODO();
-                        return NFT_SUCCESS;
+                        return spiSetGain(p, data->gain.pos,
+                                          data->gain.value);
                 }
 
                         /* handle dynamic custom properties - we can read out
@@ -410,8 +1624,10 @@ NftResult _set_handler(void *privdata, LedPluginParam o,
                 {
                         if(strcmp(data->custom.name, "spi_speed") == 0)
                         {
-                                /* set new value */
+                                /* set new value (used from next transfer) */
+                                pthread_mutex_lock(&p->lock);
                                 p->spiSpeed = (uint32_t) data->custom.value.i;
+                                pthread_mutex_unlock(&p->lock);
 
                                 NFT_LOG(L_DEBUG,
                                         "Setting \"spi_speed\" of \"%s\" to %u",
@@ -420,13 +1636,219 @@ NftResult _set_handler(void *privdata, LedPluginParam o,
                         }
                         else if(strcmp(data->custom.name, "spi_delay") == 0)
                         {
-                                /* set new value */
+                                /* set new value (used from next transfer) */
+                                pthread_mutex_lock(&p->lock);
                                 p->spiDelay = (uint16_t) data->custom.value.i;
+                                pthread_mutex_unlock(&p->lock);
                                 NFT_LOG(L_DEBUG,
                                         "Setting \"spi_delay\" of \"%s\" to %hu",
                                         p->id, p->spiDelay);
                                 return NFT_SUCCESS;
                         }
+                        else if(strcmp(data->custom.name, "chipset") == 0)
+                        {
+                                const SpiChipset *c;
+                                if(!(c = spi_chipset_find(data->custom.value.s)))
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "Unknown chipset \"%s\"",
+                                                data->custom.value.s);
+                                        return NFT_FAILURE;
+                                }
+
+                                /* check format if hardware is initialized */
+                                SpiEncoder e;
+                                if(p->format[0] &&
+                                   !spi_encoder_init(&e, c, p->format))
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "Chipset \"%s\" can't handle format \"%s\"",
+                                                c->name, p->format);
+                                        return NFT_FAILURE;
+                                }
+
+                                /* writer must be idle, new frame layout is
+                                 * set up upon next _send() */
+                                pthread_mutex_lock(&p->lock);
+                                spiWriterWait(p);
+                                p->chipset = c;
+                                spi_encoder_init(&p->encoder, c,
+                                                 p->format[0] ? p->format :
+                                                 "RGB u8");
+                                spi_encoder_set_lut(&p->encoder, p->gamma,
+                                                    p->scale);
+                                p->chainSize = 0;
+                                p->txValid = false;
+
+                                int i;
+                                for(i = 0; i < p->buses; i++)
+                                        p->bus[i].txSize =
+                                                p->bus[i].latchSize = 0;
+                                pthread_mutex_unlock(&p->lock);
+
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"chipset\" of \"%s\" to \"%s\"",
+                                        p->id, c->name);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "gamma") == 0)
+                        {
+                                if(data->custom.value.f <= 0)
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "\"gamma\" must be > 0 (not %f)",
+                                                data->custom.value.f);
+                                        return NFT_FAILURE;
+                                }
+
+                                /* dithering writers encode with the
+                                 * tables */
+                                pthread_mutex_lock(&p->lock);
+                                spiDitherWait(p);
+                                p->gamma = data->custom.value.f;
+                                spi_encoder_set_lut(&p->encoder, p->gamma,
+                                                    p->scale);
+                                p->txValid = false;
+                                pthread_mutex_unlock(&p->lock);
+
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"gamma\" of \"%s\" to %f",
+                                        p->id, p->gamma);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "scale") == 0)
+                        {
+                                if(data->custom.value.f < 0 ||
+                                   data->custom.value.f > 1)
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "\"scale\" must be 0.0 - 1.0 (not %f)",
+                                                data->custom.value.f);
+                                        return NFT_FAILURE;
+                                }
+
+                                /* dithering writers encode with the
+                                 * tables */
+                                pthread_mutex_lock(&p->lock);
+                                spiDitherWait(p);
+                                p->scale = data->custom.value.f;
+                                spi_encoder_set_lut(&p->encoder, p->gamma,
+                                                    p->scale);
+                                p->txValid = false;
+                                pthread_mutex_unlock(&p->lock);
+
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"scale\" of \"%s\" to %f",
+                                        p->id, p->scale);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "single_ioctl") == 0)
+                        {
+                                p->singleIoctl = (data->custom.value.i != 0);
+
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"single_ioctl\" of \"%s\" to %d",
+                                        p->id, p->singleIoctl);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "queue_policy") == 0)
+                        {
+                                QueuePolicy policy;
+                                if(strcmp(data->custom.value.s, "block") == 0)
+                                        policy = QUEUE_BLOCK;
+                                else if(strcmp(data->custom.value.s, "drop") ==
+                                        0)
+                                        policy = QUEUE_DROP;
+                                else
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "\"queue_policy\" must be \"block\" or \"drop\" (not \"%s\")",
+                                                data->custom.value.s);
+                                        return NFT_FAILURE;
+                                }
+
+                                pthread_mutex_lock(&p->lock);
+                                p->queuePolicy = policy;
+                                pthread_mutex_unlock(&p->lock);
+
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"queue_policy\" of \"%s\" to \"%s\"",
+                                        p->id, data->custom.value.s);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "dropped_frames") ==
+                                0)
+                        {
+                                NFT_LOG(L_WARNING,
+                                        "\"dropped_frames\" is read-only");
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "refresh_interval")
+                                == 0)
+                        {
+                                if(data->custom.value.i < 0)
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "\"refresh_interval\" must be >= 0 ms (not %d)",
+                                                data->custom.value.i);
+                                        return NFT_FAILURE;
+                                }
+
+                                p->refreshInterval = data->custom.value.i;
+
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"refresh_interval\" of \"%s\" to %u",
+                                        p->id, p->refreshInterval);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "dither_rate") == 0)
+                        {
+                                if(data->custom.value.i < 1 ||
+                                   data->custom.value.i > 100000)
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "\"dither_rate\" must be 1 - 100000 Hz (not %d)",
+                                                data->custom.value.i);
+                                        return NFT_FAILURE;
+                                }
+
+                                pthread_mutex_lock(&p->lock);
+                                p->ditherRate = data->custom.value.i;
+                                pthread_cond_broadcast(&p->cond);
+                                pthread_mutex_unlock(&p->lock);
+
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"dither_rate\" of \"%s\" to %u",
+                                        p->id, p->ditherRate);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "spi_probe") == 0)
+                        {
+                                if(data->custom.value.i < 0)
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "\"spi_probe\" must be >= 0 (not %d)",
+                                                data->custom.value.i);
+                                        return NFT_FAILURE;
+                                }
+
+                                p->probeMax = (uint32_t) data->custom.value.i;
+
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"spi_probe\" of \"%s\" to %u",
+                                        p->id, p->probeMax);
+
+                                /* probe now if hardware is initialized */
+                                if(!p->probeMax || !p->running)
+                                        return NFT_SUCCESS;
+
+                                pthread_mutex_lock(&p->lock);
+                                spiWriterWait(p);
+                                NftResult r = spiProbeApply(p);
+                                pthread_mutex_unlock(&p->lock);
+
+                                return r;
+                        }
                         else
                         {
                                 NFT_LOG(L_ERROR,
@@ -446,6 +1868,62 @@ NftResult _set_handler(void *privdata, LedPluginParam o,
 }
 
 
+/**
+ * encode pixels [start, end) of shadow copy into buffer b of all buses
+ * (dithered output: copy them to 16 bit source b)
+ */
+static void spiEncodeRange(struct priv *p, int b, LedCount start,
+                           LedCount end)
+{
+        const uint8_t *buf = p->shadow;
+        size_t bytes_per_pixel = p->pixelBytes;
+
+        if(p->encoder.dither)
+        {
+                memcpy(p->src[b] + start * p->pixelLeds,
+                       buf + start * bytes_per_pixel,
+                       (end - start) * bytes_per_pixel);
+                return;
+        }
+
+        size_t wire_per_pixel = p->encoder.rgb ?
+                p->encoder.chipset->bytes_per_pixel : 1;
+
+        /* encode part of range on every bus */
+        int i;
+        for(i = 0; i < p->buses; i++)
+        {
+                SpiBus *bus = &p->bus[i];
+
+                LedCount s = start > bus->first ? start : bus->first;
+                LedCount e = end < bus->first + bus->count ?
+                        end : bus->first + bus->count;
+                if(s >= e)
+                        continue;
+
+                size_t n = e - s;
+                uint8_t *out = bus->txBuffer[b] + bus->txStart +
+                        (s - bus->first) * wire_per_pixel;
+                const uint8_t *in = buf + s * bytes_per_pixel;
+                const uint8_t *gain = p->gain && p->gainCount == p->pixels ?
+                        p->gain + s : NULL;
+
+                if(p->encoder.hdr)
+                {
+                        spi_encode_hdr(&p->encoder, out,
+                                       (const uint16_t *) in, gain, n);
+                }
+                else
+                {
+                        spi_encode(&p->encoder, out, in, n);
+                        if(gain)
+                                spi_encode_brightness(&p->encoder, out, gain,
+                                                      n);
+                }
+        }
+}
+
+
 /**
  * send data in chain to hardware (only use this if hardware doesn't show data right after
  * data is received to avoid blanking. If the data is shown immediately, you have
@@ -457,14 +1935,193 @@ NftResult _send(void *privdata, LedChain * c, LedCount count, LedCount offset)
 
         struct priv *p = privdata;
         uint8_t *buf = led_chain_get_buffer(c);
+        size_t size = led_chain_get_buffer_size(c);
+        LedCount ledcount = led_chain_get_ledcount(c);
+
+        if(ledcount == 0)
+                return NFT_SUCCESS;
+
+        /* clip range */
+        if(offset >= ledcount)
+                return NFT_SUCCESS;
+        if(count == 0 || count > ledcount - offset)
+                count = ledcount - offset;
+
+        /* ledcount counts components: RGB pixels are encoded in one go,
+           raw values one by one */
+        const SpiChipset *chip = p->encoder.chipset;
+        size_t bytes_per_led = size / ledcount;
+        size_t bytes_per_pixel = bytes_per_led * p->pixelLeds;
+        LedCount pixels = ledcount / p->pixelLeds;
+        size_t wire_per_pixel = p->encoder.rgb ? chip->bytes_per_pixel : 1;
+
+        /* (re)allocate buffers if chain changed */
+        if(size != p->chainSize)
+        {
+                /* writers must not use front buffers meanwhile */
+                pthread_mutex_lock(&p->lock);
+                spiWriterWait(p);
+
+                if(!spiBusSegments(p, pixels))
+                {
+                        pthread_mutex_unlock(&p->lock);
+                        return NFT_FAILURE;
+                }
+
+                int i;
+                for(i = 0; i < p->buses; i++)
+                {
+                        SpiBus *bus = &p->bus[i];
+
+                        /* frame: start, pixels, end */
+                        size_t head = bus->count ?
+                                chip->start(NULL, bus->count) : 0;
+                        size_t data = bus->count * wire_per_pixel;
+                        size_t tail = bus->count ?
+                                chip->end(NULL, bus->count) : 0;
+
+                        /* (one spare byte, so empty segments get a buffer) */
+                        int k;
+                        for(k = 0; k < 2; k++)
+                        {
+                                uint8_t *tx;
+                                if(!(tx = realloc(bus->txBuffer[k],
+                                                  head + data + tail + 1)))
+                                {
+                                        NFT_LOG_PERROR("realloc");
+                                        p->chainSize = 0;
+                                        pthread_mutex_unlock(&p->lock);
+                                        return NFT_FAILURE;
+                                }
+                                if(head)
+                                        chip->start(tx, bus->count);
+                                if(tail)
+                                        chip->end(tx + head + data,
+                                                  bus->count);
+                                bus->txBuffer[k] = tx;
+                        }
 
-        /* seek to offset */
-        int bytes_per_component =
-                led_chain_get_buffer_size(c) / led_chain_get_ledcount(c);
-        buf += offset * bytes_per_component;
+                        bus->txStart = head;
+                        bus->txSize = head + data;
+                        bus->latchSize = tail;
 
-        /* send buffer */
-        return spiTxData(p->fd, buf, bytes_per_component * count);
+                        /* dithered segment before encoding */
+                        if(p->encoder.dither)
+                        {
+                                uint8_t *d;
+                                if(!(d = realloc(bus->dither,
+                                                 bus->count * p->pixelLeds +
+                                                 1)))
+                                {
+                                        NFT_LOG_PERROR("realloc");
+                                        p->chainSize = 0;
+                                        pthread_mutex_unlock(&p->lock);
+                                        return NFT_FAILURE;
+                                }
+                                bus->dither = d;
+                        }
+                }
+
+                /* 16 bit copies of chain & dither error */
+                if(p->encoder.dither)
+                {
+                        size_t n = pixels * p->pixelLeds;
+
+                        free(p->src[0]);
+                        free(p->src[1]);
+                        free(p->err);
+                        p->src[0] = calloc(n + 1, sizeof(uint16_t));
+                        p->src[1] = calloc(n + 1, sizeof(uint16_t));
+                        p->err = calloc(n + 1, sizeof(uint16_t));
+                        if(!p->src[0] || !p->src[1] || !p->err)
+                        {
+                                NFT_LOG_PERROR("calloc");
+                                p->chainSize = 0;
+                                pthread_mutex_unlock(&p->lock);
+                                return NFT_FAILURE;
+                        }
+                }
+
+                /* shadow copy of chain & stale blocks */
+                uint8_t *shadow;
+                if(!(shadow = realloc(p->shadow, size)))
+                {
+                        NFT_LOG_PERROR("realloc");
+                        p->chainSize = 0;
+                        pthread_mutex_unlock(&p->lock);
+                        return NFT_FAILURE;
+                }
+                p->shadow = shadow;
+
+                uint8_t *stale;
+                if(!(stale = realloc(p->stale, (size + SPI_BLOCK_SIZE - 1) /
+                                     SPI_BLOCK_SIZE)))
+                {
+                        NFT_LOG_PERROR("realloc");
+                        p->chainSize = 0;
+                        pthread_mutex_unlock(&p->lock);
+                        return NFT_FAILURE;
+                }
+                p->stale = stale;
+                p->pixelBytes = bytes_per_pixel;
+                p->pixels = pixels;
+
+                p->chainSize = size;
+                p->txValid = false;
+
+                pthread_mutex_unlock(&p->lock);
+        }
+
+        /* both buffers need the whole chain encoded with current settings */
+        size_t blocks = (size + SPI_BLOCK_SIZE - 1) / SPI_BLOCK_SIZE;
+        if(!p->txValid)
+        {
+                memcpy(p->shadow, buf, size);
+                memset(p->stale, 3, blocks);
+                p->txValid = true;
+                p->changed = true;
+        }
+        else
+        {
+                /* find blocks of range that changed since last time */
+                size_t first = offset * bytes_per_led / SPI_BLOCK_SIZE *
+                        SPI_BLOCK_SIZE;
+                size_t last = (offset + count) * bytes_per_led;
+                if(spi_shadow_update(p->shadow + first, buf + first,
+                                     last - first,
+                                     p->stale + first / SPI_BLOCK_SIZE, 3))
+                        p->changed = true;
+        }
+
+        /* encode runs of blocks the back buffer misses */
+        int b = p->back;
+        size_t i = 0;
+        while(i < blocks)
+        {
+                if(!(p->stale[i] & (1 << b)))
+                {
+                        i++;
+                        continue;
+                }
+
+                size_t run = i;
+                for(; run < blocks && (p->stale[run] & (1 << b)); run++)
+                        p->stale[run] &= ~(1 << b);
+
+                /* whole pixels touching the blocks */
+                LedCount start = i * SPI_BLOCK_SIZE / bytes_per_pixel;
+                LedCount end = (run * SPI_BLOCK_SIZE + bytes_per_pixel - 1) /
+                        bytes_per_pixel;
+                if(end > pixels)
+                        end = pixels;
+
+                if(start < end)
+                        spiEncodeRange(p, b, start, end);
+                i = run;
+        }
+
+        /* back buffers are handed to writer threads in _show() */
+        return NFT_SUCCESS;
 }
 
 
@@ -482,10 +2139,81 @@ NftResult _show(void *privdata)
 
         struct priv *p = privdata;
 
-        /* send zero byte to latch */
-        uint8_t latch = 0;
+        /* nothing encoded yet */
+        if(!p->running || p->chainSize == 0)
+                return NFT_SUCCESS;
+
+        pthread_mutex_lock(&p->lock);
+
+        NftResult r = NFT_SUCCESS;
+        int i;
+
+        /* dithered output: writers refresh continuously from front buffer */
+        if(p->encoder.dither)
+        {
+                spiDitherWait(p);
+
+                for(i = 0; i < p->buses; i++)
+                {
+                        if(!p->bus[i].txResult)
+                                r = NFT_FAILURE;
+                        p->bus[i].txResult = NFT_SUCCESS;
+                }
+
+                p->back = !p->back;
+                pthread_mutex_unlock(&p->lock);
+
+                return r;
+        }
+
+        /* nothing changed: skip transfer unless a refresh is due */
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(!p->changed && p->refreshInterval)
+        {
+                long ms = (now.tv_sec - p->lastFrame.tv_sec) * 1000 +
+                        (now.tv_nsec - p->lastFrame.tv_nsec) / 1000000;
+                if(ms < (long) p->refreshInterval)
+                {
+                        pthread_mutex_unlock(&p->lock);
+                        return NFT_SUCCESS;
+                }
+        }
+
+        /* writers still busy with previous frame? */
+        if(spiWriterBusy(p))
+        {
+                if(p->queuePolicy == QUEUE_DROP)
+                {
+                        /* keep back buffers, next frame is encoded on top */
+                        p->droppedFrames++;
+                        pthread_mutex_unlock(&p->lock);
+                        return NFT_SUCCESS;
+                }
+
+                spiWriterWait(p);
+        }
+
+        /* report failure of previous transfer */
+        for(i = 0; i < p->buses; i++)
+        {
+                if(!p->bus[i].txResult)
+                        r = NFT_FAILURE;
+                p->bus[i].txResult = NFT_SUCCESS;
+        }
+
+        /* swap buffers and hand off frame to all writers at once */
+        p->changed = false;
+        p->lastFrame = now;
+        p->back = !p->back;
+        p->latchWait = p->buses;
+        for(i = 0; i < p->buses; i++)
+                p->bus[i].txPending = true;
+        pthread_cond_broadcast(&p->cond);
+
+        pthread_mutex_unlock(&p->lock);
 
-        return spiTxData(p->fd, &latch, 1);
+        return r;
 }
 
 
@@ -511,9 +2239,9 @@ LedHardwarePlugin hardware_descriptor = {
         .license = "GPL",
         .author = "Daniel Hiepler <daniel@niftylight.de> (c) 2011-2014",
         .description =
-                "Plugin to control LDP8806 and compatible connected to SPI port",
+                "Plugin to control LPD8806, WS2801, APA102/SK9822, P9813 and compatible LEDs connected to SPI port",
         .url = PACKAGE_URL,
-        .id_example = "/dev/spidev0.0",
+        .id_example = "/dev/spidev0.0,/dev/spidev1.0",
         .plugin_init = _init,
         .plugin_deinit = _deinit,
         .hw_init = _spi_init,
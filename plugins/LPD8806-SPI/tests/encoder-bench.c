@@ -0,0 +1,472 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+/**
+ * verify vectorized SPI chipset encoders against the reference
+ * implementations and report encoder throughput
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "encoder.h"
+
+
+/** iterations per measurement */
+#define ROUNDS  200
+
+
+/** current time in seconds */
+static double _now(void)
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/** compare spi_encode() against spi_encode_scalar() */
+static int _verify(const SpiEncoder * e, const uint8_t * in, size_t n)
+{
+        size_t bytes = e->rgb ? n * e->chipset->bytes_per_pixel : n;
+        uint8_t *a = malloc(bytes), *b = malloc(bytes);
+        if(!a || !b)
+        {
+                free(a);
+                free(b);
+                return -1;
+        }
+
+        spi_encode(e, a, in, n);
+        spi_encode_scalar(e, b, in, n);
+
+        int r = memcmp(a, b, bytes) == 0 ? 0 : -1;
+        free(a);
+        free(b);
+        return r;
+}
+
+
+/** measure megabytes of chain data encoded per second */
+static double _measure(const SpiEncoder * e, uint8_t * out,
+                       const uint8_t * in, size_t n, SpiEncodeFunc encode)
+{
+        double start = _now();
+
+        int i;
+        for(i = 0; i < ROUNDS; i++)
+                encode(e, out, in, n);
+
+        return (double) n *3 * ROUNDS / (_now() - start) / 1e6;
+}
+
+
+/** encode one pixel and compare with expected wire bytes */
+static int _expect(const char *chipset, const char *format,
+                   const uint8_t px[3], const uint8_t * wire)
+{
+        SpiEncoder e;
+        spi_encoder_init(&e, spi_chipset_find(chipset), format);
+
+        uint8_t out[4];
+        spi_encode(&e, out, px, 1);
+
+        size_t bytes = e.chipset->bytes_per_pixel;
+        if(memcmp(out, wire, bytes) != 0)
+        {
+                fprintf(stderr, "%s: unexpected encoding %02x %02x %02x %02x\n",
+                        chipset, out[0], out[1], out[2],
+                        bytes > 3 ? out[3] : 0);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/** encode one 16 bit pixel and compare with expected APA102 wire bytes */
+static int _expect_hdr(const uint16_t px[3], const uint8_t wire[4])
+{
+        SpiEncoder e;
+        if(!spi_encoder_init(&e, spi_chipset_find("apa102"), "RGB u16") ||
+           !e.hdr)
+        {
+                fprintf(stderr, "apa102: no HDR for \"RGB u16\"\n");
+                return -1;
+        }
+
+        uint8_t out[4];
+        spi_encode(&e, out, (const uint8_t *) px, 1);
+
+        if(memcmp(out, wire, 4) != 0)
+        {
+                fprintf(stderr,
+                        "apa102 HDR: unexpected encoding %02x %02x %02x %02x\n",
+                        out[0], out[1], out[2], out[3]);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * check vectorized dithering against reference and that the average of
+ * dithered output converges to the 16 bit input
+ */
+static int _verify_dither(const char *chipset, const uint16_t * in, size_t n)
+{
+        SpiEncoder e;
+        if(!spi_encoder_init(&e, spi_chipset_find(chipset), "RGB u16") ||
+           !e.dither)
+        {
+                fprintf(stderr, "%s: no dithering for \"RGB u16\"\n",
+                        chipset);
+                return -1;
+        }
+
+        uint16_t *ea = calloc(n, sizeof(uint16_t));
+        uint16_t *eb = calloc(n, sizeof(uint16_t));
+        uint8_t *a = malloc(n), *b = malloc(n);
+        uint32_t *sum = calloc(n, sizeof(uint32_t));
+        int r = -1;
+        if(!ea || !eb || !a || !b || !sum)
+                goto _exit;
+
+        const int frames = 512;
+        int f;
+        for(f = 0; f < frames; f++)
+        {
+                spi_dither(&e, a, in, ea, n);
+                spi_dither_scalar(&e, b, in, eb, n);
+                if(memcmp(a, b, n) != 0 || memcmp(ea, eb, n * 2) != 0)
+                {
+                        fprintf(stderr, "%s: dither mismatch in frame %d\n",
+                                chipset, f);
+                        goto _exit;
+                }
+
+                size_t i;
+                for(i = 0; i < n; i++)
+                        sum[i] += a[i];
+        }
+
+        /* average must be within one 16 bit wire step */
+        size_t i;
+        for(i = 0; i < n; i++)
+        {
+                double avg = (double) sum[i] / frames * 256;
+                double step = 256 << e.chipset->lut_shift;
+                if(in[i] < 0xffff - step &&
+                   (avg < in[i] - step || avg > in[i] + step))
+                {
+                        fprintf(stderr,
+                                "%s: dithered average %.1f for %u\n",
+                                chipset, avg, in[i]);
+                        goto _exit;
+                }
+        }
+
+        r = 0;
+
+_exit:
+        free(ea);
+        free(eb);
+        free(a);
+        free(b);
+        free(sum);
+        return r;
+}
+
+
+/** check vectorized block compare against reference */
+static int _verify_shadow(const uint8_t * in, size_t n)
+{
+        size_t blocks = (n + SPI_BLOCK_SIZE - 1) / SPI_BLOCK_SIZE;
+        uint8_t *a = malloc(n), *b = malloc(n);
+        uint8_t *sa = calloc(blocks, 1), *sb = calloc(blocks, 1);
+        int r = -1;
+        if(!a || !b || !sa || !sb)
+                goto _exit;
+
+        /* change a few bytes, some in the same block */
+        memcpy(a, in, n);
+        size_t i;
+        for(i = 0; i < n; i += 17 + i % 151)
+                a[i] = ~in[i];
+        memcpy(b, a, n);
+
+        size_t ca = spi_shadow_update(a, in, n, sa, 2);
+        size_t cb = spi_shadow_update_scalar(b, in, n, sb, 2);
+        if(ca != cb || memcmp(a, in, n) != 0 || memcmp(b, in, n) != 0 ||
+           memcmp(sa, sb, blocks) != 0 || ca == 0)
+        {
+                fprintf(stderr, "shadow: mismatch for %zu bytes\n", n);
+                goto _exit;
+        }
+
+        /* nothing changed now */
+        if(spi_shadow_update(a, in, n, sa, 1) != 0)
+        {
+                fprintf(stderr, "shadow: false change for %zu bytes\n", n);
+                goto _exit;
+        }
+
+        r = 0;
+
+_exit:
+        free(a);
+        free(b);
+        free(sa);
+        free(sb);
+        return r;
+}
+
+
+int main(void)
+{
+        const char *formats[] = { "RGB u8", "GRB u8", "BGR u8", "Y u8" };
+        const size_t pixels[] = { 1, 5, 16, 17, 33, 160, 1000, 100003 };
+
+        size_t max = pixels[sizeof(pixels) / sizeof(pixels[0]) - 1];
+        uint8_t *in = malloc(max * 3);
+        uint8_t *out = malloc(max * 4);
+        if(!in || !out)
+                return EXIT_FAILURE;
+
+        size_t i;
+        srand(0);
+        for(i = 0; i < max * 3; i++)
+                in[i] = rand();
+
+
+        /* correctness for every chipset, format & remainder length */
+        const SpiChipset *c;
+        unsigned int ci;
+        for(ci = 0; (c = spi_chipset_get(ci)); ci++)
+        {
+                size_t f;
+                for(f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+                {
+                        SpiEncoder e;
+                        if(!spi_encoder_init(&e, c, formats[f]))
+                                continue;
+
+                        size_t p;
+                        for(p = 0; p < sizeof(pixels) / sizeof(pixels[0]); p++)
+                        {
+                                size_t n = e.rgb ? pixels[p] : pixels[p] * 3;
+                                if(_verify(&e, in, n) != 0)
+                                {
+                                        fprintf(stderr,
+                                                "%s/%s: encoding mismatch for %zu pixels\n",
+                                                c->name, formats[f],
+                                                pixels[p]);
+                                        return EXIT_FAILURE;
+                                }
+                        }
+
+                        /* LUT with gamma */
+                        spi_encoder_set_lut(&e, 2.2, 0.5);
+                        if(_verify(&e, in, e.rgb ? 1000 : 3000) != 0)
+                        {
+                                fprintf(stderr,
+                                        "%s/%s: LUT encoding mismatch\n",
+                                        c->name, formats[f]);
+                                return EXIT_FAILURE;
+                        }
+                }
+        }
+
+        /* known values */
+        const uint8_t px[3] = { 0xff, 0x02, 0x80 };
+        if(_expect("lpd8806", "RGB u8", px,
+                   (const uint8_t[]) { 0x81, 0xff, 0xc0 }) ||
+           _expect("ws2801", "RGB u8", px,
+                   (const uint8_t[]) { 0xff, 0x02, 0x80 }) ||
+           _expect("apa102", "RGB u8", px,
+                   (const uint8_t[]) { 0xff, 0x80, 0x02, 0xff }) ||
+           _expect("p9813", "RGB u8", px,
+                   (const uint8_t[]) { 0xdc, 0x80, 0x02, 0xff }))
+                return EXIT_FAILURE;
+
+        /* dithering */
+        if(_verify_dither("lpd8806", (const uint16_t *) in, 1003) ||
+           _verify_dither("ws2801", (const uint16_t *) in, 1003))
+                return EXIT_FAILURE;
+
+        /* change detection */
+        for(i = 0; i < sizeof(pixels) / sizeof(pixels[0]); i++)
+        {
+                if(_verify_shadow(in, pixels[i] * 3))
+                        return EXIT_FAILURE;
+        }
+
+        /* HDR: full scale, dim values using low brightness */
+        if(_expect_hdr((const uint16_t[]) { 0xffff, 0, 0x8000 },
+                       (const uint8_t[]) { 0xff, 0x80, 0x00, 0xff }) ||
+           _expect_hdr((const uint16_t[]) { 1000, 10, 0 },
+                       (const uint8_t[]) { 0xe1, 0x00, 0x01, 0x79 }))
+                return EXIT_FAILURE;
+
+        /* HDR never overflows the PWM range */
+        SpiEncoder hdr;
+        spi_encoder_init(&hdr, spi_chipset_find("apa102"), "RGB u16");
+        uint32_t v;
+        for(v = 0; v <= 0xffff; v++)
+        {
+                const uint16_t px[3] = { v, v / 2, 0 };
+                uint8_t o[4];
+                spi_encode(&hdr, o, (const uint8_t *) px, 1);
+
+                /* brightest component must not saturate early */
+                unsigned int b = o[0] & 0x1f;
+                if(o[3] == 255 && v * 31 * 255 / 65535 < b * 254)
+                {
+                        fprintf(stderr, "apa102 HDR: clipping at %u\n", v);
+                        return EXIT_FAILURE;
+                }
+        }
+
+
+        /* throughput */
+        printf("%-8s %-8s %10s %12s %12s %12s\n", "chipset", "format",
+               "pixels", "scalar MB/s", "simd MB/s", "lut MB/s");
+        for(ci = 0; (c = spi_chipset_get(ci)); ci++)
+        {
+                size_t f;
+                for(f = 0; f < 2; f++)
+                {
+                        size_t p;
+                        for(p = 5; p < sizeof(pixels) / sizeof(pixels[0]); p++)
+                        {
+                                SpiEncoder e;
+                                spi_encoder_init(&e, c, formats[f]);
+
+                                double scalar = _measure(&e, out, in,
+                                                         pixels[p],
+                                                         spi_encode_scalar);
+                                double simd = _measure(&e, out, in, pixels[p],
+                                                       spi_encode);
+                                spi_encoder_set_lut(&e, 2.2, 1.0);
+                                double lut = _measure(&e, out, in, pixels[p],
+                                                      spi_encode);
+
+                                printf("%-8s %-8s %10zu %12.1f %12.1f %12.1f\n",
+                                       c->name, formats[f], pixels[p], scalar,
+                                       simd, lut);
+                        }
+                }
+        }
+
+        /* HDR encoding of 16 bit chain */
+        size_t p;
+        for(p = 5; p < sizeof(pixels) / sizeof(pixels[0]); p++)
+        {
+                double hdrs = _measure(&hdr, out, in, pixels[p] / 2,
+                                       spi_encode) * 2;
+                printf("%-8s %-8s %10zu %12s %12s %12.1f\n", "apa102",
+                       "RGB u16", pixels[p] / 2, "-", "-", hdrs);
+        }
+
+        /* dithering of 16 bit chain */
+        SpiEncoder dither;
+        spi_encoder_init(&dither, spi_chipset_find("lpd8806"), "RGB u16");
+        uint16_t *err = calloc(max * 3 / 2, sizeof(uint16_t));
+        if(!err)
+                return EXIT_FAILURE;
+        for(p = 5; p < sizeof(pixels) / sizeof(pixels[0]); p++)
+        {
+                size_t n = pixels[p] / 2 * 3;
+                double start = _now();
+                int r;
+                for(r = 0; r < ROUNDS; r++)
+                        spi_dither(&dither, out, (const uint16_t *) in, err,
+                                   n);
+                double simd = n * 2.0 * ROUNDS / (_now() - start) / 1e6;
+
+                start = _now();
+                for(r = 0; r < ROUNDS; r++)
+                        spi_dither_scalar(&dither, out,
+                                          (const uint16_t *) in, err, n);
+                double scalar = n * 2.0 * ROUNDS / (_now() - start) / 1e6;
+
+                printf("%-8s %-8s %10zu %12.1f %12.1f %12s\n", "dither",
+                       "RGB u16", pixels[p] / 2, scalar, simd, "-");
+        }
+        free(err);
+
+        /* change detection of unchanged chain */
+        uint8_t *shadow = malloc(max * 3), *stale = calloc(max, 1);
+        if(!shadow || !stale)
+                return EXIT_FAILURE;
+        memcpy(shadow, in, max * 3);
+        for(p = 5; p < sizeof(pixels) / sizeof(pixels[0]); p++)
+        {
+                size_t n = pixels[p] * 3;
+                double start = _now();
+                int r;
+                for(r = 0; r < ROUNDS; r++)
+                        spi_shadow_update(shadow, in, n, stale, 1);
+                double simd = n * (double) ROUNDS / (_now() - start) / 1e6;
+
+                start = _now();
+                for(r = 0; r < ROUNDS; r++)
+                        spi_shadow_update_scalar(shadow, in, n, stale, 1);
+                double scalar = n * (double) ROUNDS / (_now() - start) / 1e6;
+
+                printf("%-8s %-8s %10zu %12.1f %12.1f %12s\n", "compare",
+                       "RGB u8", pixels[p], scalar, simd, "-");
+        }
+        free(shadow);
+        free(stale);
+
+        free(in);
+        free(out);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,546 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/**
+ * LD_PRELOAD interposer emulating spidev devices, so the plugin can be
+ * tested and benchmarked without SPI hardware (see spidev-preload.h)
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/spi/spidev.h>
+#include "spidev-preload.h"
+
+
+/** max. amount of emulated devices */
+#define DEVICES_MAX     16
+/** emulated devices are only tracked for fds below this */
+#define FDS_MAX         1024
+/** captured bytes per device are cut here */
+#define CAPTURE_MAX     (4 << 20)
+/** default bytes per message (like /sys/module/spidev/parameters/bufsiz) */
+#define BUFSIZ_DEFAULT  4096
+/** glob() patterns starting with this list emulated devices */
+#define GLOB_PREFIX     "/dev/spidev"
+/** default devices to emulate */
+#define DEVICES_DEFAULT "/dev/spidev0.0,/dev/spidev0.1,/dev/spidev1.0,/dev/spidev1.1"
+
+
+
+/** one emulated device */
+typedef struct
+{
+        /* device node */
+        char path[256];
+        /* anonymous file every open() of path reopens */
+        int file;
+        /* counters & settings */
+        SpidevStats stats;
+        /* data clocked out since last reset */
+        uint8_t *capture;
+        size_t captureSize;
+        size_t captureAlloc;
+} Device;
+
+
+static pthread_once_t _once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Device _dev[DEVICES_MAX];
+static int _devices;
+static Device *_fd[FDS_MAX];
+
+static size_t _bufsiz = BUFSIZ_DEFAULT;
+static bool _realtime;
+static uint32_t _maxSpeed;
+
+static int (*_real_open) (const char *, int, ...);
+static int (*_real_open64) (const char *, int, ...);
+static int (*_real_ioctl) (int, unsigned long, ...);
+static int (*_real_close) (int);
+static int (*_real_glob) (const char *, int, int (*)(const char *, int),
+                          glob_t *);
+
+
+
+/** resolve real functions and set up emulated devices */
+static void _init(void)
+{
+        _real_open = dlsym(RTLD_NEXT, "open");
+        _real_open64 = dlsym(RTLD_NEXT, "open64");
+        _real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+        _real_close = dlsym(RTLD_NEXT, "close");
+        _real_glob = dlsym(RTLD_NEXT, "glob");
+
+        const char *env;
+        if((env = getenv("SPIDEV_PRELOAD_BUFSIZ")) && atol(env) > 0)
+                _bufsiz = (size_t) atol(env);
+        if((env = getenv("SPIDEV_PRELOAD_REALTIME")))
+                _realtime = atoi(env) != 0;
+        if((env = getenv("SPIDEV_PRELOAD_MAXSPEED")))
+                _maxSpeed = (uint32_t) strtoul(env, NULL, 10);
+
+        if(!(env = getenv("SPIDEV_PRELOAD_DEVICES")))
+                env = DEVICES_DEFAULT;
+
+        /* comma separated list of paths */
+        while(*env && _devices < DEVICES_MAX)
+        {
+                size_t len = strcspn(env, ",");
+                Device *d = &_dev[_devices];
+
+                if(len > 0 && len < sizeof(d->path))
+                {
+                        memcpy(d->path, env, len);
+                        d->path[len] = '\0';
+
+                        /* reopening it gives every open() its own file
+                           description, like a device node */
+                        if((d->file = memfd_create(d->path, 0)) != -1)
+                        {
+                                d->stats.bitsPerWord = 8;
+                                _devices++;
+                        }
+                }
+
+                env += len;
+                if(*env == ',')
+                        env++;
+        }
+}
+
+
+/** get emulated device by path */
+static Device *_device(const char *path)
+{
+        pthread_once(&_once, _init);
+
+        int i;
+        for(i = 0; path && i < _devices; i++)
+        {
+                if(strcmp(_dev[i].path, path) == 0)
+                        return &_dev[i];
+        }
+
+        return NULL;
+}
+
+
+/** get emulated device by fd */
+static Device *_device_fd(int fd)
+{
+        pthread_once(&_once, _init);
+
+        if(fd < 0 || fd >= FDS_MAX)
+                return NULL;
+
+        return _fd[fd];
+}
+
+
+/** open emulated device (lock must be held) */
+static int _open(Device * d, int flags)
+{
+        char file[64];
+        snprintf(file, sizeof(file), "/proc/self/fd/%d", d->file);
+
+        int fd;
+        if((fd = _real_open(file, flags & ~(O_CREAT | O_EXCL | O_TRUNC))) ==
+           -1)
+                return -1;
+
+        if(fd >= FDS_MAX)
+        {
+                _real_close(fd);
+                errno = EMFILE;
+                return -1;
+        }
+
+        _fd[fd] = d;
+        d->stats.opens++;
+
+        return fd;
+}
+
+
+/** append data clocked out to capture (lock must be held) */
+static void _capture(Device * d, const uint8_t * tx, size_t len)
+{
+        if(d->captureSize + len > CAPTURE_MAX)
+                return;
+
+        if(d->captureSize + len > d->captureAlloc)
+        {
+                size_t a = d->captureAlloc ? d->captureAlloc : 4096;
+                while(a < d->captureSize + len)
+                        a *= 2;
+
+                uint8_t *c;
+                if(!(c = realloc(d->capture, a)))
+                        return;
+                d->capture = c;
+                d->captureAlloc = a;
+        }
+
+        /* transfers without tx_buf clock out zeroes */
+        if(tx)
+                memcpy(d->capture + d->captureSize, tx, len);
+        else
+                memset(d->capture + d->captureSize, 0, len);
+
+        d->captureSize += len;
+}
+
+
+/** emulate SPI_IOC_MESSAGE(n) (lock must be held) */
+static int _message(Device * d, struct spi_ioc_transfer *tr, unsigned int n,
+                    unsigned long long *wireNs)
+{
+        /* spidev limits the sum of all transfers */
+        size_t total = 0;
+        unsigned int i;
+        for(i = 0; i < n; i++)
+                total += tr[i].len;
+
+        if(total > _bufsiz)
+        {
+                errno = EMSGSIZE;
+                return -1;
+        }
+
+        *wireNs = 0;
+        for(i = 0; i < n; i++)
+        {
+                uint32_t speed = tr[i].speed_hz ?
+                        tr[i].speed_hz : d->stats.speed;
+                uint8_t bpw = tr[i].bits_per_word ?
+                        tr[i].bits_per_word : d->stats.bitsPerWord;
+
+                if(speed == 0 || bpw == 0)
+                {
+                        errno = EINVAL;
+                        return -1;
+                }
+
+                const uint8_t *tx = (const uint8_t *) (uintptr_t) tr[i].tx_buf;
+                uint8_t *rx = (uint8_t *) (uintptr_t) tr[i].rx_buf;
+
+                /* loopback, garbled when clocked faster than the wiring
+                   allows */
+                if(rx)
+                {
+                        if(tx)
+                                memcpy(rx, tx, tr[i].len);
+                        else
+                                memset(rx, 0, tr[i].len);
+
+                        if(_maxSpeed && speed > _maxSpeed)
+                        {
+                                size_t b;
+                                for(b = 0; b < tr[i].len; b += 2)
+                                        rx[b] ^= 0xff;
+                        }
+                }
+
+                _capture(d, tx, tr[i].len);
+
+                *wireNs += (unsigned long long) tr[i].len * 8 *
+                        1000000000ULL / speed + tr[i].delay_usecs * 1000ULL;
+        }
+
+        d->stats.messages++;
+        d->stats.transfers += n;
+        d->stats.bytes += total;
+        d->stats.wireNs += *wireNs;
+
+        return (int) total;
+}
+
+
+/** emulate ioctl (lock must be held) */
+static int _ioctl(Device * d, unsigned long request, void *arg,
+                  unsigned long long *wireNs)
+{
+        d->stats.ioctls++;
+
+        switch (request)
+        {
+                case SPI_IOC_WR_MODE:
+                        d->stats.mode = *(uint8_t *) arg;
+                        return 0;
+                case SPI_IOC_RD_MODE:
+                        *(uint8_t *) arg = d->stats.mode;
+                        return 0;
+                case SPI_IOC_WR_MODE32:
+                        d->stats.mode = (uint8_t) * (uint32_t *) arg;
+                        return 0;
+                case SPI_IOC_RD_MODE32:
+                        *(uint32_t *) arg = d->stats.mode;
+                        return 0;
+                case SPI_IOC_WR_LSB_FIRST:
+                        return 0;
+                case SPI_IOC_RD_LSB_FIRST:
+                        *(uint8_t *) arg = 0;
+                        return 0;
+                case SPI_IOC_WR_BITS_PER_WORD:
+                        d->stats.bitsPerWord = *(uint8_t *) arg;
+                        return 0;
+                case SPI_IOC_RD_BITS_PER_WORD:
+                        *(uint8_t *) arg = d->stats.bitsPerWord;
+                        return 0;
+                case SPI_IOC_WR_MAX_SPEED_HZ:
+                        d->stats.speed = *(uint32_t *) arg;
+                        return 0;
+                case SPI_IOC_RD_MAX_SPEED_HZ:
+                        *(uint32_t *) arg = d->stats.speed;
+                        return 0;
+        }
+
+        /* SPI_IOC_MESSAGE(n) encodes n in the size field */
+        if(_IOC_TYPE(request) == SPI_IOC_MAGIC && _IOC_NR(request) == 0 &&
+           _IOC_DIR(request) == _IOC_WRITE &&
+           _IOC_SIZE(request) % sizeof(struct spi_ioc_transfer) == 0)
+        {
+                return _message(d, arg, _IOC_SIZE(request) /
+                                sizeof(struct spi_ioc_transfer), wireNs);
+        }
+
+        errno = ENOTTY;
+        return -1;
+}
+
+
+/** shared part of open() & open64() */
+static int _open_hook(int (*real) (const char *, int, ...), const char *path,
+                      int flags, va_list ap)
+{
+        Device *d;
+        if(!(d = _device(path)))
+        {
+                mode_t mode = 0;
+                if(flags & (O_CREAT | O_TMPFILE))
+                        mode = va_arg(ap, mode_t);
+                return real(path, flags, mode);
+        }
+
+        pthread_mutex_lock(&_lock);
+        int fd = _open(d, flags);
+        pthread_mutex_unlock(&_lock);
+
+        return fd;
+}
+
+
+int open(const char *path, int flags, ...)
+{
+        va_list ap;
+        va_start(ap, flags);
+
+        pthread_once(&_once, _init);
+        int r = _open_hook(_real_open, path, flags, ap);
+        va_end(ap);
+        return r;
+}
+
+
+int open64(const char *path, int flags, ...)
+{
+        va_list ap;
+        va_start(ap, flags);
+
+        pthread_once(&_once, _init);
+        int r = _open_hook(_real_open64, path, flags, ap);
+        va_end(ap);
+        return r;
+}
+
+
+int ioctl(int fd, unsigned long request, ...)
+{
+        va_list ap;
+        va_start(ap, request);
+        void *arg = va_arg(ap, void *);
+        va_end(ap);
+
+        Device *d;
+        if(!(d = _device_fd(fd)))
+                return _real_ioctl(fd, request, arg);
+
+        unsigned long long wireNs = 0;
+
+        pthread_mutex_lock(&_lock);
+        int r = _ioctl(d, request, arg, &wireNs);
+        pthread_mutex_unlock(&_lock);
+
+        /* take as long as the real transfer would */
+        if(_realtime && wireNs)
+        {
+                struct timespec t = {
+                        .tv_sec = wireNs / 1000000000ULL,
+                        .tv_nsec = wireNs % 1000000000ULL,
+                };
+                nanosleep(&t, NULL);
+        }
+
+        return r;
+}
+
+
+int close(int fd)
+{
+        if(_device_fd(fd))
+        {
+                pthread_mutex_lock(&_lock);
+                _fd[fd] = NULL;
+                pthread_mutex_unlock(&_lock);
+        }
+
+        return _real_close(fd);
+}
+
+
+/** sort paths */
+static int _cmp(const void *a, const void *b)
+{
+        return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+
+int glob(const char *pattern, int flags, int (*errfunc) (const char *, int),
+         glob_t * pglob)
+{
+        pthread_once(&_once, _init);
+
+        if(strncmp(pattern, GLOB_PREFIX, strlen(GLOB_PREFIX)) != 0)
+                return _real_glob(pattern, flags, errfunc, pglob);
+
+        /* emulated devices instead of /dev (globfree() frees this) */
+        char **v;
+        if(!(v = calloc(_devices + 1, sizeof(char *))))
+                return GLOB_NOSPACE;
+
+        size_t n = 0;
+        int i;
+        for(i = 0; i < _devices; i++)
+        {
+                if(fnmatch(pattern, _dev[i].path, FNM_PATHNAME) == 0)
+                        v[n++] = strdup(_dev[i].path);
+        }
+        qsort(v, n, sizeof(char *), _cmp);
+
+        memset(pglob, 0, sizeof(glob_t));
+        pglob->gl_pathc = n;
+        pglob->gl_pathv = v;
+
+        return n ? 0 : GLOB_NOMATCH;
+}
+
+
+void spidev_preload_reset(void)
+{
+        pthread_once(&_once, _init);
+        pthread_mutex_lock(&_lock);
+
+        int i;
+        for(i = 0; i < _devices; i++)
+        {
+                Device *d = &_dev[i];
+
+                /* keep settings of open devices */
+                SpidevStats s = { 0 };
+                s.mode = d->stats.mode;
+                s.bitsPerWord = d->stats.bitsPerWord;
+                s.speed = d->stats.speed;
+                d->stats = s;
+                d->captureSize = 0;
+        }
+
+        pthread_mutex_unlock(&_lock);
+}
+
+
+bool spidev_preload_stats(const char *path, SpidevStats * s)
+{
+        Device *d;
+        if(!(d = _device(path)))
+                return false;
+
+        pthread_mutex_lock(&_lock);
+        *s = d->stats;
+        pthread_mutex_unlock(&_lock);
+
+        return true;
+}
+
+
+size_t spidev_preload_capture(const char *path, const uint8_t ** data)
+{
+        Device *d;
+        if(!(d = _device(path)))
+        {
+                *data = NULL;
+                return 0;
+        }
+
+        pthread_mutex_lock(&_lock);
+        *data = d->capture;
+        size_t size = d->captureSize;
+        pthread_mutex_unlock(&_lock);
+
+        return size;
+}
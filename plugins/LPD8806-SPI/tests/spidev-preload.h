@@ -0,0 +1,108 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/**
+ * @file spidev-preload.h
+ * @brief spidev emulation for tests (LD_PRELOAD interposer)
+ *
+ * spidev-preload.so hooks open(), ioctl(), close() and glob() on emulated
+ * /dev/spidev* devices. Configuration ioctls are accepted, every
+ * SPI_IOC_MESSAGE is recorded and its time on the wire is modelled from
+ * speed_hz. Tests look up the functions below with dlsym() so they also
+ * build without the interposer and can skip when it isn't preloaded.
+ *
+ * environment:
+ * - SPIDEV_PRELOAD_DEVICES  comma separated device paths to emulate, also
+ *                           returned by glob("/dev/spidev*")
+ *                           (default: /dev/spidev0.0,/dev/spidev0.1,
+ *                           /dev/spidev1.0,/dev/spidev1.1)
+ * - SPIDEV_PRELOAD_BUFSIZ   max. bytes per message (default: 4096)
+ * - SPIDEV_PRELOAD_REALTIME if != 0, sleep for modelled wire time
+ * - SPIDEV_PRELOAD_MAXSPEED loopback (rx_buf) is garbled above this
+ *                           clock (Hz, default: unlimited)
+ */
+
+#ifndef _SPIDEV_PRELOAD_H
+#define _SPIDEV_PRELOAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+
+/** counters of one emulated device */
+typedef struct
+{
+        /** successful open() calls */
+        unsigned long opens;
+        /** all ioctl() calls */
+        unsigned long ioctls;
+        /** SPI_IOC_MESSAGE ioctls */
+        unsigned long messages;
+        /** transfers in all messages */
+        unsigned long transfers;
+        /** bytes clocked out */
+        unsigned long long bytes;
+        /** modelled time on the wire (ns) */
+        unsigned long long wireNs;
+        /** current settings */
+        uint8_t mode;
+        uint8_t bitsPerWord;
+        uint32_t speed;
+} SpidevStats;
+
+
+/** reset counters & captured data of all devices */
+typedef void (*SpidevResetFunc) (void);
+/** get counters of device, false if device is not emulated */
+typedef bool(*SpidevStatsFunc) (const char *path, SpidevStats * s);
+/** get bytes clocked out since last reset (capture is cut at 4 MiB) */
+typedef size_t(*SpidevCaptureFunc) (const char *path, const uint8_t ** data);
+
+#define SPIDEV_PRELOAD_RESET    "spidev_preload_reset"
+#define SPIDEV_PRELOAD_STATS    "spidev_preload_stats"
+#define SPIDEV_PRELOAD_CAPTURE  "spidev_preload_capture"
+
+
+#endif /* _SPIDEV_PRELOAD_H */
@@ -0,0 +1,753 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+
+/**
+ * run the plugin against emulated spidev devices (LD_PRELOAD
+ * spidev-preload.so): verify the bytes clocked out for every chipset and
+ * for chains split across buses, check that unchanged frames are skipped,
+ * check per-pixel gain & dithered 16 bit chains, check autodetection of
+ * devices, report frames/second and syscalls/frame
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <niftyled.h>
+#include "encoder.h"
+#include "spidev-preload.h"
+
+
+/** frames to send per measurement */
+#define FRAMES          20
+/** exit code that makes automake skip a test */
+#define EXIT_SKIP       77
+/** device cache used by autodetection */
+#define CACHE           "spidev.cache"
+/** niftyled counts LEDs (components), an RGB pixel has 3 of them */
+#define RGB_LEDS(pixels) ((pixels) * 3)
+
+
+static SpidevResetFunc _reset;
+static SpidevStatsFunc _stats;
+static SpidevCaptureFunc _capture;
+
+
+/** current time in seconds */
+static double _now(void)
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/** fill chain with a pattern that changes every frame */
+static void _pattern(LedHardware * h, int frame)
+{
+        LedChain *c = led_hardware_get_chain(h);
+        uint8_t *buf = led_chain_get_buffer(c);
+        size_t size = led_chain_get_buffer_size(c);
+
+        size_t i;
+        for(i = 0; i < size; i++)
+                buf[i] = (uint8_t) (i * 7 + frame * 13);
+}
+
+
+/** create & initialize plugin for an RGB chain of pixels */
+static LedHardware *_hardware(const char *name, const char *id,
+                              LedCount pixels, const char *chipset,
+                              const char *format)
+{
+        LedHardware *h;
+        if(!(h = led_hardware_new(name, "spi_lpd8806")))
+        {
+                NFT_LOG(L_ERROR, "Hardware creation FAILED");
+                return NULL;
+        }
+
+        if(!led_hardware_init(h, id, RGB_LEDS(pixels), format))
+        {
+                NFT_LOG(L_ERROR, "failed to initialize hardware");
+                led_hardware_destroy(h);
+                return NULL;
+        }
+
+        char chip[64];
+        strncpy(chip, chipset, sizeof(chip) - 1);
+        chip[sizeof(chip) - 1] = '\0';
+        if(!led_hardware_plugin_prop_set_string(h, "chipset", chip))
+        {
+                NFT_LOG(L_ERROR, "failed to set chipset \"%s\"", chipset);
+                led_hardware_destroy(h);
+                return NULL;
+        }
+
+        return h;
+}
+
+
+/** build the frame a chipset expects for n RGB pixels */
+static uint8_t *_frame(const char *chipset, const uint8_t * in, size_t n,
+                       size_t * size)
+{
+        const SpiChipset *c;
+        SpiEncoder e;
+        if(!(c = spi_chipset_find(chipset)) ||
+           !spi_encoder_init(&e, c, "RGB u8"))
+                return NULL;
+        spi_encoder_set_lut(&e, 1.0, 1.0);
+
+        size_t head = c->start(NULL, n);
+        size_t data = n * c->bytes_per_pixel;
+        size_t tail = c->end(NULL, n);
+
+        uint8_t *out;
+        if(!(out = malloc(head + data + tail + 1)))
+                return NULL;
+
+        c->start(out, n);
+        spi_encode(&e, out + head, in, n);
+        c->end(out + head + data, n);
+
+        *size = head + data + tail;
+        return out;
+}
+
+
+/**
+ * send one frame over buses (comma separated paths) and compare what
+ * every bus clocked out with the frame of its segment
+ */
+static int _verify(const char *chipset, const char *id, LedCount pixels)
+{
+        LedHardware *h;
+        if(!(h = _hardware("spidev", id, pixels, chipset, "RGB u8")))
+                return -1;
+
+        _pattern(h, 1);
+
+        /* keep a copy, chain is gone once writers are flushed */
+        LedChain *c = led_hardware_get_chain(h);
+        size_t size = led_chain_get_buffer_size(c);
+        uint8_t *chain;
+        if(!(chain = malloc(size)))
+        {
+                led_hardware_destroy(h);
+                return -1;
+        }
+        memcpy(chain, led_chain_get_buffer(c), size);
+
+        _reset();
+        if(!led_hardware_send(h) || !led_hardware_show(h))
+        {
+                NFT_LOG(L_ERROR, "failed to send frame");
+                led_hardware_destroy(h);
+                free(chain);
+                return -1;
+        }
+
+        /* deinit waits for the last frame */
+        led_hardware_destroy(h);
+
+        /* pixels are split evenly like the plugin does */
+        int buses = 1;
+        const char *s;
+        for(s = id; *s; s++)
+                if(*s == ',')
+                        buses++;
+
+        int r = 0, b;
+        LedCount first = 0;
+        for(b = 0; b < buses; b++)
+        {
+                char path[256];
+                size_t len = strcspn(id, ",");
+                snprintf(path, sizeof(path), "%.*s", (int) len, id);
+                id += len + (id[len] == ',');
+
+                LedCount count = pixels * (b + 1) / buses -
+                        pixels * b / buses;
+
+                size_t expSize = 0;
+                uint8_t *exp = _frame(chipset, chain + first * 3, count,
+                                      &expSize);
+
+                const uint8_t *got;
+                size_t gotSize = _capture(path, &got);
+
+                if(!exp || gotSize != expSize || memcmp(got, exp, expSize))
+                {
+                        NFT_LOG(L_ERROR,
+                                "%s: %s clocked out %zu bytes, expected %zu (pixels %u-%u)",
+                                chipset, path, gotSize, expSize, first,
+                                first + count);
+                        r = -1;
+                }
+
+                free(exp);
+                first += count;
+        }
+
+        free(chain);
+        return r;
+}
+
+
+/**
+ * unchanged frames must not be sent, a changed LED must get the whole
+ * frame (with the pixel of that LED re-encoded) sent
+ */
+static int _incremental(LedCount pixels, LedCount led)
+{
+        LedHardware *h;
+        if(!(h = _hardware("spidev", "/dev/spidev0.0", pixels, "lpd8806",
+                           "RGB u8")))
+                return -1;
+
+        LedChain *c = led_hardware_get_chain(h);
+        uint8_t *buf = led_chain_get_buffer(c);
+        size_t size = led_chain_get_buffer_size(c);
+        uint8_t *chain[2];
+        chain[0] = malloc(size);
+        chain[1] = malloc(size);
+        if(!chain[0] || !chain[1])
+                return -1;
+
+        _reset();
+
+        int f;
+        for(f = 0; f < 10; f++)
+        {
+                /* change one LED in frame 5 */
+                if(f == 0)
+                        _pattern(h, 0);
+                if(f == 5)
+                        buf[led] ^= 0x80;
+                if(f == 0 || f == 5)
+                        memcpy(chain[f / 5], buf, size);
+
+                if(!led_hardware_send(h) || !led_hardware_show(h))
+                {
+                        NFT_LOG(L_ERROR, "failed to send frame %d", f);
+                        led_hardware_destroy(h);
+                        return -1;
+                }
+        }
+
+        led_hardware_destroy(h);
+
+        /* two frames on the wire */
+        SpidevStats st;
+        size_t size0 = 0, size1 = 0;
+        uint8_t *exp0 = _frame("lpd8806", chain[0], pixels, &size0);
+        uint8_t *exp1 = _frame("lpd8806", chain[1], pixels, &size1);
+        const uint8_t *got;
+        size_t gotSize = _capture("/dev/spidev0.0", &got);
+        _stats("/dev/spidev0.0", &st);
+
+        int r = 0;
+        if(!exp0 || !exp1 || gotSize != size0 + size1 ||
+           memcmp(got, exp0, size0) || memcmp(got + size0, exp1, size1))
+        {
+                NFT_LOG(L_ERROR,
+                        "changed LED %u of %u: got %zu bytes in %lu messages, expected %zu",
+                        led, RGB_LEDS(pixels), gotSize, st.messages,
+                        size0 + size1);
+                r = -1;
+        }
+
+        free(exp0);
+        free(exp1);
+        free(chain[0]);
+        free(chain[1]);
+        return r;
+}
+
+
+/**
+ * gain is one APA102 brightness per pixel, set through the first LED
+ * (component) of that pixel. Gain of other components is ignored.
+ */
+static int _gain(void)
+{
+        const LedCount pixels = 10;
+        const LedGain gain = LED_GAIN_MAX / 2;
+        LedHardware *h;
+        if(!(h = _hardware("spidev", "/dev/spidev0.0", pixels, "apa102",
+                           "RGB u8")))
+                return -1;
+
+        _pattern(h, 1);
+
+        LedChain *c = led_hardware_get_chain(h);
+        size_t size = led_chain_get_buffer_size(c);
+        uint8_t *chain;
+        if(!(chain = malloc(size)))
+        {
+                led_hardware_destroy(h);
+                return -1;
+        }
+        memcpy(chain, led_chain_get_buffer(c), size);
+
+        _reset();
+        if(!led_hardware_set_gain(h, RGB_LEDS(4), gain) ||
+           !led_hardware_set_gain(h, RGB_LEDS(6) + 1, gain) ||
+           !led_hardware_send(h) || !led_hardware_show(h))
+        {
+                NFT_LOG(L_ERROR, "failed to send frame");
+                led_hardware_destroy(h);
+                free(chain);
+                return -1;
+        }
+        led_hardware_destroy(h);
+
+        /* only pixel 4 is dimmed */
+        const SpiChipset *chip = spi_chipset_find("apa102");
+        size_t expSize = 0;
+        uint8_t *exp = _frame("apa102", chain, pixels, &expSize);
+        if(exp)
+                exp[chip->start(NULL, pixels) +
+                    4 * chip->bytes_per_pixel] = (uint8_t)
+                        (0xe0 | (gain * 31 + LED_GAIN_MAX / 2) /
+                         LED_GAIN_MAX);
+
+        const uint8_t *got;
+        size_t gotSize = _capture("/dev/spidev0.0", &got);
+
+        int r = 0;
+        if(!exp || gotSize != expSize || memcmp(got, exp, expSize))
+        {
+                NFT_LOG(L_ERROR,
+                        "gain: clocked out %zu bytes, expected %zu",
+                        gotSize, expSize);
+                r = -1;
+        }
+
+        free(exp);
+        free(chain);
+        return r;
+}
+
+
+/**
+ * 16 bit chains are dithered per LED and encoded per pixel. Values that
+ * need no dithering must reach the wire unchanged in every refresh.
+ */
+static int _dither(LedCount pixels)
+{
+        LedHardware *h;
+        if(!(h = _hardware("spidev", "/dev/spidev0.0", pixels, "lpd8806",
+                           "RGB u16")))
+                return -1;
+
+        /* 8 bit values LPD8806 can show without error */
+        LedChain *c = led_hardware_get_chain(h);
+        uint16_t *buf = led_chain_get_buffer(c);
+        uint8_t *chain;
+        if(!(chain = malloc(RGB_LEDS(pixels))))
+        {
+                led_hardware_destroy(h);
+                return -1;
+        }
+        LedCount i;
+        for(i = 0; i < RGB_LEDS(pixels); i++)
+        {
+                chain[i] = (uint8_t) (i * 7) & 0xfe;
+                buf[i] = (uint16_t) (chain[i] << 8);
+        }
+
+        _reset();
+        if(!led_hardware_send(h) || !led_hardware_show(h))
+        {
+                NFT_LOG(L_ERROR, "failed to send frame");
+                led_hardware_destroy(h);
+                free(chain);
+                return -1;
+        }
+
+        /* let the writer refresh a few times */
+        usleep(100000);
+        led_hardware_destroy(h);
+
+        size_t expSize = 0;
+        uint8_t *exp = _frame("lpd8806", chain, pixels, &expSize);
+        const uint8_t *got;
+        size_t gotSize = _capture("/dev/spidev0.0", &got);
+
+        int r = 0;
+        if(!exp || gotSize < expSize || gotSize % expSize ||
+           memcmp(got + gotSize - expSize, exp, expSize))
+        {
+                NFT_LOG(L_ERROR,
+                        "dither: clocked out %zu bytes, expected frames of %zu",
+                        gotSize, expSize);
+                r = -1;
+        }
+
+        free(exp);
+        free(chain);
+        return r;
+}
+
+
+/**
+ * clock probe only clocks out bytes LPD8806 ignores, chipsets without
+ * such a pattern refuse to probe
+ */
+static int _probe(void)
+{
+        const int max = 8000000;
+        LedHardware *h;
+        if(!(h = _hardware("spidev", "/dev/spidev0.0", 10, "lpd8806",
+                           "RGB u8")))
+                return -1;
+
+        _reset();
+
+        int r = 0;
+        int speed = 0;
+        if(!led_hardware_plugin_prop_set_int(h, "spi_probe", max) ||
+           !led_hardware_plugin_prop_get_int(h, "spi_speed", &speed) ||
+           speed != max)
+        {
+                NFT_LOG(L_ERROR, "probing lpd8806 failed (%d Hz)", speed);
+                r = -1;
+        }
+
+        const uint8_t *got;
+        size_t n = _capture("/dev/spidev0.0", &got);
+        size_t i;
+        for(i = 0; i < n; i++)
+        {
+                if(got[i] & 0x80)
+                {
+                        NFT_LOG(L_ERROR, "probe byte %zu is 0x%02x", i,
+                                got[i]);
+                        r = -1;
+                        break;
+                }
+        }
+        if(n == 0)
+        {
+                NFT_LOG(L_ERROR, "lpd8806 wasn't probed");
+                r = -1;
+        }
+
+        char chip[] = "ws2801";
+        _reset();
+        if(!led_hardware_plugin_prop_set_string(h, "chipset", chip) ||
+           led_hardware_plugin_prop_set_int(h, "spi_probe", max) ||
+           _capture("/dev/spidev0.0", &got) != 0)
+        {
+                NFT_LOG(L_ERROR, "ws2801 chain got probed");
+                r = -1;
+        }
+
+        led_hardware_destroy(h);
+        return r;
+}
+
+
+/**
+ * initialize hardwares with id "*" in given order, send a frame with a
+ * different length on each and check they ended up on the expected device
+ */
+static int _autodetect_round(const int *order)
+{
+        const char *names[] = { "auto0", "auto1", "auto2" };
+        const char *devices[] = {
+                "/dev/spidev0.0", "/dev/spidev0.1", "/dev/spidev1.0"
+        };
+        LedHardware *h[3];
+
+        _reset();
+
+        int i;
+        for(i = 0; i < 3; i++)
+        {
+                int n = order[i];
+                if(!(h[n] = _hardware(names[n], "*", 10 * (n + 1),
+                                      "lpd8806", "RGB u8")))
+                        return -1;
+        }
+
+        for(i = 0; i < 3; i++)
+        {
+                _pattern(h[i], 0);
+                if(!led_hardware_send(h[i]) || !led_hardware_show(h[i]))
+                {
+                        NFT_LOG(L_ERROR, "failed to send frame");
+                        return -1;
+                }
+        }
+
+        for(i = 0; i < 3; i++)
+                led_hardware_destroy(h[i]);
+
+        int r = 0;
+        for(i = 0; i < 3; i++)
+        {
+                const SpiChipset *c = spi_chipset_find("lpd8806");
+                size_t n = 10 * (i + 1);
+                size_t expSize = c->start(NULL, n) + n * c->bytes_per_pixel +
+                        c->end(NULL, n);
+
+                const uint8_t *got;
+                if(_capture(devices[i], &got) != expSize)
+                {
+                        NFT_LOG(L_ERROR, "\"%s\" didn't get \"%s\"",
+                                names[i], devices[i]);
+                        r = -1;
+                }
+        }
+
+        return r;
+}
+
+
+/** id "*": busy devices are skipped, assignment survives restarts */
+static int _autodetect(void)
+{
+        setenv("NFT_SPI_CACHE", CACHE, 1);
+        unlink(CACHE);
+
+        /* first come first served, then everybody gets its old device */
+        const int first[] = { 0, 1, 2 };
+        const int restart[] = { 2, 0, 1 };
+        int r = 0;
+        if(_autodetect_round(first) != 0 || _autodetect_round(restart) != 0)
+                r = -1;
+
+        unlink(CACHE);
+        return r;
+}
+
+
+/** leave stack below the caller full of cache-like lines */
+static void __attribute__((noinline)) _scribble(void)
+{
+        static const char junk[] = "junk\t/dev/junk\n";
+        volatile char stack[65536];
+        size_t i;
+        for(i = 0; i < sizeof(stack); i++)
+                stack[i] = junk[i % (sizeof(junk) - 1)];
+}
+
+
+/** cache whose last line lacks a newline is rewritten without garbage */
+static int _autodetect_unterminated(void)
+{
+        const char *old = "other\t/dev/spidev1.0";
+        const char *exp = "other\t/dev/spidev1.0\nauto0\t/dev/spidev0.0\n";
+
+        setenv("NFT_SPI_CACHE", CACHE, 1);
+
+        FILE *f;
+        if(!(f = fopen(CACHE, "w")) || fputs(old, f) == EOF ||
+           fclose(f) != 0)
+        {
+                NFT_LOG(L_ERROR, "failed to write \"%s\"", CACHE);
+                return -1;
+        }
+
+        _reset();
+        _scribble();
+
+        LedHardware *h;
+        if(!(h = _hardware("auto0", "*", 10, "lpd8806", "RGB u8")))
+                return -1;
+        led_hardware_destroy(h);
+
+        char got[256];
+        size_t n = 0;
+        if((f = fopen(CACHE, "r")))
+        {
+                n = fread(got, 1, sizeof(got) - 1, f);
+                fclose(f);
+        }
+        got[n] = '\0';
+        unlink(CACHE);
+
+        if(strcmp(got, exp) != 0)
+        {
+                NFT_LOG(L_ERROR, "cache is \"%s\", expected \"%s\"",
+                        got, exp);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/** measure frames/second & syscalls/frame of one configuration */
+static int _measure(const char *chipset, const char *id, LedCount pixels,
+                    int speed, double *fps, double *wireFps,
+                    double *ioctls)
+{
+        LedHardware *h;
+        if(!(h = _hardware("spidev", id, pixels, chipset, "RGB u8")))
+                return -1;
+
+        if(!led_hardware_plugin_prop_set_int(h, "spi_speed", speed))
+        {
+                NFT_LOG(L_ERROR, "failed to set speed %d", speed);
+                led_hardware_destroy(h);
+                return -1;
+        }
+
+        _reset();
+        double start = _now();
+
+        int f;
+        for(f = 0; f < FRAMES; f++)
+        {
+                _pattern(h, f);
+
+                if(!led_hardware_send(h) || !led_hardware_show(h))
+                {
+                        NFT_LOG(L_ERROR, "failed to send frame %d", f);
+                        led_hardware_destroy(h);
+                        return -1;
+                }
+        }
+
+        /* flush last frame */
+        led_hardware_destroy(h);
+
+        *fps = FRAMES / (_now() - start);
+
+        SpidevStats s;
+        _stats(id, &s);
+        *wireFps = s.wireNs ? FRAMES * 1e9 / s.wireNs : 0;
+        *ioctls = (double) s.ioctls / FRAMES;
+
+        return 0;
+}
+
+
+int main(void)
+{
+        nft_log_level_set(L_WARNING);
+
+        /* interposer must be preloaded */
+        if(!(_reset = (SpidevResetFunc) dlsym(RTLD_DEFAULT,
+                                               SPIDEV_PRELOAD_RESET)) ||
+           !(_stats = (SpidevStatsFunc) dlsym(RTLD_DEFAULT,
+                                               SPIDEV_PRELOAD_STATS)) ||
+           !(_capture = (SpidevCaptureFunc) dlsym(RTLD_DEFAULT,
+                                                   SPIDEV_PRELOAD_CAPTURE)))
+        {
+                printf("spidev-preload.so is not preloaded, skipping\n");
+                return EXIT_SKIP;
+        }
+
+        /* wire data of every chipset, single frames & frames that need
+           several messages (pixels) */
+        const LedCount pixels[] = { 1, 50, 1500 };
+        const SpiChipset *c;
+        unsigned int i;
+        for(i = 0; (c = spi_chipset_get(i)); i++)
+        {
+                size_t k;
+                for(k = 0; k < sizeof(pixels) / sizeof(pixels[0]); k++)
+                {
+                        if(_verify(c->name, "/dev/spidev0.0", pixels[k])
+                           != 0)
+                                return -1;
+                }
+
+                if(_verify(c->name, "/dev/spidev0.0,/dev/spidev1.0", 101)
+                   != 0)
+                        return -1;
+        }
+
+        /* changed LED in the middle, in a pixel across the first block
+           border (64 bytes) & in the last, partial block */
+        if(_incremental(1000, RGB_LEDS(500) + 1) != 0 ||
+           _incremental(50, 64) != 0 || _incremental(50, RGB_LEDS(50) - 1)
+           != 0)
+                return -1;
+
+        if(_gain() != 0 || _dither(50) != 0 || _dither(101) != 0)
+                return -1;
+
+        if(_probe() != 0 || _autodetect() != 0 ||
+           _autodetect_unterminated() != 0)
+                return -1;
+
+        printf("%-8s %8s %10s %10s %10s %12s\n", "chipset", "pixels", "speed",
+               "fps", "wire fps", "ioctls/frame");
+
+        const int speeds[] = { 500000, 8000000 };
+        const LedCount counts[] = { 160, 1000 };
+        for(i = 0; (c = spi_chipset_get(i)); i++)
+        {
+                size_t j, k;
+                for(j = 0; j < sizeof(speeds) / sizeof(speeds[0]); j++)
+                {
+                        for(k = 0; k < sizeof(counts) / sizeof(counts[0]);
+                            k++)
+                        {
+                                double fps, wireFps, ioctls;
+                                if(_measure(c->name, "/dev/spidev0.0",
+                                            counts[k], speeds[j], &fps,
+                                            &wireFps, &ioctls) != 0)
+                                        return -1;
+
+                                printf("%-8s %8u %10d %10.1f %10.1f %12.1f\n",
+                                       c->name, counts[k], speeds[j], fps,
+                                       wireFps, ioctls);
+                        }
+                }
+        }
+
+        return 0;
+}
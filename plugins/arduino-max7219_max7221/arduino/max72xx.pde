@@ -50,6 +50,9 @@
  */
 
 #include <stdarg.h>
+#ifdef __AVR__
+#include <util/crc16.h>
+#endif
 
 #if (ARDUINO >= 100)
 #include <Arduino.h>
@@ -59,10 +62,42 @@
 
 
 
+/** define this to drive the chain with the AVR hardware SPI peripheral */
+#define USE_HW_SPI
+
+#ifndef __AVR__
+#undef USE_HW_SPI
+#endif
+
+
 /** pin definitions */
+#ifdef USE_HW_SPI
+/* hardware SPI has fixed pins (11/13/10 on ATmega328, 51/52/53 on Mega) */
+#define PIN_DATA	MOSI
+#define PIN_CLOCK	SCK
+#define PIN_CS		SS
+#else
 #define PIN_DATA	10
 #define PIN_CLOCK	12
 #define PIN_CS		11
+#endif
+
+
+/** serial rate after reset (the host negotiates faster ones) */
+#define BAUDRATE_DEFAULT	115200
+/** range of rates the host may ask for */
+#define BAUDRATE_MIN		1200
+#define BAUDRATE_MAX		2000000
+/** ms to wait for a ping after switching, else fall back to default */
+#define BAUDRATE_TIMEOUT	1000
+
+
+/** every packet starts with this byte: SYNC opcode size data[size] crc8 */
+#define PACKET_SYNC		0xA5
+/** max. data bytes of one packet */
+#define PACKET_DATA_MAX		64
+/** ms between two bytes of a packet after which it's considered broken */
+#define PACKET_TIMEOUT		20
 
 
 /** define this for debugging output via LOG() function */
@@ -106,10 +141,24 @@ struct priv
   int SPI_CLK;
   /* This one is driven LOW for chip selectzion */
   int SPI_CS;
-  /* The array for shifting the data to the devices */
-  char spidata[16];
   /* We keep track of the led-status for all 8 devices in this array */
   char status[64];
+  /* rows (bits) that changed on any device since the last latch */
+  unsigned char dirty;
+  /* current serial rate */
+  unsigned long baudrate;
+  /* rate was switched but host didn't ping us at it yet */
+  bool baudratePending;
+  /* millis() when we fall back to BAUDRATE_DEFAULT */
+  unsigned long baudrateDeadline;
+  /* packet being received (starts with PACKET_SYNC) */
+  unsigned char rx[4 + PACKET_DATA_MAX];
+  /* bytes in rx */
+  unsigned char rxLen;
+  /* millis() when the last byte was received */
+  unsigned long rxTime;
+  /* damaged packets dropped since the last LED_ACK */
+  unsigned char rxErrors;
 }
 priv;
 
@@ -131,31 +180,49 @@ void LOG(char *fmt, ...) {
 #endif
 
 
-/** send data+opcode to MAX72xx chain */
-void spiTransfer(char addr, volatile char opcode, volatile char data) 
+/** initialize SPI output */
+void spiInit()
 {
-  if(addr < 0 || addr >= priv.n_devices)
-    return;
+  pinMode(priv.SPI_MOSI, OUTPUT);
+  pinMode(priv.SPI_CLK,  OUTPUT);
+  pinMode(priv.SPI_CS,   OUTPUT);
+  digitalWrite(priv.SPI_CS,HIGH);
+
+#ifdef USE_HW_SPI
+  /* enable SPI master, mode 0, MSB first, fosc/2 (MAX72xx does 10 MHz) */
+  SPCR = _BV(SPE) | _BV(MSTR);
+  SPSR = _BV(SPI2X);
+#endif
+}
 
-  /* send data last-byte first, start at offset */
-  int offset = (int) addr*2;
 
-  /* clear buffer */
-  for(char i=0; i < priv.n_devices*2; i++)
-    priv.spidata[i]=0;
+/** shift one byte out to the chain */
+static inline void spiWrite(unsigned char b)
+{
+#ifdef USE_HW_SPI
+  SPDR = b;
+  while(!(SPSR & _BV(SPIF)))
+    ;
+#else
+  shiftOut(priv.SPI_MOSI, priv.SPI_CLK, MSBFIRST, b);
+#endif
+}
+
 
-  /* put our device data into the array */
-  priv.spidata[offset+1] = opcode;
-  priv.spidata[offset] = data;
+/** send data+opcode to one MAX72xx, NOOP to all others */
+void spiTransfer(char addr, char opcode, char data) 
+{
+  if(addr < 0 || addr >= priv.n_devices)
+    return;
 
   /* enable the line */
   digitalWrite(priv.SPI_CS, LOW);
 
-  /* Now shift out the data */
-  for(char i = priv.n_devices*2; i>0; i--)
+  /* the last chip of the chain is shifted out first */
+  for(int i = priv.n_devices-1; i >= 0; i--)
   {
-        //LOG("0x%x", priv.spidata[i-1]);
-        shiftOut(priv.SPI_MOSI, priv.SPI_CLK, MSBFIRST, priv.spidata[i-1]);
+    spiWrite(i == addr ? opcode : OP_NOOP);
+    spiWrite(i == addr ? data : 0);
   }
 
   /* latch the data onto the display */
@@ -163,6 +230,21 @@ void spiTransfer(char addr, volatile char opcode, volatile char data)
 }   
 
 
+/** send one row to all MAX72xx of the chain in a single transfer */
+void spiTransferRow(char row)
+{
+  digitalWrite(priv.SPI_CS, LOW);
+
+  for(int i = priv.n_devices-1; i >= 0; i--)
+  {
+    spiWrite(OP_DIGIT0+row);
+    spiWrite(priv.status[i*8+row]);
+  }
+
+  digitalWrite(priv.SPI_CS,HIGH);
+}
+
+
 /** switch chip into shutdown mode */
 void shutdown(char addr, bool b) 
 {
@@ -210,22 +292,83 @@ void setIntensity(char addr, char intensity)
 }
 
 
-/** upload buffer to display */
+/** upload changed rows of buffer to display (at most 8 transfers) */
 void showBuffer()
 {
   LOG("Showing buffer");
 
-  char chip, row;
-  for(chip=0; chip < priv.n_devices; chip++)
+  char row;
+  for(row=0; row < 8; row++)
   {
-    for(row=0; row < 8; row++)
-    {
-      spiTransfer(chip, row+1, priv.status[chip*8+row]);
-    }
+    if(priv.dirty & (1 << row))
+      spiTransferRow(row);
+  }
+
+  priv.dirty = 0;
+}
+
+
+/** set one row of buffer, mark it for the next showBuffer() if it changed */
+void setRow(unsigned char chip, unsigned char row, char data)
+{
+  if(chip >= 8 || row >= 8)
+    return;
+
+  if(priv.status[chip*8+row] != data)
+  {
+    priv.status[chip*8+row] = data;
+    priv.dirty |= 1 << row;
   }
 }
 
 
+/** push all rows on next showBuffer() */
+void invalidateBuffer()
+{
+  priv.dirty = 0xff;
+}
+
+
+/** CRC-8 (polynomial 0x07, init 0) */
+static inline unsigned char crc8(unsigned char crc, unsigned char b)
+{
+#ifdef __AVR__
+  return _crc8_ccitt_update(crc, b);
+#else
+  crc ^= b;
+  for(char i=0; i < 8; i++)
+    crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+  return crc;
+#endif
+}
+
+
+/** send a packet to the USB host */
+void txPacket(char opcode, char *data, char size)
+{
+  unsigned char crc = crc8(crc8(0, opcode), size);
+  for(char i=0; i < size; i++)
+    crc = crc8(crc, data[i]);
+
+  Serial.write((uint8_t) PACKET_SYNC);
+  Serial.write((uint8_t) opcode);
+  Serial.write((uint8_t) size);
+  Serial.write((uint8_t *) data, size);
+  Serial.write(crc);
+}
+
+
+/** (re)start serial port at baud */
+void setBaudrate(unsigned long baud)
+{
+  /* wait until everything is sent (Arduino >= 1.0) */
+  Serial.flush();
+  Serial.end();
+  Serial.begin(baud);
+  priv.baudrate = baud;
+}
+
+
 /** initialize one MAX72xx */
 void chipInit(int i)
 {
@@ -254,21 +397,25 @@ enum
   LED_LATCH,
   /** receive pixel data */
   LED_UPLOAD,
+  /** receive changed rows as (chip, row, byte) triples */
+  LED_UPLOAD_DELTA,
+  /** echo packet back to host */
+  LED_PING,
+  /** switch serial port to 32 bit big endian baudrate */
+  LED_SET_BAUD,
+  /** frame latched: sequence number, damaged packets (to host) */
+  LED_ACK,
 };
 
 
 /*****************************************************************************/
 
-/** receive a packet from USB host */
-void rxPacket(char opcode, char ssize)
+/** handle a packet from USB host */
+void rxPacket(char opcode, char *tmp, char ssize)
 {
 
   LOG("Got packet, opcode: %d size: %d", opcode, ssize);
 
-  char tmp[64];	
-  if(ssize > 0)
-    Serial.readBytes(tmp, ssize < 64 ? ssize : 64);
-
   /* handle various packet types */
   switch(opcode)
   {
@@ -296,6 +443,7 @@ void rxPacket(char opcode, char ssize)
       /* re-initialize new amount of chips */
       for(int i=0; i < priv.n_devices; i++)
         chipInit(i);
+      invalidateBuffer();
       break;
     }
 
@@ -315,6 +463,14 @@ void rxPacket(char opcode, char ssize)
       LOG("LED_LATCH");
 
       showBuffer();
+
+      /* acknowledge, so host can send next frame */
+      if(ssize >= 1)
+      {
+        char ack[2] = { tmp[0], (char) priv.rxErrors };
+        txPacket(LED_ACK, ack, 2);
+        priv.rxErrors = 0;
+      }
       break;
     }
 
@@ -325,29 +481,150 @@ void rxPacket(char opcode, char ssize)
       char i;
       for(i=0; i < ssize; i++)
       {
-        priv.status[i] = tmp[i];
+        setRow(i / 8, i % 8, tmp[i]);
       }
 
       break;
     }
 
+  case LED_UPLOAD_DELTA:
+    {
+      LOG("LED_UPLOAD_DELTA");
+
+      char i;
+      for(i=0; i + 2 < ssize; i += 3)
+      {
+        setRow(tmp[i], tmp[i+1], tmp[i+2]);
+      }
+
+      break;
+    }
+
+  case LED_PING:
+    {
+      LOG("LED_PING");
+
+      /* host reached us, keep the current rate */
+      priv.baudratePending = false;
+      txPacket(opcode, tmp, ssize);
+      break;
+    }
+
+  case LED_SET_BAUD:
+    {
+      if(ssize < 4)
+        return;
+
+      unsigned long baud = 
+        (unsigned long) (unsigned char) tmp[0] << 24 |
+        (unsigned long) (unsigned char) tmp[1] << 16 |
+        (unsigned long) (unsigned char) tmp[2] << 8 |
+        (unsigned long) (unsigned char) tmp[3];
+
+      LOG("LED_SET_BAUD(%lu)", baud);
+
+      /* answer with the rate we're going to use */
+      if(baud < BAUDRATE_MIN || baud > BAUDRATE_MAX)
+        baud = priv.baudrate;
+
+      char reply[4] = { (char) (baud >> 24), (char) (baud >> 16),
+                        (char) (baud >> 8), (char) baud };
+      txPacket(opcode, reply, 4);
+
+      if(baud == priv.baudrate)
+        break;
+
+      setBaudrate(baud);
+      priv.baudratePending = true;
+      priv.baudrateDeadline = millis() + BAUDRATE_TIMEOUT;
+      break;
+    }
+
     /* huh? */
   default:
     {
       return;
     }
   }
+}
+
+
+/** 
+ * drop the first n bytes of the packet being received and continue at
+ * the next PACKET_SYNC in the remainder
+ */
+void rxResync(unsigned char n)
+{
+  while(n < priv.rxLen && priv.rx[n] != PACKET_SYNC)
+    n++;
+
+  priv.rxLen -= n;
+  memmove(priv.rx, priv.rx + n, priv.rxLen);
+}
+
+
+/** drop the damaged packet being received */
+void rxDrop()
+{
+  if(priv.rxErrors < 255)
+    priv.rxErrors++;
+
+  rxResync(1);
+}
 
-  /* throw away remaining data if we received too much */
-  if(ssize > 64)
+
+/** 
+ * handle all complete packets received so far. A damaged packet is 
+ * dropped and we re-align to the next PACKET_SYNC that follows its sync 
+ * byte, so the packets already received after it aren't lost.
+ */
+void rxParse()
+{
+  while(priv.rxLen >= 3)
   {
-    int i;
-    for(i=0; i < ssize-64; i++)
-      Serial.read();
+    unsigned char size = priv.rx[2];
+
+    /* no packet is that big, this wasn't a sync byte */
+    if(size > PACKET_DATA_MAX)
+    {
+      rxDrop();
+      continue;
+    }
+
+    /* incomplete */
+    if(priv.rxLen < size + 4)
+      return;
+
+    unsigned char crc = 0;
+    for(unsigned char i=1; i < size + 3; i++)
+      crc = crc8(crc, priv.rx[i]);
+
+    if(crc != priv.rx[size + 3])
+    {
+      LOG("CRC error");
+      rxDrop();
+      continue;
+    }
+
+    rxPacket(priv.rx[1], (char *) priv.rx + 3, size);
+    rxResync(size + 4);
   }
 }
 
 
+/** receive one byte from USB host */
+void rxByte(unsigned char b)
+{
+  /* wait for sync */
+  if(priv.rxLen == 0 && b != PACKET_SYNC)
+    return;
+
+  priv.rx[priv.rxLen++] = b;
+  priv.rxTime = millis();
+  rxParse();
+}
+
+
 /*****************************************************************************/
 
 /** arduino setup function (called once after reset) */
@@ -360,15 +637,13 @@ void setup()
   priv.SPI_MOSI = PIN_DATA;
   priv.SPI_CLK  = PIN_CLOCK;
   priv.SPI_CS   = PIN_CS;
-  pinMode(priv.SPI_MOSI, OUTPUT);
-  pinMode(priv.SPI_CLK,  OUTPUT);
-  pinMode(priv.SPI_CS,   OUTPUT);
-  digitalWrite(priv.SPI_CS,HIGH);
+  spiInit();
 
   /* clear our buffer */
   int i;
   for(i=0; i < sizeof(priv.status); i++) 
     priv.status[i] = 0x00;
+  invalidateBuffer();
 
   for(i=0; i < priv.n_devices; i++) 
   {
@@ -376,33 +651,41 @@ void setup()
   }
 
   /* initialize serial communication */
-  Serial.begin(115200);
+  priv.baudrate = BAUDRATE_DEFAULT;
+  priv.baudratePending = false;
+  Serial.begin(priv.baudrate);
 
   LOG("Initialized...");
 }
 
 /**
- * Test packets:
- * 0x4 0x8 0xFF 0xFF 0xFF 0xFF 0xFF 0xFF 0xFF 0xFF 
- * 0x3 0x0
- * 
- * 0x1 0x1 0x1 0x4 0x8 0xFF 0xFF 0xFF 0xFF 0xFF 0xFF 0xFF 0xFF 0x3 0x0
- * 
- * Gives:
- * 0xffff 0x2 0x0 0x3 0xffff 0x4 0x0 0x5 0xffff 0x6 0x0 0x7 0xffff 0x8 0x0
+ * Test packets (upload 8 rows, latch):
+ * 0xA5 0x4 0x8 0xFF 0xFF 0xFF 0xFF 0xFF 0xFF 0xFF 0xFF 0xB1
+ * 0xA5 0x3 0x0 0x3F
  */
 
 /** arduino loop function (called repeatedly)*/
 void loop()
 {
-  char opcode, size;
-
-  /* wait for 2 bytes at least */
-  if(Serial.available() < 2)
-    return;
+  /* host can't reach us at the new rate, go back to the default */
+  if(priv.baudratePending && 
+     (long) (millis() - priv.baudrateDeadline) >= 0)
+  {
+    priv.baudratePending = false;
+    setBaudrate(BAUDRATE_DEFAULT);
+  }
 
-  opcode = Serial.read();
-  size = Serial.read();
+  while(Serial.available() > 0)
+    rxByte(Serial.read());
 
-  rxPacket(opcode, size);
+  /* 
+   * host sends a packet in one go, so a stalled one started at a false 
+   * sync byte (e.g. after a lost byte) 
+   */
+  if(priv.rxLen > 0 && millis() - priv.rxTime > PACKET_TIMEOUT)
+  {
+    LOG("Packet timeout");
+    rxDrop();
+    rxParse();
+  }
 }
@@ -43,18 +43,43 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <termios.h>
 #include <string.h>
 #include <niftyled.h>
 #include "config.h"
 #include "arduino_max72xx.h"
+#include "baudrate.h"
+#include "bitpack.h"
 
 
 
+/** max. size of one packet (sync, opcode, size, data, crc) */
+#define AD_PACKET_MAX   (4 + AD_PACKET_DATA_MAX)
+/** packets written at once (upload + latch or all queued control packets) */
+#define AD_TXBUF_SIZE   (4 * AD_PACKET_MAX)
+/** control packets queued for the I/O thread (fits in txBuf) */
+#define AD_CTL_SIZE     AD_TXBUF_SIZE
+/** ms to wait for a reply of the arduino */
+#define AD_REPLY_TIMEOUT        250
+/** pings until the arduino must have booted (opening the port resets it) */
+#define AD_BOOT_PINGS           10
+/** max. frames latched but not acknowledged */
+#define AD_WINDOW_MAX           8
+/** ms after which a frame that wasn't acknowledged is considered lost */
+#define AD_ACK_TIMEOUT          500
+
 
 /** private info of our "hardware" */
 struct priv
@@ -65,8 +90,14 @@ struct priv
         char id[1024];
         /* amount of LEDs connected to arduino */
         LedCount ledcount;
-        /* buffer to contain our monochrome buffer */
-        unsigned char *buffer;
+        /* monochrome buffer (1 bit per LED, MSB first) */
+        unsigned char *packed;
+        /* bytes in packed */
+        size_t packedSize;
+        /* monochrome buffer as the arduino has it */
+        unsigned char *uploaded;
+        /* uploaded matches the arduino (else next upload is a full one) */
+        bool uploadedValid;
         /* threshold to use for greyscale -> monochrome conversion */
         unsigned char threshold;
         /* scan limit for MAX72xx multiplexing */
@@ -75,57 +106,693 @@ struct priv
         int fd;
         /* place to save current termios of serial port */
         struct termios oldtio;
+        /* baudrate to negotiate with the arduino */
+        unsigned int baudrate;
+        /* baudrate port & arduino currently use */
+        unsigned int baudrateActive;
+        /* sequence number of last ping */
+        unsigned char pingSeq;
+        /* packets queued for the next write() */
+        unsigned char txBuf[AD_TXBUF_SIZE];
+        /* bytes in txBuf */
+        size_t txLen;
+        /* bytes of txBuf the I/O thread already wrote */
+        size_t txDone;
+        /* control packets waiting for the I/O thread (never dropped) */
+        unsigned char ctl[AD_CTL_SIZE];
+        /* bytes in ctl */
+        size_t ctlLen;
+        /* last frame given to _show(), sent by the I/O thread */
+        unsigned char *frame;
+        /* frame wasn't sent yet */
+        bool frameReady;
+        /* frames replaced by a newer one before they were sent */
+        unsigned int droppedFrames;
+        /* I/O thread writing txBuf & handling acks */
+        pthread_t io;
+        /* I/O thread is (supposed to be) running */
+        bool ioRunning;
+        /* I/O thread quit because of an error */
+        bool ioFailed;
+        /* epoll instance & eventfd to wake up the I/O thread */
+        int epfd, evfd;
+        /* protects ctl, frame, uploaded & statistics while io is running */
+        pthread_mutex_t lock;
+        /* signalled when ctl has space again */
+        pthread_cond_t ctlSpace;
+        /* bytes received but not parsed yet */
+        unsigned char rx[AD_PACKET_MAX];
+        /* bytes in rx */
+        size_t rxLen;
+        /* max. frames in flight */
+        unsigned int window;
+        /* frames latched but not acknowledged yet (ring, oldest first) */
+        struct
+        {
+                /* sequence number sent with OP_LATCH */
+                unsigned char seq;
+                /* time of latch (us) */
+                int64_t sent;
+                /* bytes written for this frame */
+                size_t bytes;
+        } inflight[AD_WINDOW_MAX];
+        unsigned int inflightFirst, inflightCount;
+        /* sequence number of last OP_LATCH */
+        unsigned char latchSeq;
+        /* smoothed round-trip time of a frame (us) */
+        int64_t rtt;
+        /* acknowledged bytes per second */
+        unsigned int throughput;
+        /* start of current throughput measurement (us) & bytes since */
+        int64_t statStart;
+        size_t statBytes;
+        /* frames that were never acknowledged */
+        unsigned int lostFrames;
 };
 
 
 
 
-/** send data packet to arduino */
+/** CRC-8 (polynomial 0x07) of buf, continuing from crc */
+static unsigned char ad_crc8(unsigned char crc,
+                             const unsigned char *buf, size_t size)
+{
+        size_t i;
+        for(i = 0; i < size; i++)
+        {
+                crc ^= buf[i];
+
+                int bit;
+                for(bit = 0; bit < 8; bit++)
+                        crc = (unsigned char) (crc & 0x80 ?
+                                               (crc << 1) ^ 0x07 : crc << 1);
+        }
+
+        return crc;
+}
+
+
+/** frame packet into buf (space for 4 + size bytes), returns its length */
+static size_t ad_packetEncode(unsigned char *buf, unsigned char opcode,
+                              const unsigned char *data, unsigned char size)
+{
+        buf[0] = AD_PACKET_SYNC;
+        buf[1] = opcode;
+        buf[2] = size;
+        if(size)
+                memcpy(buf + 3, data, size);
+        buf[3 + size] = ad_crc8(0, buf + 1, 2 + size);
+
+        return 4 + (size_t) size;
+}
+
+
+/** write all queued packets with one write() (I/O thread not running) */
+NftResult ad_txFlush(struct priv *p)
+{
+        size_t done = 0;
+        while(done < p->txLen)
+        {
+                ssize_t r = write(p->fd, p->txBuf + done, p->txLen - done);
+                if(r == -1)
+                {
+                        if(errno == EINTR)
+                                continue;
+
+                        /* port is non-blocking */
+                        if(errno == EAGAIN)
+                        {
+                                struct pollfd pfd = {.fd = p->fd,.events =
+                                                POLLOUT };
+                                poll(&pfd, 1, -1);
+                                continue;
+                        }
+
+                        NFT_LOG_PERROR("write()");
+                        p->txLen = 0;
+                        return NFT_FAILURE;
+                }
+                done += (size_t) r;
+        }
+
+        p->txLen = 0;
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * queue data packet for arduino. Packets are only written by
+ * ad_txFlush(), so a whole frame (upload & latch) goes out in one
+ * write() and the USB-serial driver can send it in one transfer.
+ */
+NftResult ad_txQueue(struct priv *p,
+                     unsigned char opcode,
+                     const unsigned char *data, unsigned char size)
+{
+        if(size > AD_PACKET_DATA_MAX)
+        {
+                NFT_LOG(L_ERROR, "Packet too big (%d > %d bytes)", size,
+                        AD_PACKET_DATA_MAX);
+                return NFT_FAILURE;
+        }
+
+        /* make room */
+        if(p->txLen + 4 + size > sizeof(p->txBuf) && !ad_txFlush(p))
+                return NFT_FAILURE;
+
+        p->txLen += ad_packetEncode(p->txBuf + p->txLen, opcode, data, size);
+
+        return NFT_SUCCESS;
+}
+
+
+/** wake up I/O thread */
+static void ad_ioWake(struct priv *p)
+{
+        uint64_t one = 1;
+        if(write(p->evfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+                NFT_LOG_PERROR("write()");
+}
+
+
+/**
+ * queue control packet for the I/O thread. Control packets are never
+ * dropped, if the queue is full we wait until there's space.
+ */
+NftResult ad_ctlQueue(struct priv *p,
+                      unsigned char opcode,
+                      const unsigned char *data, unsigned char size)
+{
+        if(size > AD_PACKET_DATA_MAX)
+        {
+                NFT_LOG(L_ERROR, "Packet too big (%d > %d bytes)", size,
+                        AD_PACKET_DATA_MAX);
+                return NFT_FAILURE;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        while(!p->ioFailed && p->ctlLen + 4 + size > sizeof(p->ctl))
+        {
+                /* nobody would make space */
+                if(!p->ioRunning)
+                {
+                        pthread_mutex_unlock(&p->lock);
+                        NFT_LOG(L_ERROR, "Too many control packets queued");
+                        return NFT_FAILURE;
+                }
+                pthread_cond_wait(&p->ctlSpace, &p->lock);
+        }
+
+        if(p->ioFailed)
+        {
+                pthread_mutex_unlock(&p->lock);
+                return NFT_FAILURE;
+        }
+
+        p->ctlLen += ad_packetEncode(p->ctl + p->ctlLen, opcode, data, size);
+        pthread_mutex_unlock(&p->lock);
+
+        if(p->ioRunning)
+                ad_ioWake(p);
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * send data packet to arduino (after all queued packets). If the I/O
+ * thread runs - or will run once the hardware is initialized - it's
+ * handed over as control packet.
+ */
 NftResult ad_txPacket(struct priv *p,
                       unsigned char opcode,
-                      unsigned char *data, unsigned char size)
+                      const unsigned char *data, unsigned char size)
 {
+        if(p->ioRunning || p->fd == -1)
+                return ad_ctlQueue(p, opcode, data, size);
+
+        if(!ad_txQueue(p, opcode, data, size))
+                return NFT_FAILURE;
+
+        return ad_txFlush(p);
+}
+
+
+/** monotonic time in us */
+static int64_t ad_now(void)
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return (int64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
 
-        /* send opcode */
-        if(write(p->fd, &opcode, 1) == -1)
+/** read what arduino sent, wait at most timeout ms for it */
+NftResult ad_rxFill(struct priv *p, int timeout)
+{
+        for(;;)
         {
-                NFT_LOG_PERROR("write()");
+                struct pollfd pfd = {.fd = p->fd,.events = POLLIN };
+                int r = poll(&pfd, 1, timeout);
+                if(r == -1)
+                {
+                        if(errno == EINTR)
+                                continue;
+
+                        NFT_LOG_PERROR("poll()");
+                        return NFT_FAILURE;
+                }
+
+                /* timeout */
+                if(r == 0)
+                        return NFT_FAILURE;
+
+                ssize_t n = read(p->fd, p->rx + p->rxLen,
+                                 sizeof(p->rx) - p->rxLen);
+                if(n == -1)
+                {
+                        if(errno == EINTR)
+                                continue;
+
+                        if(errno == EAGAIN)
+                                return NFT_FAILURE;
+
+                        NFT_LOG_PERROR("read()");
+                        return NFT_FAILURE;
+                }
+                if(n == 0)
+                        return NFT_FAILURE;
+
+                p->rxLen += (size_t) n;
+                return NFT_SUCCESS;
+        }
+}
+
+
+/** drop first n received bytes & everything up to the next sync byte */
+static void ad_rxResync(struct priv *p, size_t n)
+{
+        while(n < p->rxLen && p->rx[n] != AD_PACKET_SYNC)
+                n++;
+
+        p->rxLen -= n;
+        memmove(p->rx, p->rx + n, p->rxLen);
+}
+
+
+/**
+ * receive one packet from arduino. Everything that's no valid packet is
+ * skipped, after a damaged one we continue at the next sync byte in it.
+ * Bytes of an incomplete packet are kept for the next call.
+ *
+ * @param data space for AD_PACKET_DATA_MAX bytes
+ * @param timeout max. ms to wait (0 = only take what's there already)
+ */
+NftResult ad_rxPacket(struct priv *p, unsigned char *opcode,
+                      unsigned char *data, unsigned char *size, int timeout)
+{
+        int64_t deadline = ad_now() + (int64_t) timeout * 1000;
+        for(;;)
+        {
+                unsigned char *packet = p->rx;
+                ad_rxResync(p, 0);
+
+                /* no packet is that big, this wasn't a sync byte */
+                if(p->rxLen >= 3 && packet[2] > AD_PACKET_DATA_MAX)
+                {
+                        ad_rxResync(p, 1);
+                        continue;
+                }
+
+                /* incomplete */
+                if(p->rxLen < 3 || p->rxLen < 4 + (size_t) packet[2])
+                {
+                        int64_t left = deadline - ad_now();
+                        if(!ad_rxFill(p, left > 0 ? (int) (left / 1000) : 0))
+                                return NFT_FAILURE;
+                        continue;
+                }
+
+                if(ad_crc8(0, packet + 1, 2 + packet[2]) !=
+                   packet[3 + packet[2]])
+                {
+                        NFT_LOG(L_DEBUG, "CRC error in packet from \"%s\"",
+                                p->id);
+                        ad_rxResync(p, 1);
+                        continue;
+                }
+
+                *opcode = packet[1];
+                *size = packet[2];
+                memcpy(data, packet + 3, packet[2]);
+                ad_rxResync(p, 4 + (size_t) packet[2]);
+                return NFT_SUCCESS;
+        }
+}
+
+
+/** oldest frame in flight was never acknowledged */
+static void ad_frameLost(struct priv *p)
+{
+        p->inflightFirst = (p->inflightFirst + 1) % AD_WINDOW_MAX;
+        p->inflightCount--;
+        p->lostFrames++;
+
+        /* we don't know which rows the arduino has */
+        p->uploadedValid = false;
+}
+
+
+/** handle OP_ACK: arduino latched frame data[0] */
+static void ad_ackHandle(struct priv *p, const unsigned char *data,
+                         unsigned char size)
+{
+        if(size < 2)
+                return;
+
+        /* arduino dropped packets, maybe some of our rows */
+        if(data[1])
+        {
+                NFT_LOG(L_DEBUG,
+                        "Arduino at \"%s\" dropped %d damaged packets",
+                        p->id, data[1]);
+                p->uploadedValid = false;
+        }
+
+        unsigned int i;
+        for(i = 0; i < p->inflightCount; i++)
+        {
+                if(p->inflight[(p->inflightFirst + i) % AD_WINDOW_MAX].seq ==
+                   data[0])
+                        break;
+        }
+
+        /* stale ack */
+        if(i == p->inflightCount)
+                return;
+
+        /* frames latched before weren't acknowledged */
+        while(i-- > 0)
+                ad_frameLost(p);
+
+        int64_t now = ad_now();
+        int64_t rtt = now - p->inflight[p->inflightFirst].sent;
+        p->rtt = p->rtt ? p->rtt + (rtt - p->rtt) / 8 : rtt;
+
+        p->statBytes += p->inflight[p->inflightFirst].bytes;
+        if(now - p->statStart >= 1000000)
+        {
+                p->throughput = (unsigned int)
+                        ((int64_t) p->statBytes * 1000000 /
+                         (now - p->statStart));
+                p->statStart = now;
+                p->statBytes = 0;
+        }
+
+        p->inflightFirst = (p->inflightFirst + 1) % AD_WINDOW_MAX;
+        p->inflightCount--;
+}
+
+
+/**
+ * handle acks that arrived, wait until no more than "inflight" frames are
+ * unacknowledged. A frame that isn't acknowledged within AD_ACK_TIMEOUT ms
+ * is considered lost.
+ */
+void ad_ackWait(struct priv *p, unsigned int inflight)
+{
+        while(p->inflightCount > 0)
+        {
+                /* block only if there are too many frames in flight */
+                int timeout = 0;
+                int64_t left = p->inflight[p->inflightFirst].sent +
+                        AD_ACK_TIMEOUT * 1000 - ad_now();
+                if(p->inflightCount > inflight && left > 0)
+                        timeout = (int) ((left + 999) / 1000);
+
+                unsigned char opcode, data[AD_PACKET_DATA_MAX], size;
+                if(ad_rxPacket(p, &opcode, data, &size, timeout))
+                {
+                        if(opcode == OP_ACK)
+                                ad_ackHandle(p, data, size);
+                        continue;
+                }
+
+                if(p->inflightCount <= inflight)
+                        break;
+
+                if(left <= 0)
+                {
+                        NFT_LOG(L_WARNING,
+                                "Arduino at \"%s\" didn't acknowledge frame %d",
+                                p->id, p->inflight[p->inflightFirst].seq);
+                        ad_frameLost(p);
+                }
+        }
+}
+
+
+/** wait for frames in flight, then drop everything else received */
+void ad_rxFlush(struct priv *p)
+{
+        ad_ackWait(p, 0);
+        tcflush(p->fd, TCIFLUSH);
+        p->rxLen = 0;
+}
+
+
+/** receive packet "opcode" from arduino, handle acks meanwhile */
+NftResult ad_rxReply(struct priv *p, unsigned char opcode,
+                     unsigned char *data, unsigned char *size, int timeout)
+{
+        int64_t deadline = ad_now() + (int64_t) timeout * 1000;
+        for(;;)
+        {
+                int64_t left = deadline - ad_now();
+                unsigned char op;
+                if(!ad_rxPacket(p, &op, data, size,
+                                left > 0 ? (int) (left / 1000) : 0))
+                        return NFT_FAILURE;
+
+                if(op == opcode)
+                        return NFT_SUCCESS;
+
+                if(op == OP_ACK)
+                        ad_ackHandle(p, data, *size);
+        }
+}
+
+
+/** check if arduino answers, try up to "tries" times */
+NftResult ad_ping(struct priv *p, int tries)
+{
+        while(tries-- > 0)
+        {
+                unsigned char seq = ++p->pingSeq;
+                unsigned char reply[AD_PACKET_DATA_MAX], size;
+
+                /* drop stale replies */
+                ad_rxFlush(p);
+
+                if(!ad_txPacket(p, OP_PING, &seq, 1))
+                        return NFT_FAILURE;
+
+                if(ad_rxReply(p, OP_PING, reply, &size, AD_REPLY_TIMEOUT) &&
+                   size == 1 && reply[0] == seq)
+                        return NFT_SUCCESS;
+        }
+
+        return NFT_FAILURE;
+}
+
+
+/**
+ * switch arduino and serial port to baud. The arduino answers
+ * OP_SET_BAUD with the rate it's going to use, then waits for a ping at
+ * that rate. Without one it returns to AD_BAUDRATE_DEFAULT after
+ * AD_BAUDRATE_FALLBACK ms and so do we.
+ */
+NftResult ad_setBaudrate(struct priv *p, unsigned int baud)
+{
+        if(baud == p->baudrateActive)
+                return NFT_SUCCESS;
+
+        unsigned char data[4] = {
+                (unsigned char) (baud >> 24), (unsigned char) (baud >> 16),
+                (unsigned char) (baud >> 8), (unsigned char) baud
+        };
+        unsigned char reply[AD_PACKET_DATA_MAX], size;
+
+        ad_rxFlush(p);
+        if(!ad_txPacket(p, OP_SET_BAUD, data, sizeof(data)))
+                return NFT_FAILURE;
+
+        if(!ad_rxReply(p, OP_SET_BAUD, reply, &size, AD_REPLY_TIMEOUT) ||
+           size != sizeof(data) ||
+           memcmp(reply, data, sizeof(data)) != 0)
+        {
+                NFT_LOG(L_WARNING,
+                        "Arduino at \"%s\" refused %u baud (old firmware?), staying at %u",
+                        p->id, baud, p->baudrateActive);
                 return NFT_FAILURE;
         }
 
+        unsigned int actual = baud;
+        if(ad_baudrate_set(p->fd, baud, &actual) == 0 && ad_ping(p, 3))
+        {
+                NFT_LOG(L_INFO, "Arduino at \"%s\" now uses %u baud (%u)",
+                        p->id, baud, actual);
+                p->baudrateActive = baud;
+                return NFT_SUCCESS;
+        }
+
+        NFT_LOG(L_WARNING,
+                "Arduino at \"%s\" unreachable at %u baud, falling back to %u",
+                p->id, baud, AD_BAUDRATE_DEFAULT);
 
-        /* send datasize */
-        if(write(p->fd, &size, 1) == -1)
+        /* wait until arduino fell back, too */
+        struct timespec t = {
+                .tv_sec = AD_BAUDRATE_FALLBACK / 1000,
+                .tv_nsec = (AD_BAUDRATE_FALLBACK % 1000 + 100) * 1000000L
+        };
+        ad_baudrate_set(p->fd, AD_BAUDRATE_DEFAULT, NULL);
+        nanosleep(&t, NULL);
+        p->baudrateActive = AD_BAUDRATE_DEFAULT;
+
+        if(!ad_ping(p, 1))
+                NFT_LOG(L_ERROR, "Arduino at \"%s\" doesn't answer anymore",
+                        p->id);
+
+        return NFT_FAILURE;
+}
+
+
+/** resize monochrome buffer for ledcount LEDs, new LEDs are off */
+NftResult ad_packedResize(struct priv * p, LedCount ledcount)
+{
+        size_t size = (ledcount + 7) / 8;
+        if(size == p->packedSize)
+                return NFT_SUCCESS;
+
+        unsigned char *packed, *frame, *uploaded;
+        if(!(packed = realloc(p->packed, size)))
         {
-                NFT_LOG_PERROR("write()");
+                NFT_LOG_PERROR("realloc");
                 return NFT_FAILURE;
         }
+        p->packed = packed;
 
+        if(!(frame = realloc(p->frame, size)))
+        {
+                NFT_LOG_PERROR("realloc");
+                return NFT_FAILURE;
+        }
+        p->frame = frame;
 
-        /* send data */
-        if(write(p->fd, data, (size_t) size) == -1)
+        if(!(uploaded = realloc(p->uploaded, size)))
         {
-                NFT_LOG_PERROR("write()");
+                NFT_LOG_PERROR("realloc");
                 return NFT_FAILURE;
         }
+        p->uploaded = uploaded;
+
+        if(size > p->packedSize)
+        {
+                memset(packed + p->packedSize, 0, size - p->packedSize);
+                memset(frame + p->packedSize, 0, size - p->packedSize);
+        }
+
+        p->packedSize = size;
+        p->uploadedValid = false;
 
         return NFT_SUCCESS;
 }
 
 
-/** send buffer to arduino */
+/** queue buffer for arduino, it's written together with the latch */
 NftResult ad_sendBuffer(struct priv * p,
-                        unsigned char *buf, unsigned char size)
+                        const unsigned char *buf, unsigned char size)
 {
         NFT_LOG(L_NOISY, "Uploading to arduino: %d bytes", size);
-        return ad_txPacket(p, OP_UPLOAD, buf, size);
+        return ad_txQueue(p, OP_UPLOAD, buf, size);
 }
 
 
-/** latch previously sent data to LEDs */
+/**
+ * queue rows of frame that changed since the last upload as
+ * (chip, row, byte) triples, or the whole frame if that's shorter
+ */
+NftResult ad_sendDelta(struct priv * p, const unsigned char *frame)
+{
+        /* byte i of buffer is row i % 8 of chip i / 8 */
+        size_t changed = 0, i;
+        if(p->uploadedValid)
+        {
+                for(i = 0; i < p->packedSize; i++)
+                        if(frame[i] != p->uploaded[i])
+                                changed++;
+        }
+
+        size_t packets = (changed + AD_DELTA_MAX - 1) / AD_DELTA_MAX;
+        if(!p->uploadedValid || changed * 3 + packets * 2 >= p->packedSize + 2)
+        {
+                if(!ad_sendBuffer(p, frame, (unsigned char) p->packedSize))
+                        return NFT_FAILURE;
+        }
+        else
+        {
+                NFT_LOG(L_NOISY, "Uploading %zu changed rows to arduino",
+                        changed);
+
+                unsigned char delta[AD_DELTA_MAX * 3];
+                size_t n = 0;
+                for(i = 0; i < p->packedSize; i++)
+                {
+                        if(frame[i] == p->uploaded[i])
+                                continue;
+
+                        delta[n++] = (unsigned char) (i / 8);
+                        delta[n++] = (unsigned char) (i % 8);
+                        delta[n++] = frame[i];
+
+                        /* packet full */
+                        if(n == sizeof(delta))
+                        {
+                                if(!ad_txQueue(p, OP_UPLOAD_DELTA, delta, n))
+                                        return NFT_FAILURE;
+                                n = 0;
+                        }
+                }
+
+                if(n && !ad_txQueue(p, OP_UPLOAD_DELTA, delta, n))
+                        return NFT_FAILURE;
+        }
+
+        memcpy(p->uploaded, frame, p->packedSize);
+        p->uploadedValid = true;
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * queue latch of previously queued data to LEDs, the frame is in flight
+ * until the arduino acknowledges it
+ */
 NftResult ad_latch(struct priv * p)
 {
-        return ad_txPacket(p, OP_LATCH, NULL, 0);
+        size_t bytes = p->txLen + 5;
+        unsigned char seq = ++p->latchSeq;
+        if(!ad_txQueue(p, OP_LATCH, &seq, 1))
+                return NFT_FAILURE;
+
+        unsigned int i =
+                (p->inflightFirst + p->inflightCount) % AD_WINDOW_MAX;
+        p->inflight[i].seq = seq;
+        p->inflight[i].sent = ad_now();
+        p->inflight[i].bytes = bytes;
+        p->inflightCount++;
+
+        return NFT_SUCCESS;
 }
 
 
@@ -150,6 +817,248 @@ NftResult ad_setIntensity(struct priv * p, unsigned char intensity)
 
 
 
+/** I/O thread quits because the port is broken (call with lock held) */
+static void ad_ioFail(struct priv *p)
+{
+        p->ioFailed = true;
+        pthread_cond_broadcast(&p->ctlSpace);
+}
+
+
+/**
+ * I/O thread. The port is non-blocking, so neither _show() nor control
+ * packets ever wait for the USB-serial driver. Whenever txBuf is written
+ * completely it's refilled with all queued control packets or - if none
+ * are queued and less than "window" frames are in flight - with the
+ * latest frame. The delta upload is built only then, so a frame that's
+ * replaced before it's sent is simply skipped.
+ */
+static void *ad_ioThread(void *arg)
+{
+        struct priv *p = arg;
+        bool pollout = false;
+
+        for(;;)
+        {
+                pthread_mutex_lock(&p->lock);
+                if(!p->ioRunning)
+                {
+                        pthread_mutex_unlock(&p->lock);
+                        break;
+                }
+
+                /* refill */
+                if(p->txDone == p->txLen)
+                {
+                        p->txLen = p->txDone = 0;
+                        if(p->ctlLen)
+                        {
+                                memcpy(p->txBuf, p->ctl, p->ctlLen);
+                                p->txLen = p->ctlLen;
+                                p->ctlLen = 0;
+                                pthread_cond_broadcast(&p->ctlSpace);
+                        }
+                        else if(p->frameReady &&
+                                p->inflightCount < p->window)
+                        {
+                                p->frameReady = false;
+                                if(!ad_sendDelta(p, p->frame) ||
+                                   !ad_latch(p))
+                                        p->txLen = 0;
+                        }
+                }
+
+                /* more to send once txBuf is written? */
+                bool pending = p->ctlLen ||
+                        (p->frameReady && p->inflightCount < p->window);
+
+                /* wake up when oldest frame in flight times out */
+                int timeout = -1;
+                if(p->inflightCount)
+                {
+                        int64_t left = p->inflight[p->inflightFirst].sent +
+                                AD_ACK_TIMEOUT * 1000 - ad_now();
+                        timeout = left > 0 ? (int) ((left + 999) / 1000) : 0;
+                }
+                pthread_mutex_unlock(&p->lock);
+
+                /* write as much as the driver takes */
+                while(p->txDone < p->txLen)
+                {
+                        ssize_t r = write(p->fd, p->txBuf + p->txDone,
+                                          p->txLen - p->txDone);
+                        if(r == -1)
+                        {
+                                if(errno == EINTR)
+                                        continue;
+                                if(errno == EAGAIN)
+                                        break;
+
+                                NFT_LOG_PERROR("write()");
+                                p->txDone = p->txLen;
+                                break;
+                        }
+                        p->txDone += (size_t) r;
+                }
+
+                if(p->txDone == p->txLen && pending)
+                        timeout = 0;
+
+                /* wait for POLLOUT only while txBuf isn't written */
+                if(pollout != (p->txDone < p->txLen))
+                {
+                        pollout = !pollout;
+                        struct epoll_event ev = {
+                                .events = EPOLLIN | (pollout ? EPOLLOUT : 0),
+                                .data.fd = p->fd
+                        };
+                        epoll_ctl(p->epfd, EPOLL_CTL_MOD, p->fd, &ev);
+                }
+
+                struct epoll_event ev[2];
+                int n = epoll_wait(p->epfd, ev, 2, timeout);
+                if(n == -1 && errno != EINTR)
+                {
+                        NFT_LOG_PERROR("epoll_wait()");
+                        pthread_mutex_lock(&p->lock);
+                        ad_ioFail(p);
+                        pthread_mutex_unlock(&p->lock);
+                        break;
+                }
+
+                int i;
+                for(i = 0; i < n; i++)
+                {
+                        /* woken up */
+                        if(ev[i].data.fd == p->evfd)
+                        {
+                                uint64_t count;
+                                if(read(p->evfd, &count, sizeof(count)) == -1)
+                                        NFT_LOG_PERROR("read()");
+                                continue;
+                        }
+
+                        if(ev[i].events & (EPOLLERR | EPOLLHUP))
+                        {
+                                NFT_LOG(L_ERROR,
+                                        "Serial port \"%s\" failed",
+                                        p->id);
+                                pthread_mutex_lock(&p->lock);
+                                ad_ioFail(p);
+                                pthread_mutex_unlock(&p->lock);
+                                return NULL;
+                        }
+
+                        /* handle acks */
+                        if(ev[i].events & EPOLLIN)
+                        {
+                                unsigned char opcode, data[AD_PACKET_DATA_MAX],
+                                        size;
+                                while(ad_rxPacket(p, &opcode, data, &size, 0))
+                                {
+                                        if(opcode != OP_ACK)
+                                                continue;
+
+                                        pthread_mutex_lock(&p->lock);
+                                        ad_ackHandle(p, data, size);
+                                        pthread_mutex_unlock(&p->lock);
+                                }
+                        }
+                }
+
+                /* frames that will never be acknowledged */
+                pthread_mutex_lock(&p->lock);
+                while(p->inflightCount &&
+                      ad_now() - p->inflight[p->inflightFirst].sent >=
+                      AD_ACK_TIMEOUT * 1000)
+                {
+                        NFT_LOG(L_WARNING,
+                                "Arduino at \"%s\" didn't acknowledge frame %d",
+                                p->id, p->inflight[p->inflightFirst].seq);
+                        ad_frameLost(p);
+                }
+                pthread_mutex_unlock(&p->lock);
+        }
+
+        return NULL;
+}
+
+
+/** start I/O thread */
+NftResult ad_ioStart(struct priv *p)
+{
+        if((p->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        {
+                NFT_LOG_PERROR("epoll_create1()");
+                return NFT_FAILURE;
+        }
+
+        if((p->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        {
+                NFT_LOG_PERROR("eventfd()");
+                close(p->epfd);
+                return NFT_FAILURE;
+        }
+
+        struct epoll_event ev = {.events = EPOLLIN,.data.fd = p->evfd };
+        struct epoll_event port = {.events = EPOLLIN,.data.fd = p->fd };
+        if(epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->evfd, &ev) == -1 ||
+           epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->fd, &port) == -1)
+        {
+                NFT_LOG_PERROR("epoll_ctl()");
+                close(p->evfd);
+                close(p->epfd);
+                return NFT_FAILURE;
+        }
+
+        p->txLen = p->txDone = 0;
+        p->ioFailed = false;
+        p->ioRunning = true;
+        if(pthread_create(&p->io, NULL, ad_ioThread, p) != 0)
+        {
+                NFT_LOG_PERROR("pthread_create");
+                p->ioRunning = false;
+                close(p->evfd);
+                close(p->epfd);
+                return NFT_FAILURE;
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * stop I/O thread. Control packets it didn't send yet are written now,
+ * a frame that wasn't sent stays for the next ad_ioStart().
+ */
+void ad_ioStop(struct priv *p)
+{
+        if(!p->ioRunning)
+                return;
+
+        pthread_mutex_lock(&p->lock);
+        p->ioRunning = false;
+        pthread_mutex_unlock(&p->lock);
+        ad_ioWake(p);
+
+        pthread_join(p->io, NULL);
+        close(p->evfd);
+        close(p->epfd);
+
+        /* rest of txBuf, then control packets */
+        p->txLen -= p->txDone;
+        memmove(p->txBuf, p->txBuf + p->txDone, p->txLen);
+        p->txDone = 0;
+        if(p->txLen + p->ctlLen > sizeof(p->txBuf) && !ad_txFlush(p))
+                p->txLen = 0;
+        memcpy(p->txBuf + p->txLen, p->ctl, p->ctlLen);
+        p->txLen += p->ctlLen;
+        p->ctlLen = 0;
+        ad_txFlush(p);
+}
+
+
+
 /******************************************************************************/
 
 /**
@@ -189,6 +1098,13 @@ static NftResult _init(void **privdata, LedHardware * h)
         /* defaults */
         p->ledcount = 0;
         p->threshold = 128;
+        p->baudrate = AD_BAUDRATE_DEFAULT;
+        p->window = 2;
+        p->fd = -1;
+        p->epfd = -1;
+        p->evfd = -1;
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->ctlSpace, NULL);
 
         /* 
          * register some dynamic properties for this plugin - those will be
@@ -200,6 +1116,24 @@ static NftResult _init(void **privdata, LedHardware * h)
         if(!led_hardware_plugin_prop_register
            (h, "scan_limit", LED_HW_CUSTOM_PROP_INT))
                 return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "baudrate", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "window", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "rtt_us", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "throughput", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "lost_frames", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (h, "dropped_frames", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
 
         return NFT_SUCCESS;
 }
@@ -222,9 +1156,20 @@ static void _deinit(void *privdata)
         /* unregister or settings-handlers */
         led_hardware_plugin_prop_unregister(p->hw, "threshold");
         led_hardware_plugin_prop_unregister(p->hw, "scan_limit");
+        led_hardware_plugin_prop_unregister(p->hw, "baudrate");
+        led_hardware_plugin_prop_unregister(p->hw, "window");
+        led_hardware_plugin_prop_unregister(p->hw, "rtt_us");
+        led_hardware_plugin_prop_unregister(p->hw, "throughput");
+        led_hardware_plugin_prop_unregister(p->hw, "lost_frames");
+        led_hardware_plugin_prop_unregister(p->hw, "dropped_frames");
+
+        /* free buffers */
+        free(p->packed);
+        free(p->frame);
+        free(p->uploaded);
 
-        /* free buffer */
-        free(p->buffer);
+        pthread_cond_destroy(&p->ctlSpace);
+        pthread_mutex_destroy(&p->lock);
 
         /* free structure we allocated in _init() */
         free(privdata);
@@ -280,7 +1225,16 @@ static NftResult _hw_init(void *privdata, const char *id)
         }
 
         /* open serial port */
-        if((p->fd = open(p->id, O_RDWR | O_NOCTTY)) == -1)
+        p->txLen = 0;
+        p->rxLen = 0;
+        p->inflightCount = 0;
+        p->rtt = 0;
+        p->throughput = 0;
+        p->statStart = ad_now();
+        p->statBytes = 0;
+        p->uploadedValid = false;
+        p->frameReady = false;
+        if((p->fd = open(p->id, O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1)
         {
                 NFT_LOG(L_ERROR, "Failed to open port \"%s\"", p->id);
                 NFT_LOG_PERROR("open()");
@@ -303,7 +1257,26 @@ static NftResult _hw_init(void *privdata, const char *id)
         newtio.c_cc[VTIME] = 5;
         tcflush(p->fd, TCIFLUSH);
         tcsetattr(p->fd, TCSANOW, &newtio);
+        p->baudrateActive = AD_BAUDRATE_DEFAULT;
 
+        /* negotiate faster rate once arduino is up (failing is no error) */
+        if(p->baudrate != p->baudrateActive)
+        {
+                if(ad_ping(p, AD_BOOT_PINGS))
+                        ad_setBaudrate(p, p->baudrate);
+                else
+                        NFT_LOG(L_WARNING,
+                                "Arduino at \"%s\" doesn't answer pings, staying at %u baud",
+                                p->id, p->baudrateActive);
+        }
+
+        /* from now on, all writes go through the I/O thread */
+        if(!ad_ioStart(p))
+        {
+                close(p->fd);
+                p->fd = -1;
+                return NFT_FAILURE;
+        }
 
         return NFT_SUCCESS;
 }
@@ -318,12 +1291,31 @@ static void _hw_deinit(void *privdata)
 
         struct priv *p = privdata;
 
+        ad_ioStop(p);
+
+        /* last frame given to _show() must still reach the LEDs */
+        if(p->frameReady && !p->ioFailed)
+        {
+                p->frameReady = false;
+                if(!ad_sendDelta(p, p->frame) || !ad_latch(p) ||
+                   !ad_txFlush(p))
+                        NFT_LOG(L_WARNING,
+                                "Failed to send last frame to \"%s\"", p->id);
+        }
+
+        /* wait until it's acknowledged or timed out */
+        ad_ackWait(p, 0);
+
+        /* leave arduino at the rate the next session expects */
+        ad_setBaudrate(p, AD_BAUDRATE_DEFAULT);
+
         /* restore old serial port settings */
         tcflush(p->fd, TCIFLUSH);
         tcsetattr(p->fd, TCSANOW, &p->oldtio);
 
         /* close serial port */
         close(p->fd);
+        p->fd = -1;
 }
 
 
@@ -389,6 +1381,51 @@ NftResult _get_handler(void *privdata, LedPluginParam o,
                                 data->custom.valuesize = sizeof(int);
                                 return NFT_SUCCESS;
                         }
+                        else if(strcmp(data->custom.name, "baudrate") == 0)
+                        {
+                                data->custom.value.i = (int) p->baudrate;
+                                data->custom.valuesize = sizeof(int);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "window") == 0)
+                        {
+                                data->custom.value.i = (int) p->window;
+                                data->custom.valuesize = sizeof(int);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "rtt_us") == 0)
+                        {
+                                pthread_mutex_lock(&p->lock);
+                                data->custom.value.i = (int) p->rtt;
+                                pthread_mutex_unlock(&p->lock);
+                                data->custom.valuesize = sizeof(int);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "throughput") == 0)
+                        {
+                                pthread_mutex_lock(&p->lock);
+                                data->custom.value.i = (int) p->throughput;
+                                pthread_mutex_unlock(&p->lock);
+                                data->custom.valuesize = sizeof(int);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "lost_frames") == 0)
+                        {
+                                pthread_mutex_lock(&p->lock);
+                                data->custom.value.i = (int) p->lostFrames;
+                                pthread_mutex_unlock(&p->lock);
+                                data->custom.valuesize = sizeof(int);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "dropped_frames")
+                                == 0)
+                        {
+                                pthread_mutex_lock(&p->lock);
+                                data->custom.value.i = (int) p->droppedFrames;
+                                pthread_mutex_unlock(&p->lock);
+                                data->custom.valuesize = sizeof(int);
+                                return NFT_SUCCESS;
+                        }
                         else
                         {
                                 NFT_LOG(L_ERROR,
@@ -460,6 +1497,11 @@ NftResult _set_handler(void *privdata, LedPluginParam o,
                         NFT_LOG(L_DEBUG, "Setting chipcount to %d",
                                 chipcount);
 
+                        /* chips are re-initialized, upload everything */
+                        pthread_mutex_lock(&p->lock);
+                        p->uploadedValid = false;
+                        pthread_mutex_unlock(&p->lock);
+
                         return ad_setChipcount(p, chipcount);
                 }
 
@@ -517,6 +1559,70 @@ NftResult _set_handler(void *privdata, LedPluginParam o,
 
                                 return NFT_SUCCESS;
                         }
+                        else if(strcmp(data->custom.name, "baudrate") == 0)
+                        {
+                                /* validate */
+                                if(data->custom.value.i < 1200 ||
+                                   data->custom.value.i > AD_BAUDRATE_MAX)
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "Baudrate %d outside range (1200-%d)",
+                                                data->custom.value.i,
+                                                AD_BAUDRATE_MAX);
+                                        return NFT_FAILURE;
+                                }
+
+                                /* set new value */
+                                p->baudrate =
+                                        (unsigned int) data->custom.value.i;
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"baudrate\" of \"%s\" to %u",
+                                        p->id, p->baudrate);
+
+                                /* negotiate now if hardware is initialized */
+                                if(p->fd != -1)
+                                {
+                                        ad_ioStop(p);
+                                        ad_setBaudrate(p, p->baudrate);
+                                        if(!ad_ioStart(p))
+                                                return NFT_FAILURE;
+                                }
+
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "window") == 0)
+                        {
+                                /* validate */
+                                if(data->custom.value.i < 1 ||
+                                   data->custom.value.i > AD_WINDOW_MAX)
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "Window %d outside range (1-%d)",
+                                                data->custom.value.i,
+                                                AD_WINDOW_MAX);
+                                        return NFT_FAILURE;
+                                }
+
+                                /* set new value */
+                                p->window =
+                                        (unsigned int) data->custom.value.i;
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"window\" of \"%s\" to %u frames",
+                                        p->id, p->window);
+
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "rtt_us") == 0 ||
+                                strcmp(data->custom.name, "throughput") == 0 ||
+                                strcmp(data->custom.name, "lost_frames") == 0 ||
+                                strcmp(data->custom.name,
+                                       "dropped_frames") == 0)
+                        {
+                                NFT_LOG(L_WARNING,
+                                        "\"%s\" is read-only. Not changing it.",
+                                        data->custom.name);
+                                return NFT_SUCCESS;
+                        }
                         else
                         {
                                 NFT_LOG(L_ERROR,
@@ -549,33 +1655,28 @@ NftResult _send(void *privdata, LedChain * c, LedCount count, LedCount offset)
 
         /* 8 bits-per-pixel buffer as given by niftyled */
         unsigned char *buffer = led_chain_get_buffer(c);
-        /* 1 bit-per-pixel buffer as needed by arduino */
-        unsigned char packed[64];
-
-        /* clear buffer */
-        memset(packed, 0, sizeof(packed));
-
-        /* convert to 8bpp to 1bpp */
-        LedCount i;
-        for(i = 0; i < p->ledcount; i++)
-        {
-                packed[i / 8] = packed[i / 8] << 1;
-
-                if(buffer[i] >= p->threshold)
-                        packed[i / 8] |= 1;
-        }
-
-
-        NFT_LOG(L_NOISY, "Packed buffer: %x %x %x %x %x %x %x %x",
-                packed[0], packed[1], packed[2], packed[3],
-                packed[4], packed[5], packed[6], packed[7]);
-
+        LedCount ledcount = led_chain_get_ledcount(c);
+        if(ledcount > p->ledcount)
+                ledcount = p->ledcount;
+
+        /* clip range */
+        if(offset >= ledcount)
+                return NFT_SUCCESS;
+        if(count == 0 || count > ledcount - offset)
+                count = ledcount - offset;
+
+        /* convert range from 8bpp to 1bpp, the rest is kept */
+        pthread_mutex_lock(&p->lock);
+        NftResult r = ad_packedResize(p, ledcount);
+        pthread_mutex_unlock(&p->lock);
+        if(!r)
+                return NFT_FAILURE;
+        ad_bitpack_range(p->packed, buffer, offset, count, p->threshold);
 
-        /* send buffer */
-        ad_sendBuffer(p, packed,
-                      (p->ledcount % 8 ==
-                       0 ? p->ledcount / 8 : p->ledcount / 8 + 1));
+        NFT_LOG(L_NOISY, "Packed LEDs %d - %d (%zu bytes)", offset,
+                offset + count, p->packedSize);
 
+        /* changes are sent by the I/O thread after _show() */
         return NFT_SUCCESS;
 }
 
@@ -594,8 +1695,23 @@ NftResult _show(void *privdata)
 
         struct priv *p = privdata;
 
-        ad_latch(p);
+        /* hand frame to I/O thread, never wait for the port */
+        pthread_mutex_lock(&p->lock);
+        if(p->ioFailed)
+        {
+                pthread_mutex_unlock(&p->lock);
+                return NFT_FAILURE;
+        }
+
+        /* latest frame wins */
+        if(p->frameReady)
+                p->droppedFrames++;
+        memcpy(p->frame, p->packed, p->packedSize);
+        p->frameReady = true;
+        pthread_mutex_unlock(&p->lock);
 
+        if(p->ioRunning)
+                ad_ioWake(p);
         return NFT_SUCCESS;
 }
 
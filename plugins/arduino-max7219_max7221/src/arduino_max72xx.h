@@ -60,8 +60,36 @@ typedef enum
         OP_LATCH,
         /** receive pixel data */
         OP_UPLOAD,
+        /** receive changed rows as (chip, row, byte) triples */
+        OP_UPLOAD_DELTA,
+        /** echo packet back to host */
+        OP_PING,
+        /** switch serial port to 32 bit big endian baudrate */
+        OP_SET_BAUD,
+        /** arduino latched frame: sequence number of OP_LATCH,
+            damaged packets dropped since last ack (arduino -> host) */
+        OP_ACK,
 } ArduinoOperation;
 
 
+/**
+ * every packet (both directions) is framed as
+ * AD_PACKET_SYNC, opcode, size, data[size], crc8
+ * crc8 has polynomial 0x07 & init 0 and covers opcode, size & data
+ */
+#define AD_PACKET_SYNC          0xA5
+/** max. data bytes of one packet the arduino accepts */
+#define AD_PACKET_DATA_MAX      64
+/** max. (chip, row, byte) triples in one OP_UPLOAD_DELTA packet */
+#define AD_DELTA_MAX            (AD_PACKET_DATA_MAX / 3)
+
+/** baudrate of the arduino after reset */
+#define AD_BAUDRATE_DEFAULT     115200
+/** highest baudrate of an ATmega at 16 MHz */
+#define AD_BAUDRATE_MAX         2000000
+/** ms after OP_SET_BAUD until the arduino falls back if it got no ping */
+#define AD_BAUDRATE_FALLBACK    1000
+
+
 
 #endif /* _NL_PLUGIN_ARDUINO_72XX */
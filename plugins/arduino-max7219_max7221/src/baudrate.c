@@ -0,0 +1,157 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+
+/**
+ * serial port speed
+ *
+ * <termios.h> only knows the Bxxx constants. On Linux, any rate the
+ * UART can generate (e.g. 500000 or 1000000 for an ATmega at 16 MHz)
+ * is set through termios2 and BOTHER. <asm/termbits.h> clashes with
+ * <termios.h>, that's why this lives in a file of its own.
+ */
+
+#include <stddef.h>
+#include <errno.h>
+#include "baudrate.h"
+
+#if defined(__linux__)
+#include <asm/ioctls.h>
+#include <asm/termbits.h>
+
+int ioctl(int fd, unsigned long request, ...);
+#else
+#include <termios.h>
+#endif
+
+
+#if !defined(__linux__) || !defined(BOTHER)
+/** standard rates for cfsetspeed() */
+static const struct
+{
+        unsigned int baud;
+        speed_t speed;
+} _rates[] =
+{
+        {9600, B9600},
+        {19200, B19200},
+        {38400, B38400},
+        {57600, B57600},
+        {115200, B115200},
+#ifdef B230400
+        {230400, B230400},
+#endif
+#ifdef B460800
+        {460800, B460800},
+#endif
+#ifdef B500000
+        {500000, B500000},
+#endif
+#ifdef B921600
+        {921600, B921600},
+#endif
+#ifdef B1000000
+        {1000000, B1000000},
+#endif
+#ifdef B2000000
+        {2000000, B2000000},
+#endif
+};
+#endif
+
+
+/**
+ * set input & output speed of tty fd to baud, all other settings are kept
+ *
+ * @param actual rate the driver really uses (may be rounded), or NULL
+ * @result 0 on success, -1 on error (errno is set, EINVAL if the rate is
+ *         not supported)
+ */
+int ad_baudrate_set(int fd, unsigned int baud, unsigned int *actual)
+{
+#if defined(__linux__) && defined(BOTHER)
+        struct termios2 tio;
+        if(ioctl(fd, TCGETS2, &tio) == -1)
+                return -1;
+
+        tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+        tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+        tio.c_ispeed = baud;
+        tio.c_ospeed = baud;
+
+        if(ioctl(fd, TCSETS2, &tio) == -1 || ioctl(fd, TCGETS2, &tio) == -1)
+                return -1;
+
+        if(actual)
+                *actual = tio.c_ospeed;
+
+        return 0;
+#else
+        size_t i;
+        for(i = 0; i < sizeof(_rates) / sizeof(_rates[0]); i++)
+        {
+                if(_rates[i].baud == baud)
+                        break;
+        }
+
+        if(i == sizeof(_rates) / sizeof(_rates[0]))
+        {
+                errno = EINVAL;
+                return -1;
+        }
+
+        struct termios tio;
+        if(tcgetattr(fd, &tio) == -1 ||
+           cfsetispeed(&tio, _rates[i].speed) == -1 ||
+           cfsetospeed(&tio, _rates[i].speed) == -1 ||
+           tcsetattr(fd, TCSANOW, &tio) == -1)
+                return -1;
+
+        if(actual)
+                *actual = baud;
+
+        return 0;
+#endif
+}
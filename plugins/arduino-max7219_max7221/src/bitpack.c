@@ -0,0 +1,196 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+/**
+ * greyscale -> monochrome conversion for MAX72xx matrices
+ *
+ * Every pixel >= threshold becomes a set bit. 8 pixels are packed per
+ * byte, first pixel in the MSB (that's the column order the arduino
+ * shifts out to the MAX72xx digit registers).
+ */
+
+#include <string.h>
+#include "bitpack.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+/**
+ * pack n pixels to ceil(n / 8) bytes. Bits of a trailing partial byte
+ * that have no pixel are 0.
+ */
+void ad_bitpack_scalar(uint8_t * out, const uint8_t * in, size_t n,
+                       uint8_t threshold)
+{
+        size_t i;
+        for(i = 0; i < n; i += 8)
+        {
+                uint8_t byte = 0;
+                size_t b;
+                for(b = 0; b < 8; b++)
+                {
+                        byte <<= 1;
+                        if(i + b < n && in[i + b] >= threshold)
+                                byte |= 1;
+                }
+                out[i / 8] = byte;
+        }
+}
+
+
+#if defined(__SSE2__) && !defined(__AVX2__)
+/** bit order of movemask bytes reversed (LSB first -> MSB first) */
+static const uint8_t _reverse[256] = {
+#define R2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
+#define R6(n) R4(n), R4(n + 2 * 4), R4(n + 1 * 4), R4(n + 3 * 4)
+        R6(0), R6(2), R6(1), R6(3)
+#undef R2
+#undef R4
+#undef R6
+};
+#endif
+
+
+/** vectorized ad_bitpack_scalar() (compare & movemask) */
+void ad_bitpack(uint8_t * out, const uint8_t * in, size_t n,
+                uint8_t threshold)
+{
+        size_t i = 0;
+
+#if defined(__AVX2__)
+        const __m256i t = _mm256_set1_epi8((char) threshold);
+        /* reverse pixels in every 8 byte group so movemask is MSB first */
+        const __m256i rev = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0,
+                                             15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0,
+                                             15, 14, 13, 12, 11, 10, 9, 8);
+
+        for(; i + 32 <= n; i += 32)
+        {
+                __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+                /* unsigned v >= t */
+                __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v);
+                uint32_t m = (uint32_t)
+                        _mm256_movemask_epi8(_mm256_shuffle_epi8(ge, rev));
+                memcpy(out + i / 8, &m, 4);
+        }
+#elif defined(__SSE2__)
+        const __m128i t = _mm_set1_epi8((char) threshold);
+
+        for(; i + 16 <= n; i += 16)
+        {
+                __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+                /* unsigned v >= t */
+                __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, t), v);
+                int m = _mm_movemask_epi8(ge);
+                out[i / 8] = _reverse[m & 0xff];
+                out[i / 8 + 1] = _reverse[m >> 8];
+        }
+#elif defined(__ARM_NEON)
+        const uint8x16_t t = vdupq_n_u8(threshold);
+        static const uint8_t w[16] = {
+                128, 64, 32, 16, 8, 4, 2, 1, 128, 64, 32, 16, 8, 4, 2, 1
+        };
+        const uint8x16_t weight = vld1q_u8(w);
+
+        for(; i + 16 <= n; i += 16)
+        {
+                uint8x16_t m = vandq_u8(vcgeq_u8(vld1q_u8(in + i), t),
+                                        weight);
+                /* sum of each half = its byte */
+                uint8x8_t s = vpadd_u8(vget_low_u8(m), vget_high_u8(m));
+                s = vpadd_u8(s, s);
+                s = vpadd_u8(s, s);
+                out[i / 8] = vget_lane_u8(s, 0);
+                out[i / 8 + 1] = vget_lane_u8(s, 1);
+        }
+#endif
+
+        ad_bitpack_scalar(out + i / 8, in + i, n - i, threshold);
+}
+
+
+/** set bit of pixel i in out */
+static void _bit(uint8_t * out, const uint8_t * in, size_t i,
+                 uint8_t threshold)
+{
+        uint8_t bit = 0x80 >> (i % 8);
+        if(in[i] >= threshold)
+                out[i / 8] |= bit;
+        else
+                out[i / 8] &= ~bit;
+}
+
+
+/**
+ * pack pixels offset to offset + count of in into the bit positions they
+ * have in out. Other bits of out are left alone.
+ */
+void ad_bitpack_range(uint8_t * out, const uint8_t * in, size_t offset,
+                      size_t count, uint8_t threshold)
+{
+        size_t i = offset, end = offset + count;
+
+        /* bits up to next byte boundary */
+        for(; i < end && i % 8; i++)
+                _bit(out, in, i, threshold);
+
+        /* whole bytes */
+        size_t whole = (end - i) / 8 * 8;
+        ad_bitpack(out + i / 8, in + i, whole, threshold);
+        i += whole;
+
+        /* bits of last partial byte */
+        for(; i < end; i++)
+                _bit(out, in, i, threshold);
+}
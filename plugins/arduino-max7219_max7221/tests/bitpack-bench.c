@@ -0,0 +1,218 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+
+/**
+ * verify vectorized threshold bit packing against the reference
+ * implementation and report throughput for large virtual matrices
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "bitpack.h"
+
+
+/** iterations per measurement */
+#define ROUNDS  200
+
+
+/** current time in seconds */
+static double _now(void)
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/** compare ad_bitpack() against ad_bitpack_scalar() and a naive packer */
+static int _verify(const uint8_t * in, size_t n, uint8_t threshold)
+{
+        size_t bytes = (n + 7) / 8;
+        uint8_t *a = malloc(bytes + 1), *b = malloc(bytes + 1);
+        int r = -1;
+        if(!a || !b)
+                goto _exit;
+
+        ad_bitpack(a, in, n, threshold);
+        ad_bitpack_scalar(b, in, n, threshold);
+
+        size_t i;
+        for(i = 0; i < n; i++)
+        {
+                int bit = (b[i / 8] >> (7 - i % 8)) & 1;
+                if(bit != (in[i] >= threshold))
+                {
+                        fprintf(stderr, "scalar: wrong bit %zu of %zu\n", i,
+                                n);
+                        goto _exit;
+                }
+        }
+
+        if(memcmp(a, b, bytes) != 0)
+        {
+                fprintf(stderr, "simd: mismatch for %zu pixels, threshold %u\n",
+                        n, threshold);
+                goto _exit;
+        }
+
+        r = 0;
+
+_exit:
+        free(a);
+        free(b);
+        return r;
+}
+
+
+/** packing a range must only touch the bits of that range */
+static int _verify_range(const uint8_t * in, size_t n, size_t offset,
+                         size_t count)
+{
+        size_t bytes = (n + 7) / 8;
+        uint8_t *a = malloc(bytes), *b = malloc(bytes);
+        int r = -1;
+        if(!a || !b)
+                goto _exit;
+
+        /* start from garbage */
+        memset(a, 0x5a, bytes);
+        ad_bitpack_range(a, in, offset, count, 128);
+
+        memset(b, 0x5a, bytes);
+        size_t i;
+        for(i = offset; i < offset + count; i++)
+        {
+                uint8_t bit = 0x80 >> (i % 8);
+                b[i / 8] = in[i] >= 128 ? b[i / 8] | bit : b[i / 8] & ~bit;
+        }
+
+        if(memcmp(a, b, bytes) != 0)
+        {
+                fprintf(stderr, "range: mismatch for %zu + %zu\n", offset,
+                        count);
+                goto _exit;
+        }
+
+        r = 0;
+
+_exit:
+        free(a);
+        free(b);
+        return r;
+}
+
+
+int main(void)
+{
+        /* virtual matrices of 8x8 modules */
+        const size_t sides[] = { 8, 64, 256, 1024, 4096 };
+        const uint8_t thresholds[] = { 0, 1, 127, 128, 255 };
+
+        size_t max = sides[sizeof(sides) / sizeof(sides[0]) - 1];
+        max *= max;
+        uint8_t *in = malloc(max);
+        uint8_t *out = malloc(max / 8 + 1);
+        if(!in || !out)
+                return EXIT_FAILURE;
+
+        size_t i, t;
+        srand(0);
+        for(i = 0; i < max; i++)
+                in[i] = rand();
+
+        /* all lengths around vector widths */
+        for(i = 0; i < 200; i++)
+        {
+                for(t = 0; t < sizeof(thresholds); t++)
+                {
+                        if(_verify(in + i % 7, i, thresholds[t]))
+                                return EXIT_FAILURE;
+                }
+        }
+
+        /* ranges with unaligned start/end */
+        size_t o, c;
+        for(o = 0; o < 20; o++)
+        {
+                for(c = 0; c < 70; c++)
+                {
+                        if(_verify_range(in, 100, o, c))
+                                return EXIT_FAILURE;
+                }
+        }
+
+        /* throughput */
+        printf("%-12s %12s %12s %12s\n", "matrix", "pixels", "scalar MP/s",
+               "simd MP/s");
+        for(i = 0; i < sizeof(sides) / sizeof(sides[0]); i++)
+        {
+                size_t n = sides[i] * sides[i];
+                int rounds = n < 100000 ? ROUNDS * 10 : ROUNDS / 10 + 1;
+
+                double start = _now();
+                int r;
+                for(r = 0; r < rounds; r++)
+                        ad_bitpack_scalar(out, in, n, 128);
+                double scalar = n * (double) rounds / (_now() - start) / 1e6;
+
+                start = _now();
+                for(r = 0; r < rounds; r++)
+                        ad_bitpack(out, in, n, 128);
+                double simd = n * (double) rounds / (_now() - start) / 1e6;
+
+                char name[32];
+                snprintf(name, sizeof(name), "%zux%zu", sides[i], sides[i]);
+                printf("%-12s %12zu %12.1f %12.1f\n", name, n, scalar, simd);
+        }
+
+        free(in);
+        free(out);
+
+        return EXIT_SUCCESS;
+}
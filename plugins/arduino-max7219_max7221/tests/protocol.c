@@ -0,0 +1,735 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+
+/**
+ * drive the plugin against a scripted arduino on the other end of a pty:
+ * every packet must arrive framed with a valid CRC, frames must be latched
+ * as uploaded and replies must be found behind line noise. After a
+ * dropped byte, a bad CRC or a missing ack the next frame must be uploaded
+ * completely, lost_frames & dropped_frames must count what happened and
+ * control packets must never be dropped
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <termios.h>
+#include <pty.h>
+#include <niftyled.h>
+#include "arduino_max72xx.h"
+#include "bitpack.h"
+
+
+/** LEDs of 8 MAX72xx with an 8x8 matrix each */
+#define LEDCOUNT        512
+/** bytes of one frame at the arduino */
+#define FRAME_SIZE      (LEDCOUNT / 8)
+/** ms to wait for the plugin */
+#define TIMEOUT         2000
+/** baudrate the plugin negotiates */
+#define BAUDRATE        230400
+
+
+/** fault the firmware injects */
+typedef enum
+{
+        FAULT_NONE,
+        /** lose last data byte of next upload */
+        FAULT_DROP_BYTE,
+        /** damage CRC of next upload */
+        FAULT_BAD_CRC,
+        /** latch next frame but don't acknowledge it */
+        FAULT_NO_ACK,
+} Fault;
+
+
+/** scripted arduino, behaves like arduino/max72xx.pde */
+static struct
+{
+        /** master side of pty */
+        int fd;
+        pthread_t thread;
+        bool quit;
+        /** protects everything below */
+        pthread_mutex_t lock;
+        /** signalled after every latch */
+        pthread_cond_t latched;
+        /** fault to inject */
+        Fault fault;
+        /** ms to delay every ack */
+        unsigned int ackDelay;
+        /** send a stray byte & a damaged copy before every reply */
+        bool noise;
+        /** packet being received */
+        unsigned char rx[4 + AD_PACKET_DATA_MAX];
+        size_t rxLen;
+        /** damaged packets received */
+        unsigned int rxErrors;
+        /** damaged packets since last ack */
+        unsigned char ackErrors;
+        /** rows received & rows latched */
+        unsigned char rows[FRAME_SIZE], status[FRAME_SIZE];
+        /** complete upload since last latch, for last latch */
+        bool full, latchedFull;
+        /** frames latched */
+        unsigned int latches;
+        /** OP_SET_SCANLIMIT packets & the last value */
+        unsigned int scanLimits;
+        int scanLimit;
+        /** OP_SET_SCANLIMIT packets out of order */
+        unsigned int scanLimitErrors;
+        /** OP_PING packets, OP_SET_BAUD packets & the last rate */
+        unsigned int pings, bauds, baudrate;
+        /** OP_PING packets since last OP_SET_BAUD */
+        unsigned int baudPings;
+} _fw;
+
+
+/** CRC-8 (polynomial 0x07, init 0) */
+static unsigned char _crc8(unsigned char crc, const unsigned char *data,
+                           size_t size)
+{
+        size_t i;
+        for(i = 0; i < size; i++)
+        {
+                crc ^= data[i];
+                int b;
+                for(b = 0; b < 8; b++)
+                        crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+        return crc;
+}
+
+
+/** send packet to host */
+static void _fw_tx(unsigned char opcode, const unsigned char *data,
+                   unsigned char size)
+{
+        /* stray byte, damaged copy of packet, packet */
+        unsigned char packet[1 + 2 * (4 + AD_PACKET_DATA_MAX)];
+        unsigned char *p = packet + 1;
+        p[0] = AD_PACKET_SYNC;
+        p[1] = opcode;
+        p[2] = size;
+        memcpy(p + 3, data, size);
+        p[3 + size] = _crc8(0, p + 1, 2 + size);
+
+        size_t len = 4 + (size_t) size;
+        if(_fw.noise)
+        {
+                packet[0] = (unsigned char) ~AD_PACKET_SYNC;
+                memcpy(p + len, p, len);
+                p[3 + size] ^= 0xff;
+                p = packet;
+                len = 1 + 2 * len;
+        }
+
+        if(write(_fw.fd, p, len) != (ssize_t) len)
+                NFT_LOG_PERROR("write()");
+}
+
+
+/** handle packet from host (lock held) */
+static void _fw_packet(unsigned char opcode, const unsigned char *data,
+                       unsigned char size)
+{
+        switch (opcode)
+        {
+                case OP_SET_SCANLIMIT:
+                {
+                        /* values are set in ascending order (mod 8) */
+                        if(size < 1 ||
+                           (_fw.scanLimit >= 0 &&
+                            data[0] != (_fw.scanLimit + 1) % 8))
+                                _fw.scanLimitErrors++;
+                        _fw.scanLimit = size ? data[0] : -1;
+                        _fw.scanLimits++;
+                        break;
+                }
+
+                case OP_UPLOAD:
+                {
+                        memcpy(_fw.rows, data, size);
+                        _fw.full = size == FRAME_SIZE;
+                        break;
+                }
+
+                case OP_UPLOAD_DELTA:
+                {
+                        unsigned char i;
+                        for(i = 0; i + 2 < size; i += 3)
+                        {
+                                if(data[i] < 8 && data[i + 1] < 8)
+                                        _fw.rows[data[i] * 8 + data[i + 1]] =
+                                                data[i + 2];
+                        }
+                        break;
+                }
+
+                case OP_LATCH:
+                {
+                        memcpy(_fw.status, _fw.rows, FRAME_SIZE);
+                        _fw.latchedFull = _fw.full;
+                        _fw.full = false;
+                        _fw.latches++;
+                        pthread_cond_broadcast(&_fw.latched);
+
+                        if(_fw.fault == FAULT_NO_ACK)
+                        {
+                                _fw.fault = FAULT_NONE;
+                                break;
+                        }
+
+                        if(_fw.ackDelay)
+                        {
+                                pthread_mutex_unlock(&_fw.lock);
+                                usleep(_fw.ackDelay * 1000);
+                                pthread_mutex_lock(&_fw.lock);
+                        }
+
+                        unsigned char ack[2] = { data[0], _fw.ackErrors };
+                        _fw_tx(OP_ACK, ack, sizeof(ack));
+                        _fw.ackErrors = 0;
+                        break;
+                }
+
+                case OP_PING:
+                {
+                        _fw.pings++;
+                        _fw.baudPings++;
+                        _fw_tx(opcode, data, size);
+                        break;
+                }
+
+                case OP_SET_BAUD:
+                {
+                        /* the pty doesn't care about rates, accept all */
+                        if(size == 4)
+                                _fw.baudrate = (unsigned int) data[0] << 24 |
+                                        (unsigned int) data[1] << 16 |
+                                        (unsigned int) data[2] << 8 | data[3];
+                        _fw.bauds++;
+                        _fw.baudPings = 0;
+                        _fw_tx(opcode, data, size);
+                        break;
+                }
+        }
+}
+
+
+/** drop first n bytes of rx and continue at next sync byte (lock held) */
+static void _fw_resync(size_t n)
+{
+        while(n < _fw.rxLen && _fw.rx[n] != AD_PACKET_SYNC)
+                n++;
+
+        _fw.rxLen -= n;
+        memmove(_fw.rx, _fw.rx + n, _fw.rxLen);
+}
+
+
+/** receive one byte from host, inject faults into uploads (lock held) */
+static void _fw_byte(unsigned char b)
+{
+        if(_fw.rxLen == 0 && b != AD_PACKET_SYNC)
+                return;
+
+        /* position of b in an upload */
+        bool upload = _fw.rxLen >= 3 && (_fw.rx[1] == OP_UPLOAD ||
+                                         _fw.rx[1] == OP_UPLOAD_DELTA);
+        if(upload && _fw.fault == FAULT_DROP_BYTE &&
+           _fw.rxLen == 2 + (size_t) _fw.rx[2])
+        {
+                _fw.fault = FAULT_NONE;
+                return;
+        }
+        if(upload && _fw.fault == FAULT_BAD_CRC &&
+           _fw.rxLen == 3 + (size_t) _fw.rx[2])
+        {
+                _fw.fault = FAULT_NONE;
+                b ^= 0xff;
+        }
+
+        _fw.rx[_fw.rxLen++] = b;
+
+        while(_fw.rxLen >= 3)
+        {
+                unsigned char size = _fw.rx[2];
+                if(size > AD_PACKET_DATA_MAX ||
+                   (_fw.rxLen >= 4 + (size_t) size &&
+                    _crc8(0, _fw.rx + 1, 2 + size) != _fw.rx[3 + size]))
+                {
+                        _fw.rxErrors++;
+                        if(_fw.ackErrors < 255)
+                                _fw.ackErrors++;
+                        _fw_resync(1);
+                        continue;
+                }
+
+                /* incomplete */
+                if(_fw.rxLen < 4 + (size_t) size)
+                        return;
+
+                _fw_packet(_fw.rx[1], _fw.rx + 3, size);
+                _fw_resync(4 + (size_t) size);
+        }
+}
+
+
+/** arduino main loop */
+static void *_fw_run(void *arg)
+{
+        for(;;)
+        {
+                pthread_mutex_lock(&_fw.lock);
+                bool quit = _fw.quit;
+                pthread_mutex_unlock(&_fw.lock);
+                if(quit)
+                        break;
+
+                struct pollfd pfd = {.fd = _fw.fd,.events = POLLIN };
+                if(poll(&pfd, 1, 10) <= 0)
+                        continue;
+
+                unsigned char buf[256];
+                ssize_t n = read(_fw.fd, buf, sizeof(buf));
+                if(n <= 0)
+                {
+                        /* nobody has the port open */
+                        usleep(10000);
+                        continue;
+                }
+
+                pthread_mutex_lock(&_fw.lock);
+                ssize_t i;
+                for(i = 0; i < n; i++)
+                        _fw_byte(buf[i]);
+                pthread_mutex_unlock(&_fw.lock);
+        }
+
+        return NULL;
+}
+
+
+/** absolute time TIMEOUT ms from now */
+static struct timespec _deadline(void)
+{
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += TIMEOUT / 1000;
+        t.tv_nsec += (TIMEOUT % 1000) * 1000000L;
+        if(t.tv_nsec >= 1000000000L)
+        {
+                t.tv_sec++;
+                t.tv_nsec -= 1000000000L;
+        }
+        return t;
+}
+
+
+/** wait until firmware latched "latches" frames */
+static int _fw_wait(unsigned int latches)
+{
+        struct timespec t = _deadline();
+        int r = 0;
+
+        pthread_mutex_lock(&_fw.lock);
+        while(_fw.latches < latches && r == 0)
+                r = pthread_cond_timedwait(&_fw.latched, &_fw.lock, &t);
+        unsigned int latched = _fw.latches;
+        pthread_mutex_unlock(&_fw.lock);
+
+        if(latched < latches)
+        {
+                NFT_LOG(L_ERROR, "arduino latched %u frames, expected %u",
+                        latched, latches);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/** set fault & ack delay of firmware, return frames it latched so far */
+static unsigned int _fw_script(Fault fault, unsigned int ackDelay)
+{
+        pthread_mutex_lock(&_fw.lock);
+        _fw.fault = fault;
+        _fw.ackDelay = ackDelay;
+        unsigned int latches = _fw.latches;
+        pthread_mutex_unlock(&_fw.lock);
+
+        return latches;
+}
+
+
+/** value of integer property */
+static int _prop(LedHardware * h, const char *name)
+{
+        int v = -1;
+        if(!led_hardware_plugin_prop_get_int(h, name, &v))
+                NFT_LOG(L_ERROR, "failed to get \"%s\"", name);
+        return v;
+}
+
+
+/** wait until integer property reaches value */
+static int _prop_wait(LedHardware * h, const char *name, int value)
+{
+        int t;
+        for(t = 0; t < TIMEOUT / 10; t++)
+        {
+                if(_prop(h, name) >= value)
+                        return 0;
+                usleep(10000);
+        }
+
+        NFT_LOG(L_ERROR, "\"%s\" is %d, expected %d", name, _prop(h, name),
+                value);
+        return -1;
+}
+
+
+/** show frame f, remember what the arduino should display */
+static int _show(LedHardware * h, int f, unsigned char *expected)
+{
+        LedChain *c = led_hardware_get_chain(h);
+        uint8_t *leds = led_chain_get_buffer(c);
+
+        /* one row inverted, so consecutive frames differ in two rows */
+        LedCount l;
+        for(l = 0; l < LEDCOUNT; l++)
+                leds[l] = ((l * 7) % 11 < 4) != (l / 8 == (LedCount) f %
+                                                 FRAME_SIZE) ? 255 : 0;
+
+        ad_bitpack_range(expected, leds, 0, LEDCOUNT, 128);
+
+        if(!led_hardware_send(h) || !led_hardware_show(h))
+        {
+                NFT_LOG(L_ERROR, "failed to show frame %d", f);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * check frame arduino latched last
+ *
+ * @param full 1 if it must have been uploaded completely, 0 if as delta,
+ *        -1 if it doesn't matter
+ */
+static int _check(const char *what, const unsigned char *expected, int full)
+{
+        pthread_mutex_lock(&_fw.lock);
+        bool same = memcmp(_fw.status, expected, FRAME_SIZE) == 0;
+        bool latchedFull = _fw.latchedFull;
+        pthread_mutex_unlock(&_fw.lock);
+
+        if(!same || (full >= 0 && latchedFull != (full == 1)))
+        {
+                NFT_LOG(L_ERROR, "%s: arduino shows %s frame (%s upload)",
+                        what, same ? "right" : "wrong",
+                        latchedFull ? "full" : "delta");
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * the first frame is uploaded completely, the following ones as deltas.
+ * The arduino must latch every frame as shown and find no damaged packet.
+ */
+static int _frames(LedHardware * h, int *f)
+{
+        unsigned char expected[FRAME_SIZE];
+
+        int i;
+        for(i = 0; i < 8; i++)
+        {
+                unsigned int latches = _fw_script(FAULT_NONE, 0);
+                if(_show(h, (*f)++, expected) != 0 ||
+                   _fw_wait(latches + 1) != 0 ||
+                   _check("frame", expected, i == 0) != 0)
+                        return -1;
+        }
+
+        pthread_mutex_lock(&_fw.lock);
+        unsigned int errors = _fw.rxErrors;
+        pthread_mutex_unlock(&_fw.lock);
+
+        if(errors)
+        {
+                NFT_LOG(L_ERROR, "arduino got %u damaged packets", errors);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * replies behind a stray byte & a damaged packet must still be found:
+ * the first boot ping gets its reply, so does OP_SET_BAUD and the ping
+ * confirming the new rate
+ */
+static int _negotiated(void)
+{
+        pthread_mutex_lock(&_fw.lock);
+        unsigned int pings = _fw.pings, bauds = _fw.bauds;
+        unsigned int baudrate = _fw.baudrate, baudPings = _fw.baudPings;
+        pthread_mutex_unlock(&_fw.lock);
+
+        if(pings != 2 || bauds != 1 || baudrate != BAUDRATE ||
+           baudPings != 1)
+        {
+                NFT_LOG(L_ERROR,
+                        "arduino got %u pings, %u baudrate changes (last %u), expected 2, 1 (%u)",
+                        pings, bauds, baudrate, BAUDRATE);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * a damaged upload is reported by the next ack, a missing ack times out
+ * and counts as lost frame. Either way the next frame is uploaded
+ * completely. Runs after _frames(), so good frames are deltas.
+ */
+static int _faults(LedHardware * h, int *f)
+{
+        const struct
+        {
+                Fault fault;
+                const char *name;
+                int lost;
+        } faults[] =
+        {
+                {FAULT_DROP_BYTE, "dropped byte", 0},
+                {FAULT_BAD_CRC, "bad CRC", 0},
+                {FAULT_NO_ACK, "missing ack", 1},
+        };
+
+        unsigned char expected[FRAME_SIZE];
+        unsigned int latches;
+
+        size_t i;
+        for(i = 0; i < sizeof(faults) / sizeof(faults[0]); i++)
+        {
+                int lost = _prop(h, "lost_frames");
+
+                /* good frames are deltas, so is the faulty one */
+                latches = _fw_script(FAULT_NONE, 0);
+                if(_show(h, (*f)++, expected) != 0 ||
+                   _fw_wait(latches + 1) != 0 ||
+                   _check(faults[i].name, expected, 0) != 0)
+                        return -1;
+
+                /* faulty frame, plugin learns about it from the next ack or
+                   its absence */
+                latches = _fw_script(faults[i].fault, 0);
+                if(_show(h, (*f)++, expected) != 0 ||
+                   _fw_wait(latches + 1) != 0 ||
+                   (faults[i].lost &&
+                    _prop_wait(h, "lost_frames", lost + 1) != 0))
+                        return -1;
+
+                if(_show(h, (*f)++, expected) != 0 ||
+                   _fw_wait(latches + 2) != 0 ||
+                   _check(faults[i].name, expected, 1) != 0)
+                        return -1;
+
+                if(_prop(h, "lost_frames") != lost + faults[i].lost)
+                {
+                        NFT_LOG(L_ERROR, "%s: %d frames lost, expected %d",
+                                faults[i].name, _prop(h, "lost_frames") - lost,
+                                faults[i].lost);
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+
+/**
+ * while a frame is in flight, newer frames replace each other but control
+ * packets still go out, all of them and in order
+ */
+static int _dropped(LedHardware * h, int *f)
+{
+        const int controls = 100;
+        unsigned char expected[FRAME_SIZE];
+
+        int dropped = _prop(h, "dropped_frames");
+        unsigned int latches = _fw_script(FAULT_NONE, 200);
+        pthread_mutex_lock(&_fw.lock);
+        _fw.scanLimits = 0;
+        _fw.scanLimitErrors = 0;
+        _fw.scanLimit = -1;
+        pthread_mutex_unlock(&_fw.lock);
+
+        /* first frame is in flight, second one replaced by third */
+        if(_show(h, (*f)++, expected) != 0 || _fw_wait(latches + 1) != 0 ||
+           _show(h, (*f)++, expected) != 0 || _show(h, (*f)++, expected) != 0)
+                return -1;
+
+        int i;
+        for(i = 0; i < controls; i++)
+        {
+                if(!led_hardware_plugin_prop_set_int(h, "scan_limit", i % 8))
+                        return -1;
+        }
+
+        if(_fw_wait(latches + 2) != 0 || _check("dropped", expected, -1))
+                return -1;
+
+        _fw_script(FAULT_NONE, 0);
+
+        pthread_mutex_lock(&_fw.lock);
+        unsigned int scanLimits = _fw.scanLimits;
+        unsigned int errors = _fw.scanLimitErrors;
+        pthread_mutex_unlock(&_fw.lock);
+
+        if(_prop(h, "dropped_frames") != dropped + 1 ||
+           scanLimits != (unsigned int) controls || errors)
+        {
+                NFT_LOG(L_ERROR,
+                        "%d frames dropped (expected 1), arduino got %u of %d control packets (%u out of order)",
+                        _prop(h, "dropped_frames") - dropped, scanLimits,
+                        controls, errors);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+        nft_log_level_set(L_ERROR);
+
+        /* arduino on master side of pty, plugin opens slave */
+        int slave;
+        char port[256];
+        if(openpty(&_fw.fd, &slave, port, NULL, NULL) == -1)
+        {
+                NFT_LOG_PERROR("openpty()");
+                return EXIT_FAILURE;
+        }
+
+        struct termios tio;
+        tcgetattr(slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+
+        pthread_mutex_init(&_fw.lock, NULL);
+        pthread_cond_init(&_fw.latched, NULL);
+        _fw.scanLimit = -1;
+        _fw.noise = true;
+        if(pthread_create(&_fw.thread, NULL, _fw_run, NULL) != 0)
+        {
+                NFT_LOG_PERROR("pthread_create()");
+                return EXIT_FAILURE;
+        }
+
+        LedHardware *h;
+        if(!(h = led_hardware_new("arduino", "serial_arduino-max72xx")))
+                return EXIT_FAILURE;
+
+        /* one frame in flight, so faults hit exactly one frame.
+           Negotiation at init goes through ping & OP_SET_BAUD replies. */
+        if(!led_hardware_plugin_prop_set_int(h, "window", 1) ||
+           !led_hardware_plugin_prop_set_int(h, "baudrate", BAUDRATE) ||
+           !led_hardware_init(h, port, LEDCOUNT, "Y u8"))
+        {
+                NFT_LOG(L_ERROR, "failed to initialize hardware");
+                led_hardware_destroy(h);
+                return EXIT_FAILURE;
+        }
+
+        int f = 0, r = 0;
+        if(_negotiated() != 0 || _frames(h, &f) != 0 ||
+           _faults(h, &f) != 0 || _dropped(h, &f) != 0)
+                r = -1;
+
+        /* last frame shown before deinit must still arrive */
+        unsigned char expected[FRAME_SIZE];
+        unsigned int latches = _fw_script(FAULT_NONE, 200);
+        if(r == 0 &&
+           (_show(h, f++, expected) != 0 || _fw_wait(latches + 1) != 0 ||
+            _show(h, f++, expected) != 0))
+                r = -1;
+
+        led_hardware_destroy(h);
+
+        if(r == 0 &&
+           (_fw_wait(latches + 2) != 0 || _check("deinit", expected, -1)))
+                r = -1;
+
+        pthread_mutex_lock(&_fw.lock);
+        _fw.quit = true;
+        pthread_mutex_unlock(&_fw.lock);
+        pthread_join(_fw.thread, NULL);
+
+        close(slave);
+        close(_fw.fd);
+
+        return r == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -45,56 +45,215 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
-#include <usb.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include <niftyled.h>
 #include "config.h"
 #include "niftylino.h"
 #include "niftylino_usb.h"
+#include "niftylino_transport.h"
 
 
 
 
+/**
+ * frame fence shared by all niftylino instances
+ *
+ * Every queued transfer is counted as "in flight" until its worker finished
+ * it. _show() waits for all adapters so they latch together.
+ */
+static struct
+{
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        unsigned int in_flight;
+} _fence =
+{
+.mutex = PTHREAD_MUTEX_INITIALIZER,.cond =
+                PTHREAD_COND_INITIALIZER,.in_flight = 0,};
+
+
 /** send message + payload to adapter */
 static NftResult _adapter_usb_send(Niftylino * n, uint message, char *payload,
                                    size_t payload_size)
 {
-        if(!n->usb_handle)
+        if(!n->handle)
                 NFT_LOG_NULL(NFT_FAILURE);
 
-        if(usb_control_msg(n->usb_handle, RECV_EP, message, 0, 0,
-                           payload, payload_size, n->usb_timeout) < 0)
+        pthread_rwlock_rdlock(&n->handle_lock);
+        int r = n->handle ? n->transport->control_send(n->handle, message,
+                                                       payload, payload_size,
+                                                       n->usb_timeout) : -1;
+        pthread_rwlock_unlock(&n->handle_lock);
+
+        if(r < 0)
                 return NFT_FAILURE;
 
         return NFT_SUCCESS;
 }
 
 
-/** receive payload from adapter */
-/*static NftResult _adapter_usb_rcv(Niftylino *n, uint message, char *payload, size_t payload_size)
+/** receive payload from adapter, returns amount of bytes received or -1 */
+static int _adapter_usb_rcv(Niftylino * n, uint message, char *payload,
+                            size_t payload_size)
 {
-        if(!n->usb_handle)
-                NFT_LOG_NULL(NFT_FAILURE);
+        if(!n->handle)
+                NFT_LOG_NULL(-1);
+
+        pthread_rwlock_rdlock(&n->handle_lock);
+        int r = n->handle ? n->transport->control_rcv(n->handle, message,
+                                                      payload, payload_size,
+                                                      n->usb_timeout) : -1;
+        pthread_rwlock_unlock(&n->handle_lock);
+
+        return r;
+}
+
+
+/** read one 32 bit value from adapter */
+static NftResult _adapter_usb_rcv_u32(Niftylino * n, uint message,
+                                      uint32_t * value)
+{
+        uint32_t v = 0;
 
-        if(usb_control_msg(n->usb_handle,
-                       USB_TYPE_CLASS | DIR_DEV_TO_HOST | USB_RECIP_INTERFACE,
-                       message, 0, 0, payload, payload_size, n->usb_timeout) < 0)
+        if(_adapter_usb_rcv(n, message, (char *) &v, sizeof(v)) <
+           (int) sizeof(v))
                 return NFT_FAILURE;
 
+        *value = v;
         return NFT_SUCCESS;
-}*/
+}
 
 
 
 
-/** send gain value of LED */
-static NftResult _set_gain(Niftylino * n, LedCount led, LedGain gain)
+/**
+ * telemetry poller
+ *
+ * Runs with lowest scheduling priority and only issues control requests on
+ * the default pipe. Bulk transfers of _send() never wait for it.
+ */
+static void *_telemetry_thread(void *arg)
 {
-        if(!n)
-                NFT_LOG_NULL(NFT_FAILURE);;
+        Niftylino *n = arg;
+
+#ifdef SCHED_IDLE
+        /* we're the least important thing around */
+        struct sched_param param = {.sched_priority = 0 };
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+        pthread_mutex_lock(&n->telemetry_mutex);
+        while(n->poller_running)
+        {
+                int interval = n->telemetry_interval;
+
+                if(interval > 0)
+                {
+                        /* never hold the lock while talking to the device */
+                        pthread_mutex_unlock(&n->telemetry_mutex);
+
+                        NiftylinoTelemetry t;
+                        bool ok =
+                                _adapter_usb_rcv_u32(n, NIFTY_GET_STATE,
+                                                     &t.state) &&
+                                _adapter_usb_rcv_u32(n, NIFTY_GET_VERSION,
+                                                     &t.version) &&
+                                _adapter_usb_rcv_u32(n, NIFTY_GET_CHAINLENGTH,
+                                                     &t.chainlength);
+
+                        pthread_mutex_lock(&n->telemetry_mutex);
+
+                        if(ok)
+                        {
+                                t.valid = true;
+                                n->telemetry = t;
+                        }
+                        else
+                        {
+                                NFT_LOG(L_VERBOSE,
+                                        "Failed to poll telemetry from \"%s\"",
+                                        n->id);
+                        }
+
+                        if(!n->poller_running)
+                                break;
+                }
+
+                /* sleep until next poll (or until we're woken up) */
+                if(n->telemetry_interval > 0)
+                {
+                        struct timespec t;
+                        clock_gettime(CLOCK_MONOTONIC, &t);
+                        t.tv_sec += n->telemetry_interval / 1000;
+                        t.tv_nsec += (n->telemetry_interval % 1000) * 1000000L;
+                        if(t.tv_nsec >= 1000000000L)
+                        {
+                                t.tv_sec++;
+                                t.tv_nsec -= 1000000000L;
+                        }
+                        pthread_cond_timedwait(&n->telemetry_cond,
+                                               &n->telemetry_mutex, &t);
+                }
+                else
+                {
+                        pthread_cond_wait(&n->telemetry_cond,
+                                          &n->telemetry_mutex);
+                }
+        }
+        pthread_mutex_unlock(&n->telemetry_mutex);
+
+        return NULL;
+}
+
+
+/** start telemetry poller */
+static NftResult _telemetry_start(Niftylino * n)
+{
+        pthread_mutex_lock(&n->telemetry_mutex);
+        memset(&n->telemetry, 0, sizeof(n->telemetry));
+        n->poller_running = true;
+        pthread_mutex_unlock(&n->telemetry_mutex);
+
+        if(pthread_create(&n->poller, NULL, _telemetry_thread, n) != 0)
+        {
+                NFT_LOG_PERROR("pthread_create");
+                n->poller_running = false;
+                return NFT_FAILURE;
+        }
+
+        return NFT_SUCCESS;
+}
 
-        if(led % LEDS_PER_CHIP != 0)
-                return NFT_SUCCESS;
 
+/** stop telemetry poller */
+static void _telemetry_stop(Niftylino * n)
+{
+        pthread_mutex_lock(&n->telemetry_mutex);
+        if(!n->poller_running)
+        {
+                pthread_mutex_unlock(&n->telemetry_mutex);
+                return;
+        }
+        n->poller_running = false;
+        pthread_cond_signal(&n->telemetry_cond);
+        pthread_mutex_unlock(&n->telemetry_mutex);
+
+        pthread_join(n->poller, NULL);
+}
+
+
+
+
+/** send gain value of one chip */
+static NftResult _send_gain(Niftylino * n, uint32_t chip, uint8_t gain)
+{
         /* used to set the gain of one chip in a chain */
         struct
         {
@@ -102,12 +261,45 @@ static NftResult _set_gain(Niftylino * n, LedCount led, LedGain gain)
                 uint8_t gain;
         } _Gain =
         {
-                .chip = led / LEDS_PER_CHIP,
-                        /* scale gain from (0x0 - 0xffff) to (0x0 - 0xff) */
-        .gain = (uint8_t) (gain * 255 / LED_GAIN_MAX),};
+        .chip = chip,.gain = gain,};
 
         return _adapter_usb_send(n, NIFTY_SET_GAIN_NO_PROPAGATE,
                                  (char *) &_Gain, sizeof(_Gain));
+}
+
+
+/** send gain value of LED */
+static NftResult _set_gain(Niftylino * n, LedCount led, LedGain gain)
+{
+        if(!n)
+                NFT_LOG_NULL(NFT_FAILURE);;
+
+        if(led % LEDS_PER_CHIP != 0)
+                return NFT_SUCCESS;
+
+        uint32_t chip = led / LEDS_PER_CHIP;
+        /* scale gain from (0x0 - 0xffff) to (0x0 - 0xff) */
+        uint8_t g = (uint8_t) (gain * 255 / LED_GAIN_MAX);
+
+        /* remember gain so we can restore it after recovering */
+        pthread_mutex_lock(&_fence.mutex);
+        if(chip >= n->n_gains)
+        {
+                int *gains;
+                if((gains = realloc(n->gains, (chip + 1) * sizeof(int))))
+                {
+                        size_t i;
+                        for(i = n->n_gains; i <= chip; i++)
+                                gains[i] = -1;
+                        n->gains = gains;
+                        n->n_gains = chip + 1;
+                }
+        }
+        if(chip < n->n_gains)
+                n->gains[chip] = g;
+        pthread_mutex_unlock(&_fence.mutex);
+
+        return _send_gain(n, chip, g);
 
 }
 
@@ -153,6 +345,485 @@ static NftResult _set_format(void *privdata, NiftylinoValueWidth w)
                                  (char *) &_Bitwidth, sizeof(_Bitwidth));
 }
 
+/** set LED offset of next bulk transfer (needs firmware support) */
+static NftResult _set_write_offset(Niftylino * n, uint32_t offset)
+{
+        if(!n)
+                NFT_LOG_NULL(NFT_FAILURE);
+
+        /* nothing to do? */
+        if(offset == n->write_offset)
+                return NFT_SUCCESS;
+
+        struct
+        {
+                uint32_t offset;
+        } _Offset;
+
+        _Offset.offset = offset;
+
+        if(!_adapter_usb_send(n, NIFTY_SET_WRITE_OFFSET,
+                              (char *) &_Offset, sizeof(_Offset)))
+                return NFT_FAILURE;
+
+        n->write_offset = offset;
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * shrink [*start, *end) to the range of bytes that differ between a and b
+ *
+ * @result false if both buffers are equal in that range
+ */
+static bool _dirty_range(const char *a, const char *b, size_t * start,
+                         size_t * end)
+{
+        size_t s = *start, e = *end;
+
+        /* compare machine words where possible */
+        while(s + sizeof(uint64_t) <= e)
+        {
+                uint64_t wa, wb;
+                memcpy(&wa, a + s, sizeof(wa));
+                memcpy(&wb, b + s, sizeof(wb));
+                if(wa != wb)
+                        break;
+                s += sizeof(uint64_t);
+        }
+        while(s < e && a[s] == b[s])
+                s++;
+
+        if(s == e)
+                return false;
+
+        while(e - s >= sizeof(uint64_t))
+        {
+                uint64_t wa, wb;
+                memcpy(&wa, a + e - sizeof(wa), sizeof(wa));
+                memcpy(&wb, b + e - sizeof(wb), sizeof(wb));
+                if(wa != wb)
+                        break;
+                e -= sizeof(uint64_t);
+        }
+        while(a[e - 1] == b[e - 1])
+                e--;
+
+        *start = s;
+        *end = e;
+        return true;
+}
+
+
+/** make sure shadow buffer can hold size bytes */
+static NftResult _shadow_resize(Niftylino * n, size_t size)
+{
+        if(n->shadow_size == size)
+                return NFT_SUCCESS;
+
+        char *shadow;
+        if(!(shadow = realloc(n->shadow, size)))
+        {
+                NFT_LOG_PERROR("realloc");
+                return NFT_FAILURE;
+        }
+
+        n->shadow = shadow;
+        n->shadow_size = size;
+        n->shadow_valid = false;
+        return NFT_SUCCESS;
+}
+
+
+
+/** make sure wire buffer can hold size bytes */
+static NftResult _wire_resize(Niftylino * n, size_t size)
+{
+        if(n->wire_size == size)
+                return NFT_SUCCESS;
+
+        char *wire;
+        if(!(wire = realloc(n->wire, size)))
+        {
+                NFT_LOG_PERROR("realloc");
+                return NFT_FAILURE;
+        }
+
+        n->wire = wire;
+        n->wire_size = size;
+        return NFT_SUCCESS;
+}
+
+
+/** convert 16 bit values to 8 bit by keeping the most significant byte */
+static void _downconvert(uint8_t * dst, const uint16_t * src, size_t count)
+{
+        size_t i = 0;
+
+#if defined(__SSE2__)
+        for(; i + 16 <= count; i += 16)
+        {
+                __m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+                __m128i b = _mm_loadu_si128((const __m128i *) (src + i + 8));
+                a = _mm_srli_epi16(a, 8);
+                b = _mm_srli_epi16(b, 8);
+                _mm_storeu_si128((__m128i *) (dst + i),
+                                 _mm_packus_epi16(a, b));
+        }
+#elif defined(__ARM_NEON)
+        for(; i + 16 <= count; i += 16)
+        {
+                uint16x8_t a = vld1q_u16(src + i);
+                uint16x8_t b = vld1q_u16(src + i + 8);
+                vst1q_u8(dst + i,
+                         vcombine_u8(vshrn_n_u16(a, 8), vshrn_n_u16(b, 8)));
+        }
+#endif
+
+        for(; i < count; i++)
+                dst[i] = src[i] >> 8;
+}
+
+
+/** transfer buf[start, end) to controller once (bpc = bytes per LED) */
+static NftResult _transfer_once(Niftylino * n, char *buf, size_t start,
+                                size_t end, size_t bpc)
+{
+        if(n->offset_writes &&
+           !_set_write_offset(n, (uint32_t) (start / bpc)))
+                return NFT_FAILURE;
+
+        NFT_LOG(L_NOISY, "Transferring bytes %zu - %zu", start, end);
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        pthread_rwlock_rdlock(&n->handle_lock);
+        int r = n->handle ? n->transport->bulk_write(n->handle, 1,
+                                                     buf + start,
+                                                     end - start,
+                                                     n->usb_timeout) : -1;
+        pthread_rwlock_unlock(&n->handle_lock);
+
+        if(r < 0)
+                return NFT_FAILURE;
+
+        /* remember how long that took */
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        unsigned int i = n->tx_next;
+        n->tx_time[i] = (uint64_t) (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+                t1.tv_nsec - t0.tv_nsec;
+        n->tx_bytes[i] = end - start;
+        n->tx_next = (i + 1) % ADAPT_SAMPLES;
+        if(n->tx_samples < ADAPT_SAMPLES)
+                n->tx_samples++;
+
+        return NFT_SUCCESS;
+}
+
+
+/** restore controller state after it was re-claimed or re-opened */
+static NftResult _replay_state(Niftylino * n)
+{
+        n->write_offset = 0;
+
+        /* controller might have lost the frame it had */
+        pthread_mutex_lock(&_fence.mutex);
+        n->shadow_valid = false;
+        pthread_mutex_unlock(&_fence.mutex);
+
+        if(n->ledcount && !_set_ledcount(n, n->ledcount))
+                return NFT_FAILURE;
+
+        if(!_set_format(n, n->wire_width))
+                return NFT_FAILURE;
+
+        size_t i;
+        for(i = 0; i < n->n_gains; i++)
+        {
+                pthread_mutex_lock(&_fence.mutex);
+                int g = n->gains[i];
+                pthread_mutex_unlock(&_fence.mutex);
+
+                if(g >= 0 && !_send_gain(n, i, (uint8_t) g))
+                        return NFT_FAILURE;
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * recover from a failed transfer without re-initializing the hardware
+ *
+ * Escalates from clearing the halt condition of our endpoint over
+ * re-claiming the interface to re-opening the adapter by its serial.
+ * After each step the failed transfer is retried.
+ */
+static NftResult _recover(Niftylino * n, char *buf, size_t start, size_t end,
+                          size_t bpc)
+{
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        NftResult r = NFT_FAILURE;
+        int tier;
+        for(tier = 0; tier < 3 && !r; tier++)
+        {
+                switch (tier)
+                {
+                                /* clear halt of bulk endpoint */
+                        case 0:
+                        {
+                                pthread_rwlock_rdlock(&n->handle_lock);
+                                int e = n->handle ?
+                                        n->transport->clear_halt(n->handle,
+                                                                 1) : -1;
+                                pthread_rwlock_unlock(&n->handle_lock);
+                                if(e < 0)
+                                        continue;
+                                break;
+                        }
+
+                                /* re-claim interface */
+                        case 1:
+                        {
+                                pthread_rwlock_rdlock(&n->handle_lock);
+                                int e = n->handle ?
+                                        n->transport->reclaim(n->handle) : -1;
+                                pthread_rwlock_unlock(&n->handle_lock);
+                                if(e < 0 || !_replay_state(n))
+                                        continue;
+                                break;
+                        }
+
+                                /* re-open adapter by serial */
+                        case 2:
+                        {
+                                pthread_rwlock_wrlock(&n->handle_lock);
+                                NftResult o = n->transport->reopen(&n->handle,
+                                                                   n->id);
+                                pthread_rwlock_unlock(&n->handle_lock);
+                                if(!o || !_replay_state(n))
+                                        continue;
+                                break;
+                        }
+                }
+
+                NFT_LOG(L_VERBOSE, "\"%s\": retrying after recovery step %d",
+                        n->id, tier + 1);
+                r = _transfer_once(n, buf, start, end, bpc);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        unsigned int us = (t1.tv_sec - t0.tv_sec) * 1000000 +
+                (t1.tv_nsec - t0.tv_nsec) / 1000;
+
+        pthread_mutex_lock(&_fence.mutex);
+        if(r)
+        {
+                n->stats.recoveries++;
+                n->stats.steps[tier - 1]++;
+        }
+        else
+                n->stats.failures++;
+        n->stats.last_time = us;
+        if(us > n->stats.max_time)
+                n->stats.max_time = us;
+        pthread_mutex_unlock(&_fence.mutex);
+
+        NFT_LOG(r ? L_INFO : L_ERROR, "\"%s\": recovery %s after %u us",
+                n->id, r ? "succeeded" : "failed", us);
+
+        return r;
+}
+
+
+/** transfer buf[start, end) to controller (bpc = bytes per LED) */
+static NftResult _transfer(Niftylino * n, char *buf, size_t start,
+                           size_t end, size_t bpc)
+{
+        if(_transfer_once(n, buf, start, end, bpc))
+                return NFT_SUCCESS;
+
+        NFT_LOG(L_WARNING, "Transfer to \"%s\" failed", n->id);
+
+        if(!n->recovery)
+                return NFT_FAILURE;
+
+        return _recover(n, buf, start, end, bpc);
+}
+
+
+/**
+ * estimate how long a bulk transfer of size bytes takes (ns). Recent
+ * transfers are fitted to a fixed per-transfer latency plus a time per
+ * byte (least squares), so small transfers don't look like slow ones.
+ */
+static uint64_t _tx_estimate(Niftylino * n, size_t size)
+{
+        unsigned int i, k = n->tx_samples;
+
+        double mx = 0, my = 0;
+        for(i = 0; i < k; i++)
+        {
+                mx += n->tx_bytes[i];
+                my += n->tx_time[i];
+        }
+        mx /= k;
+        my /= k;
+
+        double sxx = 0, sxy = 0;
+        for(i = 0; i < k; i++)
+        {
+                double dx = n->tx_bytes[i] - mx;
+                sxx += dx * dx;
+                sxy += dx * (n->tx_time[i] - my);
+        }
+
+        /* transfers of one size only tell their mean duration */
+        double per_byte = sxx > 0 ? sxy / sxx : (mx > 0 ? my / mx : 0);
+        double latency = sxx > 0 ? my - per_byte * mx : 0;
+
+        /* keep both terms positive (jitter) */
+        if(per_byte < 0)
+        {
+                per_byte = 0;
+                latency = my;
+        }
+        else if(latency < 0)
+        {
+                latency = 0;
+                per_byte = mx > 0 ? my / mx : 0;
+        }
+
+        return (uint64_t) (latency + per_byte * size);
+}
+
+
+/**
+ * decide about value width to use for the next frame of a 16 bit chain.
+ * 
+ * Estimates how long the next frame takes with 16 bit values (size is the
+ * amount of bytes it will transfer at 16 bit) and falls back to 8 bit if
+ * that's over budget for a couple of frames. Returns to 16 bit once there
+ * is enough headroom again.
+ */
+static NiftylinoValueWidth _adapt_width(Niftylino * n, size_t size)
+{
+        /* adaptive mode disabled? */
+        if(n->target_fps <= 0 || n->format_width != NIFTYLINO_16BIT_VALUES)
+        {
+                n->adapt_frames = 0;
+                return n->format_width;
+        }
+
+        if(n->tx_samples == 0)
+                return n->wire_width;
+
+        uint64_t budget = 1000000000ULL / n->target_fps;
+        uint64_t estimate = _tx_estimate(n, size);
+
+        if(n->wire_width == NIFTYLINO_16BIT_VALUES)
+        {
+                n->adapt_frames = estimate > budget ? n->adapt_frames + 1 : 0;
+                if(n->adapt_frames < ADAPT_FRAMES_DOWN)
+                        return NIFTYLINO_16BIT_VALUES;
+        }
+        else
+        {
+                n->adapt_frames =
+                        estimate * 100 < budget * ADAPT_HEADROOM ?
+                        n->adapt_frames + 1 : 0;
+                if(n->adapt_frames < ADAPT_FRAMES_UP)
+                        return NIFTYLINO_8BIT_VALUES;
+        }
+
+        n->adapt_frames = 0;
+        return n->wire_width ==
+                NIFTYLINO_16BIT_VALUES ? NIFTYLINO_8BIT_VALUES :
+                NIFTYLINO_16BIT_VALUES;
+}
+
+
+/** bulk transfer worker (one per adapter) */
+static void *_worker_thread(void *arg)
+{
+        Niftylino *n = arg;
+
+        pthread_mutex_lock(&_fence.mutex);
+        while(n->worker_running)
+        {
+                if(!n->tx_pending)
+                {
+                        pthread_cond_wait(&n->worker_cond, &_fence.mutex);
+                        continue;
+                }
+
+                char *buf = n->tx_buf;
+                size_t start = n->tx_start, end = n->tx_end;
+                size_t bpc = n->tx_bpc;
+                pthread_mutex_unlock(&_fence.mutex);
+
+                NftResult r = _transfer(n, buf, start, end, bpc);
+
+                pthread_mutex_lock(&_fence.mutex);
+                n->tx_result = r;
+                if(!r)
+                        n->shadow_valid = false;
+                n->tx_pending = false;
+                _fence.in_flight--;
+                pthread_cond_broadcast(&_fence.cond);
+        }
+        pthread_mutex_unlock(&_fence.mutex);
+
+        return NULL;
+}
+
+
+/** wait until this adapter has no transfer in flight (call with fence locked) */
+static void _worker_wait(Niftylino * n)
+{
+        while(n->tx_pending)
+                pthread_cond_wait(&_fence.cond, &_fence.mutex);
+}
+
+
+/** start bulk transfer worker */
+static NftResult _worker_start(Niftylino * n)
+{
+        n->tx_pending = false;
+        n->tx_result = NFT_SUCCESS;
+        n->worker_running = true;
+
+        if(pthread_create(&n->worker, NULL, _worker_thread, n) != 0)
+        {
+                NFT_LOG_PERROR("pthread_create");
+                n->worker_running = false;
+                return NFT_FAILURE;
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/** stop bulk transfer worker after it finished pending transfers */
+static void _worker_stop(Niftylino * n)
+{
+        pthread_mutex_lock(&_fence.mutex);
+        if(!n->worker_running)
+        {
+                pthread_mutex_unlock(&_fence.mutex);
+                return;
+        }
+        _worker_wait(n);
+        n->worker_running = false;
+        pthread_cond_signal(&n->worker_cond);
+        pthread_mutex_unlock(&_fence.mutex);
+
+        pthread_join(n->worker, NULL);
+}
+
 /*******************************************************************************
  *******************************************************************************
  ******************************************************************************/
@@ -179,19 +850,75 @@ static NftResult _init(void **privdata, LedHardware * hw)
         /* save our hardware descriptor for later */
         n->hw = hw;
 
-        /* initialize usb subsystem */
-        usb_init();
-
-        /* enable debugging */
-        int level = 0;
-        if(nft_log_level_is_noisier_than(nft_log_level_get(), L_VERBOSE))
-                level = 3;
-        else if(nft_log_level_is_noisier_than(nft_log_level_get(), L_INFO))
-                level = 2;
-        else if(nft_log_level_is_noisier_than(nft_log_level_get(), L_ERROR))
-                level = 1;
-
-        usb_set_debug(level);
+        /* recover from transfer errors by default */
+        n->recovery = true;
+        pthread_rwlock_init(&n->handle_lock, NULL);
+
+        /* transfer in background by default */
+        n->async_send = true;
+        pthread_cond_init(&n->worker_cond, NULL);
+
+        /* telemetry poller */
+        n->telemetry_interval = TELEMETRY_INTERVAL_DEFAULT;
+        pthread_mutex_init(&n->telemetry_mutex, NULL);
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&n->telemetry_cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        /* register dynamic properties */
+        if(!led_hardware_plugin_prop_register
+           (hw, "telemetry_interval", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "state", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "firmware_version", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "device_chainlength", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "dirty_detect", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "offset_writes", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "async_send", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "target_fps", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "bitwidth", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "recovery", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "recoveries", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "recovery_failures", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "recovery_time_us", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "recovery_time_max_us", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "recovery_clear_halt", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "recovery_reclaim", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
+        if(!led_hardware_plugin_prop_register
+           (hw, "recovery_reopen", LED_HW_CUSTOM_PROP_INT))
+                return NFT_FAILURE;
 
         return NFT_SUCCESS;
 }
@@ -205,12 +932,43 @@ static void _deinit(void *privdata)
 
         /* deinitialize hardware */
         Niftylino *n = privdata;
-        if(n)
-                free(n);
+        if(!n)
+                return;
+
+        /* unregister properties */
+        led_hardware_plugin_prop_unregister(n->hw, "telemetry_interval");
+        led_hardware_plugin_prop_unregister(n->hw, "state");
+        led_hardware_plugin_prop_unregister(n->hw, "firmware_version");
+        led_hardware_plugin_prop_unregister(n->hw, "device_chainlength");
+        led_hardware_plugin_prop_unregister(n->hw, "dirty_detect");
+        led_hardware_plugin_prop_unregister(n->hw, "offset_writes");
+        led_hardware_plugin_prop_unregister(n->hw, "async_send");
+        led_hardware_plugin_prop_unregister(n->hw, "target_fps");
+        led_hardware_plugin_prop_unregister(n->hw, "bitwidth");
+        led_hardware_plugin_prop_unregister(n->hw, "recovery");
+        led_hardware_plugin_prop_unregister(n->hw, "recoveries");
+        led_hardware_plugin_prop_unregister(n->hw, "recovery_failures");
+        led_hardware_plugin_prop_unregister(n->hw, "recovery_time_us");
+        led_hardware_plugin_prop_unregister(n->hw, "recovery_time_max_us");
+        led_hardware_plugin_prop_unregister(n->hw, "recovery_clear_halt");
+        led_hardware_plugin_prop_unregister(n->hw, "recovery_reclaim");
+        led_hardware_plugin_prop_unregister(n->hw, "recovery_reopen");
+
+        pthread_cond_destroy(&n->worker_cond);
+        pthread_cond_destroy(&n->telemetry_cond);
+        pthread_mutex_destroy(&n->telemetry_mutex);
+        pthread_rwlock_destroy(&n->handle_lock);
+
+        free(n->gains);
+        free(n->wire);
+        free(n->shadow);
+        free(n);
 
 }
 
 
+/* forward declaration */
+static void _usb_deinit(void *privdata);
 
 /**
  * initialize hardware
@@ -219,10 +977,6 @@ static NftResult _usb_init(void *privdata, const char *id)
 {
         Niftylino *n = privdata;
 
-        struct usb_bus *bus;
-        struct usb_device *dev;
-        struct usb_dev_handle *h;
-
         /* save id */
         strncpy(n->id, id, sizeof(n->id));
 
@@ -264,119 +1018,57 @@ static NftResult _usb_init(void *privdata, const char *id)
         }
 
 
-        /* find (new) busses */
-        usb_find_busses();
-
-        /* find (new) devices */
-        usb_find_devices();
-
-
+        /* fake controller requested? */
+        if(strncmp(n->id, "fake", 4) == 0)
+                n->transport = &niftylino_transport_fake;
+        else
+                n->transport = &niftylino_transport_libusb;
 
-        /* open niftylino usb-device */
+        /* open niftylino device */
         char serial[255];
+        if(!n->transport->open(&n->handle, n->id, serial, sizeof(serial)))
+                return NFT_FAILURE;
 
-        /* walk all busses */
-        for(bus = usb_get_busses(); bus; bus = bus->next)
-        {
-                /* walk all devices on bus */
-                for(dev = bus->devices; dev; dev = dev->next)
-                {
-                        /* found niftylino? */
-                        if((dev->descriptor.idVendor != VENDOR_ID) ||
-                           (dev->descriptor.idProduct != PRODUCT_ID))
-                        {
-                                continue;
-                        }
-
-
-                        /* try to open */
-                        if(!(h = usb_open(dev)))
-                                /* device allready open or other error */
-                                continue;
-
-                        /* interface already claimed by driver? */
-                        char driver[1024];
-                        if(!(usb_get_driver_np(h, 0, driver, sizeof(driver))))
-                        {
-                                // NFT_LOG(L_ERROR, "Device already claimed by
-                                // \"%s\"", driver);
-                                continue;
-                        }
-
-                        /* reset device */
-                        usb_reset(h);
-                        usb_close(h);
-                        // ~ if(usb_reset(h) < 0)
-                        // ~ {
-                        // ~ /* reset failed */
-                        // ~ usb_close(h);
-                        // ~ continue;
-                        // ~ }
-
-                        /* re-open */
-                        if(!(h = usb_open(dev)))
-                                /* device allready open or other error */
-                                continue;
-
-                        /* clear any previous halt status */
-                        // usb_clear_halt(h, 0);
-
-                        /* claim interface */
-                        if(usb_claim_interface(h, 0) < 0)
-                        {
-                                /* device claim failed */
-                                usb_close(h);
-                                continue;
-                        }
-
-                        /* receive string-descriptor (serial number) */
-                        if(usb_get_string_simple(h, 3, serial, sizeof(serial))
-                           < 0)
-                        {
-                                usb_release_interface(h, 0);
-                                usb_close(h);
-                                continue;
-                        }
-
+        /* serial-number... */
+        strncpy(n->id, serial, sizeof(n->id));
 
-                        /* device id == requested id? (or wildcard id
-                         * requested? */
-                        if(strlen(n->id) == 0 ||
-                           strncmp(n->id, serial, sizeof(serial)) == 0 ||
-                           strncmp(n->id, "*", 1) == 0)
-                        {
-                                /* serial-number... */
-                                strncpy(n->id, serial, sizeof(n->id));
-                                /* usb device handle */
-                                n->usb_handle = h;
+        /* we don't know what the controller holds */
+        n->shadow_valid = false;
+        n->write_offset = 0;
+        n->format_width = vw;
+        n->wire_width = vw;
+        n->adapt_frames = 0;
+        n->tx_samples = 0;
+        n->tx_next = 0;
 
-                                /* set format */
-                                NFT_LOG(L_INFO, "Setting bitwidth to %d bit",
-                                        (vw ==
-                                         NIFTYLINO_8BIT_VALUES ? 8 : 16));
+        /* set format */
+        NFT_LOG(L_INFO, "Setting bitwidth to %d bit",
+                (vw == NIFTYLINO_8BIT_VALUES ? 8 : 16));
 
-                                if(!_set_format(privdata, vw))
-                                {
-                                        NFT_LOG(L_ERROR,
-                                                "Failed to set greyscale format to %s.",
-                                                vw ==
-                                                NIFTYLINO_8BIT_VALUES ? "u8" :
-                                                "u16");
-                                        return NFT_FAILURE;
-                                }
-
-                                return NFT_SUCCESS;
-                        }
-
-                        /* close this adapter */
-                        usb_release_interface(h, 0);
-                        usb_close(h);
+        if(!_set_format(privdata, vw))
+        {
+                NFT_LOG(L_ERROR,
+                        "Failed to set greyscale format to %s.",
+                        vw == NIFTYLINO_8BIT_VALUES ? "u8" : "u16");
+                _usb_deinit(privdata);
+                return NFT_FAILURE;
+        }
 
+        /* start bulk transfer worker */
+        if(!_worker_start(n))
+        {
+                _usb_deinit(privdata);
+                return NFT_FAILURE;
+        }
 
-                }
+        /* start polling controller state */
+        if(!_telemetry_start(n))
+        {
+                _usb_deinit(privdata);
+                return NFT_FAILURE;
         }
 
-        return NFT_FAILURE;
+        return NFT_SUCCESS;
 }
 
 
@@ -387,12 +1079,15 @@ static void _usb_deinit(void *privdata)
 {
         Niftylino *n = privdata;
 
-        if(!(n->usb_handle))
+        _telemetry_stop(n);
+        _worker_stop(n);
+
+        /* handle might be gone after failed recovery */
+        if(!(n->handle))
                 return;
 
-        usb_release_interface(n->usb_handle, 0);
-        usb_close(n->usb_handle);
-        n->usb_handle = NULL;
+        n->transport->close(n->handle);
+        n->handle = NULL;
 }
 
 /**
@@ -418,6 +1113,116 @@ NftResult _get_handler(void *privdata, LedPluginParam o,
                         return NFT_SUCCESS;
                 }
 
+                        /* telemetry values are -1 until first successful
+                         * poll */
+                case LED_HW_CUSTOM_PROP:
+                {
+                        NftResult r = NFT_SUCCESS;
+
+                        pthread_mutex_lock(&n->telemetry_mutex);
+                        if(strcmp(data->custom.name, "dirty_detect") == 0)
+                        {
+                                data->custom.value.i = n->dirty_detect;
+                        }
+                        else if(strcmp(data->custom.name, "async_send") == 0)
+                        {
+                                data->custom.value.i = n->async_send;
+                        }
+                        else if(strcmp(data->custom.name, "target_fps") == 0)
+                        {
+                                data->custom.value.i = n->target_fps;
+                        }
+                        else if(strcmp(data->custom.name, "recovery") == 0)
+                        {
+                                data->custom.value.i = n->recovery;
+                        }
+                        else if(strncmp(data->custom.name, "recover", 7) == 0)
+                        {
+                                pthread_mutex_lock(&_fence.mutex);
+                                NiftylinoRecoveryStats st = n->stats;
+                                pthread_mutex_unlock(&_fence.mutex);
+
+                                if(strcmp(data->custom.name, "recoveries") ==
+                                   0)
+                                        data->custom.value.i = st.recoveries;
+                                else if(strcmp
+                                        (data->custom.name,
+                                         "recovery_failures") == 0)
+                                        data->custom.value.i = st.failures;
+                                else if(strcmp
+                                        (data->custom.name,
+                                         "recovery_time_us") == 0)
+                                        data->custom.value.i = st.last_time;
+                                else if(strcmp
+                                        (data->custom.name,
+                                         "recovery_time_max_us") == 0)
+                                        data->custom.value.i = st.max_time;
+                                else if(strcmp
+                                        (data->custom.name,
+                                         "recovery_clear_halt") == 0)
+                                        data->custom.value.i = st.steps[0];
+                                else if(strcmp
+                                        (data->custom.name,
+                                         "recovery_reclaim") == 0)
+                                        data->custom.value.i = st.steps[1];
+                                else if(strcmp
+                                        (data->custom.name,
+                                         "recovery_reopen") == 0)
+                                        data->custom.value.i = st.steps[2];
+                                else
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "Unhandled custom property \"%s\"",
+                                                data->custom.name);
+                                        r = NFT_FAILURE;
+                                }
+                        }
+                        else if(strcmp(data->custom.name, "bitwidth") == 0)
+                        {
+                                data->custom.value.i =
+                                        n->wire_width ==
+                                        NIFTYLINO_8BIT_VALUES ? 8 : 16;
+                        }
+                        else if(strcmp(data->custom.name, "offset_writes") ==
+                                0)
+                        {
+                                data->custom.value.i = n->offset_writes;
+                        }
+                        else if(strcmp(data->custom.name, "telemetry_interval")
+                                == 0)
+                        {
+                                data->custom.value.i = n->telemetry_interval;
+                        }
+                        else if(strcmp(data->custom.name, "state") == 0)
+                        {
+                                data->custom.value.i = n->telemetry.valid ?
+                                        (int) n->telemetry.state : -1;
+                        }
+                        else if(strcmp(data->custom.name, "firmware_version")
+                                == 0)
+                        {
+                                data->custom.value.i = n->telemetry.valid ?
+                                        (int) n->telemetry.version : -1;
+                        }
+                        else if(strcmp(data->custom.name, "device_chainlength")
+                                == 0)
+                        {
+                                data->custom.value.i = n->telemetry.valid ?
+                                        (int) n->telemetry.chainlength : -1;
+                        }
+                        else
+                        {
+                                NFT_LOG(L_ERROR,
+                                        "Unhandled custom property \"%s\"",
+                                        data->custom.name);
+                                r = NFT_FAILURE;
+                        }
+                        pthread_mutex_unlock(&n->telemetry_mutex);
+
+                        data->custom.valuesize = sizeof(int);
+                        return r;
+                }
+
                 default:
                 {
                         NFT_LOG(L_ERROR,
@@ -462,9 +1267,129 @@ NftResult _set_handler(void *privdata, LedPluginParam o,
                                 return NFT_FAILURE;
 
                         n->ledcount = data->ledcount;
+                        n->shadow_valid = false;
                         return NFT_SUCCESS;
                 }
 
+                case LED_HW_CUSTOM_PROP:
+                {
+                        if(strcmp(data->custom.name, "dirty_detect") == 0)
+                        {
+                                pthread_mutex_lock(&_fence.mutex);
+                                n->dirty_detect = (data->custom.value.i != 0);
+                                n->shadow_valid = false;
+                                pthread_mutex_unlock(&_fence.mutex);
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"dirty_detect\" of \"%s\" to %d",
+                                        n->id, n->dirty_detect);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "async_send") == 0)
+                        {
+                                /* finish what's in flight before switching */
+                                pthread_mutex_lock(&_fence.mutex);
+                                _worker_wait(n);
+                                n->async_send = (data->custom.value.i != 0);
+                                pthread_mutex_unlock(&_fence.mutex);
+
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"async_send\" of \"%s\" to %d",
+                                        n->id, n->async_send);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "recovery") == 0)
+                        {
+                                n->recovery = (data->custom.value.i != 0);
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"recovery\" of \"%s\" to %d",
+                                        n->id, n->recovery);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "target_fps") == 0)
+                        {
+                                if(data->custom.value.i < 0)
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "target_fps must be >= 0 (0 = off)");
+                                        return NFT_FAILURE;
+                                }
+
+                                pthread_mutex_lock(&_fence.mutex);
+                                n->target_fps = data->custom.value.i;
+                                n->adapt_frames = 0;
+                                pthread_mutex_unlock(&_fence.mutex);
+
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"target_fps\" of \"%s\" to %d",
+                                        n->id, n->target_fps);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "offset_writes") ==
+                                0)
+                        {
+                                pthread_mutex_lock(&_fence.mutex);
+                                _worker_wait(n);
+                                n->offset_writes = (data->custom.value.i != 0);
+                                pthread_mutex_unlock(&_fence.mutex);
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"offset_writes\" of \"%s\" to %d",
+                                        n->id, n->offset_writes);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "telemetry_interval") ==
+                           0)
+                        {
+                                if(data->custom.value.i < 0)
+                                {
+                                        NFT_LOG(L_ERROR,
+                                                "telemetry_interval must be >= 0 (0 = off)");
+                                        return NFT_FAILURE;
+                                }
+
+                                pthread_mutex_lock(&n->telemetry_mutex);
+                                n->telemetry_interval = data->custom.value.i;
+                                pthread_cond_signal(&n->telemetry_cond);
+                                pthread_mutex_unlock(&n->telemetry_mutex);
+
+                                NFT_LOG(L_DEBUG,
+                                        "Setting \"telemetry_interval\" of \"%s\" to %d ms",
+                                        n->id, data->custom.value.i);
+                                return NFT_SUCCESS;
+                        }
+                        else if(strcmp(data->custom.name, "state") == 0 ||
+                                strcmp(data->custom.name,
+                                       "firmware_version") == 0 ||
+                                strcmp(data->custom.name,
+                                       "device_chainlength") == 0 ||
+                                strcmp(data->custom.name, "bitwidth") == 0 ||
+                                strcmp(data->custom.name, "recoveries") == 0 ||
+                                strcmp(data->custom.name,
+                                       "recovery_failures") == 0 ||
+                                strcmp(data->custom.name,
+                                       "recovery_time_us") == 0 ||
+                                strcmp(data->custom.name,
+                                       "recovery_time_max_us") == 0 ||
+                                strcmp(data->custom.name,
+                                       "recovery_clear_halt") == 0 ||
+                                strcmp(data->custom.name,
+                                       "recovery_reclaim") == 0 ||
+                                strcmp(data->custom.name,
+                                       "recovery_reopen") == 0)
+                        {
+                                NFT_LOG(L_WARNING,
+                                        "\"%s\" is read-only. Not changing it.",
+                                        data->custom.name);
+                                return NFT_SUCCESS;
+                        }
+                        else
+                        {
+                                NFT_LOG(L_ERROR,
+                                        "Unhandled custom property \"%s\"",
+                                        data->custom.name);
+                                return NFT_FAILURE;
+                        }
+                }
+
                 default:
                 {
                         return NFT_SUCCESS;
@@ -485,6 +1410,20 @@ NftResult _show(void *privdata)
         if(!n)
                 NFT_LOG_NULL(NFT_FAILURE);
 
+        /* wait for all adapters to finish their transfers */
+        pthread_mutex_lock(&_fence.mutex);
+        while(_fence.in_flight > 0)
+                pthread_cond_wait(&_fence.cond, &_fence.mutex);
+        NftResult r = n->tx_result;
+        n->tx_result = NFT_SUCCESS;
+        pthread_mutex_unlock(&_fence.mutex);
+
+        if(!r)
+        {
+                NFT_LOG(L_ERROR, "Transfer to \"%s\" failed", n->id);
+                return NFT_FAILURE;
+        }
+
         /* latch hardware */
         return _adapter_usb_send(n, NIFTY_LATCH, NULL, 0);
 }
@@ -502,15 +1441,128 @@ NftResult _send(void *privdata, LedChain * c, LedCount count, LedCount offset)
 
         Niftylino *n = privdata;
 
-        if(!n || !n->usb_handle)
+        if(!n || !n->handle)
                 NFT_LOG_NULL(NFT_FAILURE);
 
 
         char *buffer = led_chain_get_buffer(c);
+        size_t size = led_chain_get_buffer_size(c);
+        LedCount ledcount = led_chain_get_ledcount(c);
+
+        if(ledcount == 0 || offset >= ledcount)
+                return NFT_SUCCESS;
+
+        if(count > ledcount - offset)
+                count = ledcount - offset;
+
+        /* nothing to transfer (would queue an empty bulk transfer) */
+        if(count == 0)
+                return NFT_SUCCESS;
+
+        /* byte range of requested LEDs */
+        size_t bpc = size / ledcount;
+        size_t start = offset * bpc;
+        size_t end = (offset + count) * bpc;
+
+        /* previous transfer must be done before we touch the shadow buffer */
+        pthread_mutex_lock(&_fence.mutex);
+        _worker_wait(n);
+
+        if(!_shadow_resize(n, size))
+        {
+                pthread_mutex_unlock(&_fence.mutex);
+                return NFT_FAILURE;
+        }
+
+        /* only transfer what changed since last time */
+        if(n->dirty_detect && n->shadow_valid)
+        {
+                if(!_dirty_range(buffer, n->shadow, &start, &end))
+                {
+                        pthread_mutex_unlock(&_fence.mutex);
+                        NFT_LOG(L_NOISY, "Nothing changed. Skipping transfer.");
+                        return NFT_SUCCESS;
+                }
+
+                /* align to LED boundaries */
+                start -= start % bpc;
+                end += (bpc - end % bpc) % bpc;
+        }
+
+        /* 
+         * without firmware support, each bulk transfer starts at the first
+         * LED. Coalesce into one transfer from the start of the chain to the
+         * end of the range.
+         */
+        if(!n->offset_writes)
+                start = 0;
+
+        /* switch value width? (controller is idle now) */
+        NiftylinoValueWidth w = _adapt_width(n, end - start);
+        if(w != n->wire_width)
+        {
+                pthread_mutex_unlock(&_fence.mutex);
+
+                NFT_LOG(L_INFO, "\"%s\": switching to %d bit values", n->id,
+                        w == NIFTYLINO_8BIT_VALUES ? 8 : 16);
+
+                if(!_set_format(n, w))
+                        return NFT_FAILURE;
+
+                pthread_mutex_lock(&_fence.mutex);
+                n->wire_width = w;
+
+                /* controller needs a complete frame in the new format */
+                n->shadow_valid = false;
+                start = 0;
+                end = size;
+        }
+
+        /* shadow buffer is what we transfer from */
+        memcpy(n->shadow + start, buffer + start, end - start);
+        if(start == 0 && end == size)
+                n->shadow_valid = true;
+
+        char *tx = n->shadow;
+
+        /* ...unless we send 8 bit values of a 16 bit chain */
+        if(n->wire_width != n->format_width)
+        {
+                if(!_wire_resize(n, size / 2))
+                {
+                        n->shadow_valid = false;
+                        pthread_mutex_unlock(&_fence.mutex);
+                        return NFT_FAILURE;
+                }
+
+                _downconvert((uint8_t *) n->wire + start / 2,
+                             (const uint16_t *) (n->shadow + start),
+                             (end - start) / 2);
+                tx = n->wire;
+                start /= 2;
+                end /= 2;
+                bpc /= 2;
+        }
+
+        /* queue transfer for worker */
+        if(n->async_send && n->worker_running)
+        {
+                n->tx_buf = tx;
+                n->tx_start = start;
+                n->tx_end = end;
+                n->tx_bpc = bpc;
+                n->tx_pending = true;
+                _fence.in_flight++;
+                pthread_cond_signal(&n->worker_cond);
+                pthread_mutex_unlock(&_fence.mutex);
+                return NFT_SUCCESS;
+        }
+        pthread_mutex_unlock(&_fence.mutex);
 
-        if(usb_bulk_write(n->usb_handle, 1, buffer,
-                          led_chain_get_buffer_size(c), n->usb_timeout) < 0)
+        /* ...or transfer right away */
+        if(!_transfer(n, tx, start, end, bpc))
         {
+                n->shadow_valid = false;
                 return NFT_FAILURE;
         }
 
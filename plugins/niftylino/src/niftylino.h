@@ -45,11 +45,64 @@
 #ifndef _NIFTYLINO
 #define _NIFTYLINO
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "niftylino_transport.h"
+
+
+/** bulk transfers the duration estimate of _adapt_width() is fitted to */
+#define ADAPT_SAMPLES                   16
+
+
+/** controller state as read back by the telemetry poller */
+typedef struct
+{
+        /** result of NIFTY_GET_STATE */
+        uint32_t                        state;
+        /** result of NIFTY_GET_VERSION */
+        uint32_t                        version;
+        /** result of NIFTY_GET_CHAINLENGTH */
+        uint32_t                        chainlength;
+        /** true after the first successful poll */
+        bool                            valid;
+} NiftylinoTelemetry;
+
+
+/** statistics of in-place error recovery */
+typedef struct
+{
+        /** successful recoveries */
+        unsigned int                    recoveries;
+        /** recoveries that didn't help */
+        unsigned int                    failures;
+        /** duration of last recovery (microseconds) */
+        unsigned int                    last_time;
+        /** longest recovery so far (microseconds) */
+        unsigned int                    max_time;
+        /** successful recoveries by step that fixed it (clear halt,
+            re-claim, re-open) */
+        unsigned int                    steps[3];
+} NiftylinoRecoveryStats;
+
+
+/* available bits per led-brightness-value */
+typedef enum
+{
+        NIFTYLINO_8BIT_VALUES = 0,
+        NIFTYLINO_16BIT_VALUES,
+} NiftylinoValueWidth;
+
+
 /** private plugin information */
 typedef struct
 {
-        /** usb-dev-handle of controller */
-        struct usb_dev_handle          *usb_handle;
+        /** transport used to talk to the controller */
+        const NiftylinoTransport       *transport;
+        /** handle of opened controller (owned by transport) */
+        void                           *handle;
+        /** held for reading while using handle, for writing to replace it */
+        pthread_rwlock_t                handle_lock;
         /** usb timeout */
         unsigned int                    usb_timeout;
         /** id of this adapter (with niftylino adapters it's the USB serial string) */
@@ -58,20 +111,89 @@ typedef struct
         LedHardware                    *hw;
         /** current ledcount of this instance */
         LedCount                        ledcount;
+        /** telemetry poller thread */
+        pthread_t                       poller;
+        /** true while the poller thread should keep running */
+        bool                            poller_running;
+        /** protects telemetry & poller state */
+        pthread_mutex_t                 telemetry_mutex;
+        /** wakes up the poller (interval change or shutdown) */
+        pthread_cond_t                  telemetry_cond;
+        /** milliseconds between two polls (0 = don't poll) */
+        int                             telemetry_interval;
+        /** last telemetry read from the controller */
+        NiftylinoTelemetry              telemetry;
+        /** copy of chain buffer as last sent to the controller */
+        char                           *shadow;
+        /** size of shadow buffer (bytes) */
+        size_t                          shadow_size;
+        /** true if shadow buffer matches the controller's contents */
+        bool                            shadow_valid;
+        /** only transfer bytes that changed since the last transfer */
+        bool                            dirty_detect;
+        /** controller supports NIFTY_SET_WRITE_OFFSET */
+        bool                            offset_writes;
+        /** last offset sent with NIFTY_SET_WRITE_OFFSET */
+        uint32_t                        write_offset;
+        /** hand bulk transfers to a worker thread */
+        bool                            async_send;
+        /** bulk transfer worker */
+        pthread_t                       worker;
+        /** true while worker should keep running */
+        bool                            worker_running;
+        /** wakes up worker (protected by frame fence mutex) */
+        pthread_cond_t                  worker_cond;
+        /** true while a transfer is queued or in progress */
+        bool                            tx_pending;
+        /** buffer to transfer from (shadow or wire buffer) */
+        char                           *tx_buf;
+        /** range of tx_buf to transfer */
+        size_t                          tx_start, tx_end;
+        /** bytes per LED of queued transfer */
+        size_t                          tx_bpc;
+        /** result of last finished transfer */
+        NftResult                       tx_result;
+        /** duration (ns) & size (bytes) of recent bulk transfers */
+        uint64_t                        tx_time[ADAPT_SAMPLES];
+        size_t                          tx_bytes[ADAPT_SAMPLES];
+        /** amount of valid samples & index of the next one */
+        unsigned int                    tx_samples, tx_next;
+        /** value width of our chain */
+        NiftylinoValueWidth             format_width;
+        /** value width the controller currently expects */
+        NiftylinoValueWidth             wire_width;
+        /** frame rate to keep up by lowering bitwidth (0 = don't adapt) */
+        int                             target_fps;
+        /** consecutive frames over (or under) budget */
+        unsigned int                    adapt_frames;
+        /** 8 bit values of a 16 bit chain when running in 8 bit mode */
+        char                           *wire;
+        /** size of wire buffer (bytes) */
+        size_t                          wire_size;
+        /** try to recover from transfer errors in place */
+        bool                            recovery;
+        /** gain of every chip as last set (-1 = never set) */
+        int                            *gains;
+        /** amount of entries in gains */
+        size_t                          n_gains;
+        /** recovery statistics (protected by frame fence mutex) */
+        NiftylinoRecoveryStats          stats;
 } Niftylino;
 
 
-/* available bits per led-brightness-value */
-typedef enum
-{
-        NIFTYLINO_8BIT_VALUES = 0,
-        NIFTYLINO_16BIT_VALUES,
-} NiftylinoValueWidth;
-
-
 /** niftylino USB device & product id */
 #define VENDOR_ID       0x0483
 #define PRODUCT_ID	0x5740
 
 #define LEDS_PER_CHIP 	16
+
+/** default interval between two telemetry polls (milliseconds) */
+#define TELEMETRY_INTERVAL_DEFAULT      1000
+
+/** frames over budget before falling back to 8 bit */
+#define ADAPT_FRAMES_DOWN               8
+/** frames with enough headroom before returning to 16 bit */
+#define ADAPT_FRAMES_UP                 64
+/** 16 bit transfers must fit in this share of the budget to return (%) */
+#define ADAPT_HEADROOM                  75
 #endif
@@ -0,0 +1,585 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/**
+ * in-process niftylino emulation
+ *
+ * Models the time a transfer takes on the bus (bandwidth + per-transfer
+ * latency) and records every control & bulk message. Used to test and
+ * benchmark the plugin without an adapter plugged in.
+ *
+ * id syntax: "fake[:<speed>[:<latency-us>]]" where speed is "fs" (USB
+ * full-speed), "hs" (USB high-speed) or a bulk bandwidth in bytes/second.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <niftyled.h>
+#include "config.h"
+#include "niftylino.h"
+#include "niftylino_usb.h"
+#include "niftylino_transport.h"
+#include "niftylino_fake.h"
+
+
+/** usable bulk bandwidth of USB full-speed (19 * 64 bytes per 1 ms frame) */
+#define FAKE_FS_BANDWIDTH       1216000
+/** usable bulk bandwidth of USB high-speed (13 * 512 bytes per 125 us) */
+#define FAKE_HS_BANDWIDTH       53248000
+/** per-transfer latency of full-speed (one frame) */
+#define FAKE_FS_LATENCY_US      1000
+/** per-transfer latency of high-speed (one microframe) */
+#define FAKE_HS_LATENCY_US      125
+
+
+/** emulated controller */
+typedef struct _FakeDevice
+{
+        /** next open controller */
+        struct _FakeDevice *next;
+        /** id controller was opened with */
+        char id[256];
+        pthread_mutex_t mutex;
+        /** bulk bandwidth in bytes/second */
+        uint64_t bandwidth;
+        /** latency of each transfer (ns) */
+        uint64_t latency;
+        /** time the modelled bus is free again (ns) */
+        uint64_t bus_free;
+        /** controller state as set by the host */
+        uint32_t chainlength;
+        uint32_t bitwidth;
+        /** bulk writes until injected error (0 = none) & its errno */
+        unsigned int fail_in;
+        int fail_error;
+        /** errno of failure waiting for recovery (0 = none) */
+        int error;
+        /** record of all messages */
+        NiftylinoFakeRecord *records;
+        size_t n_records;
+        size_t records_size;
+        /** statistics */
+        uint64_t bulk_bytes;
+        uint64_t wire_time;
+} FakeDevice;
+
+
+/** all open controllers, looked up by tests */
+static FakeDevice *_devices;
+static pthread_mutex_t _devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** current time (ns) */
+static uint64_t _now(void)
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return (uint64_t) t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+
+/** sleep until t (ns) */
+static void _sleep_until(uint64_t t)
+{
+        struct timespec ts = {
+                .tv_sec = t / 1000000000ULL,
+                .tv_nsec = t % 1000000000ULL
+        };
+
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) !=
+              0);
+}
+
+
+/**
+ * account for one transfer on the modelled bus and record it.
+ * Blocks for as long as the transfer would take.
+ */
+static void _transfer(FakeDevice * d, NiftylinoFakeMessageType type,
+                      unsigned int message, const char *payload,
+                      size_t size, bool bulk)
+{
+        pthread_mutex_lock(&d->mutex);
+
+        /* transfers on the same device are serialized on the bus */
+        uint64_t now = _now();
+        uint64_t start = d->bus_free > now ? d->bus_free : now;
+        uint64_t duration = d->latency;
+        if(bulk)
+                duration += (uint64_t) size *1000000000ULL / d->bandwidth;
+        uint64_t end = start + duration;
+
+        d->bus_free = end;
+        d->wire_time += duration;
+        if(bulk)
+                d->bulk_bytes += size;
+
+        /* record message */
+        if(d->n_records >= d->records_size)
+        {
+                size_t s = d->records_size ? d->records_size * 2 : 1024;
+                NiftylinoFakeRecord *r;
+                if((r = realloc(d->records,
+                                s * sizeof(NiftylinoFakeRecord))))
+                {
+                        d->records = r;
+                        d->records_size = s;
+                }
+        }
+        if(d->n_records < d->records_size)
+        {
+                uint32_t value = 0;
+                uint8_t *data = NULL;
+                if(bulk)
+                {
+                        if((data = malloc(size ? size : 1)))
+                                memcpy(data, payload, size);
+                }
+                else if(payload && size >= sizeof(value))
+                {
+                        memcpy(&value, payload, sizeof(value));
+                }
+
+                d->records[d->n_records++] = (NiftylinoFakeRecord)
+                {
+                .t = end,.type = type,.message = message,.size =
+                                size,.value = value,.data = data};
+        }
+
+        pthread_mutex_unlock(&d->mutex);
+
+        _sleep_until(end);
+}
+
+
+/** "open" fake controller */
+static NftResult _open(void **handle, const char *id, char *serial,
+                       size_t serial_size)
+{
+        FakeDevice *d;
+        if(!(d = calloc(1, sizeof(FakeDevice))))
+        {
+                NFT_LOG_PERROR("calloc");
+                return NFT_FAILURE;
+        }
+
+        /* defaults: full-speed */
+        d->bandwidth = FAKE_FS_BANDWIDTH;
+        d->latency = FAKE_FS_LATENCY_US * 1000ULL;
+
+        /* parse speed & latency */
+        const char *speed = strchr(id, ':');
+        if(speed)
+        {
+                speed++;
+                if(strncmp(speed, "hs", 2) == 0)
+                {
+                        d->bandwidth = FAKE_HS_BANDWIDTH;
+                        d->latency = FAKE_HS_LATENCY_US * 1000ULL;
+                }
+                else if(strncmp(speed, "fs", 2) != 0)
+                {
+                        unsigned long long b = strtoull(speed, NULL, 10);
+                        if(b == 0)
+                        {
+                                NFT_LOG(L_ERROR,
+                                        "Invalid fake speed in \"%s\"", id);
+                                free(d);
+                                return NFT_FAILURE;
+                        }
+                        d->bandwidth = b;
+                }
+
+                const char *latency = strchr(speed, ':');
+                if(latency)
+                        d->latency = strtoull(latency + 1, NULL, 10) * 1000ULL;
+        }
+
+        pthread_mutex_init(&d->mutex, NULL);
+
+        strncpy(d->id, id, sizeof(d->id) - 1);
+        pthread_mutex_lock(&_devices_mutex);
+        d->next = _devices;
+        _devices = d;
+        pthread_mutex_unlock(&_devices_mutex);
+
+        NFT_LOG(L_INFO,
+                "Using fake niftylino (%llu bytes/s, %llu us latency)",
+                (unsigned long long) d->bandwidth,
+                (unsigned long long) d->latency / 1000);
+
+        /* our serial is the id we were opened with */
+        strncpy(serial, id, serial_size - 1);
+        serial[serial_size - 1] = '\0';
+
+        *handle = d;
+        return NFT_SUCCESS;
+}
+
+
+/** forget recorded messages (mutex must be held) */
+static void _records_free(FakeDevice * d)
+{
+        size_t i;
+        for(i = 0; i < d->n_records; i++)
+                free((void *) d->records[i].data);
+        d->n_records = 0;
+}
+
+
+/** close fake controller */
+static void _close(void *handle)
+{
+        FakeDevice *d = handle;
+
+        pthread_mutex_lock(&_devices_mutex);
+        FakeDevice **l;
+        for(l = &_devices; *l; l = &(*l)->next)
+        {
+                if(*l == d)
+                {
+                        *l = d->next;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&_devices_mutex);
+
+        size_t i, control = 0, bulk = 0;
+        for(i = 0; i < d->n_records; i++)
+        {
+                if(d->records[i].type == NIFTYLINO_FAKE_BULK_WRITE)
+                        bulk++;
+                else
+                        control++;
+        }
+
+        NFT_LOG(L_INFO,
+                "fake niftylino: %zu control messages, %zu bulk transfers (%llu bytes), %llu us on the wire",
+                control, bulk, (unsigned long long) d->bulk_bytes,
+                (unsigned long long) d->wire_time / 1000);
+
+        _records_free(d);
+        pthread_mutex_destroy(&d->mutex);
+        free(d->records);
+        free(d);
+}
+
+
+/** pending error of controller */
+static int _error(FakeDevice * d)
+{
+        pthread_mutex_lock(&d->mutex);
+        int error = d->error;
+        pthread_mutex_unlock(&d->mutex);
+        return error;
+}
+
+
+/** recover from pending error, controller forgets its state (mutex held) */
+static void _recovered(FakeDevice * d)
+{
+        if(d->error != EPIPE)
+        {
+                d->chainlength = 0;
+                d->bitwidth = 0;
+        }
+        d->error = 0;
+}
+
+
+/** receive control message */
+static int _control_send(void *handle, unsigned int message, char *payload,
+                         size_t size, unsigned int timeout)
+{
+        FakeDevice *d = handle;
+
+        if(_error(d) == ENODEV)
+                return -ENODEV;
+
+        _transfer(d, NIFTYLINO_FAKE_CONTROL_SEND, message, payload, size,
+                  false);
+
+        /* keep state we can report back */
+        uint32_t v = 0;
+        if(payload && size >= sizeof(v))
+                memcpy(&v, payload, sizeof(v));
+
+        pthread_mutex_lock(&d->mutex);
+        switch (message)
+        {
+                case NIFTY_SET_CHAINLENGTH:
+                {
+                        d->chainlength = v;
+                        break;
+                }
+
+                case NIFTY_SET_INPUT_BITWIDTH:
+                {
+                        d->bitwidth = v;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&d->mutex);
+
+        return size;
+}
+
+
+/** answer control message */
+static int _control_rcv(void *handle, unsigned int message, char *payload,
+                        size_t size, unsigned int timeout)
+{
+        FakeDevice *d = handle;
+
+        if(_error(d) == ENODEV)
+                return -ENODEV;
+
+        _transfer(d, NIFTYLINO_FAKE_CONTROL_RCV, message, NULL, size, false);
+
+        uint32_t v;
+        pthread_mutex_lock(&d->mutex);
+        switch (message)
+        {
+                case NIFTY_GET_STATE:
+                {
+                        v = 0;
+                        break;
+                }
+
+                case NIFTY_GET_VERSION:
+                {
+                        v = 0xfa4e;
+                        break;
+                }
+
+                case NIFTY_GET_CHAINLENGTH:
+                {
+                        v = d->chainlength;
+                        break;
+                }
+
+                case NIFTY_GET_INPUT_BITWIDTH:
+                {
+                        v = d->bitwidth;
+                        break;
+                }
+
+                default:
+                {
+                        pthread_mutex_unlock(&d->mutex);
+                        return -1;
+                }
+        }
+        pthread_mutex_unlock(&d->mutex);
+
+        if(size > sizeof(v))
+                size = sizeof(v);
+        memcpy(payload, &v, size);
+
+        return size;
+}
+
+
+/** receive bulk data (unless an error was injected) */
+static int _bulk_write(void *handle, int ep, char *data, size_t size,
+                       unsigned int timeout)
+{
+        FakeDevice *d = handle;
+
+        pthread_mutex_lock(&d->mutex);
+        if(d->fail_in && --d->fail_in == 0)
+                d->error = d->fail_error;
+        int error = d->error;
+        pthread_mutex_unlock(&d->mutex);
+
+        if(error)
+                return -error;
+
+        _transfer(d, NIFTYLINO_FAKE_BULK_WRITE, ep, data, size, true);
+        return size;
+}
+
+
+/** clear halt (fixes stalled endpoint) */
+static int _clear_halt(void *handle, int ep)
+{
+        FakeDevice *d = handle;
+
+        int error = _error(d);
+        if(error == ENODEV)
+                return -ENODEV;
+
+        _transfer(d, NIFTYLINO_FAKE_CONTROL_SEND, 0, NULL, 0, false);
+
+        if(error && error != EPIPE)
+                return -error;
+
+        pthread_mutex_lock(&d->mutex);
+        _recovered(d);
+        pthread_mutex_unlock(&d->mutex);
+        return 0;
+}
+
+
+/** re-claim interface (fixes everything but a device that's gone) */
+static int _reclaim(void *handle)
+{
+        FakeDevice *d = handle;
+
+        pthread_mutex_lock(&d->mutex);
+        int r = d->error == ENODEV ? -ENODEV : 0;
+        if(r == 0 && d->error)
+                _recovered(d);
+        pthread_mutex_unlock(&d->mutex);
+
+        return r;
+}
+
+
+/** reopen (we're still there, handle stays the same) */
+static NftResult _reopen(void **handle, const char *serial)
+{
+        FakeDevice *d = *handle;
+
+        pthread_mutex_lock(&d->mutex);
+        if(d->error)
+                _recovered(d);
+        pthread_mutex_unlock(&d->mutex);
+
+        return NFT_SUCCESS;
+}
+
+
+
+
+/** find open controller (_devices_mutex must be held) */
+static FakeDevice *_find(const char *id)
+{
+        FakeDevice *d;
+        for(d = _devices; d; d = d->next)
+        {
+                if(strcmp(d->id, id) == 0)
+                        return d;
+        }
+
+        return NULL;
+}
+
+
+/** messages recorded by controller with id (see niftylino_fake.h) */
+size_t niftylino_fake_records(const char *id,
+                              const NiftylinoFakeRecord ** records)
+{
+        size_t n = 0;
+
+        pthread_mutex_lock(&_devices_mutex);
+        FakeDevice *d;
+        if((d = _find(id)))
+        {
+                pthread_mutex_lock(&d->mutex);
+                *records = d->records;
+                n = d->n_records;
+                pthread_mutex_unlock(&d->mutex);
+        }
+        pthread_mutex_unlock(&_devices_mutex);
+
+        return n;
+}
+
+
+/** forget messages recorded by controller with id */
+void niftylino_fake_reset(const char *id)
+{
+        pthread_mutex_lock(&_devices_mutex);
+        FakeDevice *d;
+        if((d = _find(id)))
+        {
+                pthread_mutex_lock(&d->mutex);
+                _records_free(d);
+                pthread_mutex_unlock(&d->mutex);
+        }
+        pthread_mutex_unlock(&_devices_mutex);
+}
+
+
+
+
+/** let n-th bulk write of controller with id fail with -error */
+bool niftylino_fake_fail(const char *id, unsigned int n, int error)
+{
+        pthread_mutex_lock(&_devices_mutex);
+        FakeDevice *d;
+        if((d = _find(id)))
+        {
+                pthread_mutex_lock(&d->mutex);
+                d->fail_in = n;
+                d->fail_error = error;
+                pthread_mutex_unlock(&d->mutex);
+        }
+        pthread_mutex_unlock(&_devices_mutex);
+
+        return d != NULL;
+}
+
+
+
+
+/** fake transport */
+const NiftylinoTransport niftylino_transport_fake = {
+        .name = "fake",
+        .open = _open,
+        .close = _close,
+        .control_send = _control_send,
+        .control_rcv = _control_rcv,
+        .bulk_write = _bulk_write,
+        .clear_halt = _clear_halt,
+        .reclaim = _reclaim,
+        .reopen = _reopen,
+};
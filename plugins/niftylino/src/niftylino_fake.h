@@ -0,0 +1,117 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+/**
+ * @file niftylino_fake.h
+ * @brief introspection of the fake niftylino transport for tests
+ *
+ * The plugin exports the functions below. Tests look them up with dlsym()
+ * on the loaded plugin, devices are identified by the id they were opened
+ * with (e.g. "fake:fs").
+ */
+
+#ifndef _NIFTYLINO_FAKE
+#define _NIFTYLINO_FAKE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/** kind of recorded message */
+typedef enum
+{
+        NIFTYLINO_FAKE_CONTROL_SEND,
+        NIFTYLINO_FAKE_CONTROL_RCV,
+        NIFTYLINO_FAKE_BULK_WRITE,
+} NiftylinoFakeMessageType;
+
+
+/** one recorded message */
+typedef struct
+{
+        /** time transfer finished on the modelled bus (ns) */
+        uint64_t                        t;
+        NiftylinoFakeMessageType        type;
+        /** control message id or bulk endpoint */
+        unsigned int                    message;
+        /** payload size */
+        size_t                          size;
+        /** first 32 bits of control payload (0 if shorter) */
+        uint32_t                        value;
+        /** copy of bulk payload (NULL for control messages) */
+        const uint8_t                  *data;
+} NiftylinoFakeRecord;
+
+
+/**
+ * get messages recorded since device was opened or reset. Records stay
+ * valid until the next message or reset (set "telemetry_interval" to 0,
+ * so the poller doesn't add messages meanwhile).
+ *
+ * @result amount of records, 0 if no such device is open
+ */
+typedef size_t                  (*NiftylinoFakeRecordsFunc) (const char *id, const NiftylinoFakeRecord ** records);
+/** forget recorded messages of device */
+typedef void                    (*NiftylinoFakeResetFunc) (const char *id);
+
+/**
+ * let the n-th bulk write from now (1 = next one) fail with -error. It
+ * keeps failing until the matching recovery step:
+ * - EPIPE: endpoint stalled until its halt is cleared
+ * - ENODEV: device gone (every message fails) until it's re-opened
+ * - any other: interface lost until it's re-claimed
+ * The controller forgets chainlength & bitwidth unless the error is EPIPE.
+ *
+ * @result false if no such device is open
+ */
+typedef bool                    (*NiftylinoFakeFailFunc) (const char *id, unsigned int n, int error);
+
+#define NIFTYLINO_FAKE_RECORDS  "niftylino_fake_records"
+#define NIFTYLINO_FAKE_RESET    "niftylino_fake_reset"
+#define NIFTYLINO_FAKE_FAIL     "niftylino_fake_fail"
+
+
+#endif /* _NIFTYLINO_FAKE */
@@ -0,0 +1,264 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <usb.h>
+#include <niftyled.h>
+#include "config.h"
+#include "niftylino.h"
+#include "niftylino_usb.h"
+#include "niftylino_transport.h"
+
+
+
+
+/** find, claim & open niftylino usb-device matching id */
+static NftResult _find(void **handle, const char *id, char *serial,
+                       size_t serial_size, bool reset)
+{
+        struct usb_bus *bus;
+        struct usb_device *dev;
+        struct usb_dev_handle *h;
+
+        /* initialize usb subsystem */
+        usb_init();
+
+        /* enable debugging */
+        int level = 0;
+        if(nft_log_level_is_noisier_than(nft_log_level_get(), L_VERBOSE))
+                level = 3;
+        else if(nft_log_level_is_noisier_than(nft_log_level_get(), L_INFO))
+                level = 2;
+        else if(nft_log_level_is_noisier_than(nft_log_level_get(), L_ERROR))
+                level = 1;
+
+        usb_set_debug(level);
+
+        /* find (new) busses */
+        usb_find_busses();
+
+        /* find (new) devices */
+        usb_find_devices();
+
+
+        /* walk all busses */
+        for(bus = usb_get_busses(); bus; bus = bus->next)
+        {
+                /* walk all devices on bus */
+                for(dev = bus->devices; dev; dev = dev->next)
+                {
+                        /* found niftylino? */
+                        if((dev->descriptor.idVendor != VENDOR_ID) ||
+                           (dev->descriptor.idProduct != PRODUCT_ID))
+                        {
+                                continue;
+                        }
+
+
+                        /* try to open */
+                        if(!(h = usb_open(dev)))
+                                /* device allready open or other error */
+                                continue;
+
+                        /* interface already claimed by driver? */
+                        char driver[1024];
+                        if(!(usb_get_driver_np(h, 0, driver, sizeof(driver))))
+                        {
+                                // NFT_LOG(L_ERROR, "Device already claimed by
+                                // \"%s\"", driver);
+                                continue;
+                        }
+
+                        if(reset)
+                        {
+                                /* reset device */
+                                usb_reset(h);
+                                usb_close(h);
+                                // ~ if(usb_reset(h) < 0)
+                                // ~ {
+                                // ~ /* reset failed */
+                                // ~ usb_close(h);
+                                // ~ continue;
+                                // ~ }
+
+                                /* re-open */
+                                if(!(h = usb_open(dev)))
+                                        /* device allready open or other
+                                         * error */
+                                        continue;
+                        }
+
+                        /* clear any previous halt status */
+                        // usb_clear_halt(h, 0);
+
+                        /* claim interface */
+                        if(usb_claim_interface(h, 0) < 0)
+                        {
+                                /* device claim failed */
+                                usb_close(h);
+                                continue;
+                        }
+
+                        /* receive string-descriptor (serial number) */
+                        if(usb_get_string_simple(h, 3, serial, serial_size)
+                           < 0)
+                        {
+                                usb_release_interface(h, 0);
+                                usb_close(h);
+                                continue;
+                        }
+
+
+                        /* device id == requested id? (or wildcard id
+                         * requested? */
+                        if(strlen(id) == 0 ||
+                           strncmp(id, serial, serial_size) == 0 ||
+                           strncmp(id, "*", 1) == 0)
+                        {
+                                *handle = h;
+                                return NFT_SUCCESS;
+                        }
+
+                        /* close this adapter */
+                        usb_release_interface(h, 0);
+                        usb_close(h);
+
+
+                }
+        }
+
+        return NFT_FAILURE;
+}
+
+
+/** open niftylino usb-device matching id */
+static NftResult _open(void **handle, const char *id, char *serial,
+                       size_t serial_size)
+{
+        return _find(handle, id, serial, serial_size, true);
+}
+
+
+/** close usb-device */
+static void _close(void *handle)
+{
+        usb_release_interface(handle, 0);
+        usb_close(handle);
+}
+
+
+/** send message + payload to adapter */
+static int _control_send(void *handle, unsigned int message, char *payload,
+                         size_t size, unsigned int timeout)
+{
+        return usb_control_msg(handle, RECV_EP, message, 0, 0,
+                               payload, size, timeout);
+}
+
+
+/** receive payload from adapter */
+static int _control_rcv(void *handle, unsigned int message, char *payload,
+                        size_t size, unsigned int timeout)
+{
+        return usb_control_msg(handle,
+                               USB_TYPE_CLASS | DIR_DEV_TO_HOST |
+                               USB_RECIP_INTERFACE, message, 0, 0, payload,
+                               size, timeout);
+}
+
+
+/** write to bulk endpoint */
+static int _bulk_write(void *handle, int ep, char *data, size_t size,
+                       unsigned int timeout)
+{
+        return usb_bulk_write(handle, ep, data, size, timeout);
+}
+
+
+/** clear halt condition of endpoint */
+static int _clear_halt(void *handle, int ep)
+{
+        return usb_clear_halt(handle, ep);
+}
+
+
+/** release & re-claim our interface */
+static int _reclaim(void *handle)
+{
+        usb_release_interface(handle, 0);
+        return usb_claim_interface(handle, 0);
+}
+
+
+/** close device and open it again by serial */
+static NftResult _reopen(void **handle, const char *serial)
+{
+        char s[255];
+
+        usb_release_interface(*handle, 0);
+        usb_close(*handle);
+        *handle = NULL;
+
+        /* the serial makes sure we get the same adapter back */
+        return _find(handle, serial, s, sizeof(s), false);
+}
+
+
+
+
+/** libusb transport */
+const NiftylinoTransport niftylino_transport_libusb = {
+        .name = "libusb",
+        .open = _open,
+        .close = _close,
+        .control_send = _control_send,
+        .control_rcv = _control_rcv,
+        .bulk_write = _bulk_write,
+        .clear_halt = _clear_halt,
+        .reclaim = _reclaim,
+        .reopen = _reopen,
+};
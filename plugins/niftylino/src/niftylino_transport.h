@@ -0,0 +1,86 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+#ifndef _NIFTYLINO_TRANSPORT
+#define _NIFTYLINO_TRANSPORT
+
+#include <stddef.h>
+
+
+/**
+ * transport backend used to talk to a niftylino controller
+ *
+ * All functions returning int return a negative value upon error.
+ */
+typedef struct
+{
+        /** name of this backend */
+        const char                     *name;
+        /** open first controller matching id, fill in its serial */
+        NftResult                       (*open) (void **handle, const char *id, char *serial, size_t serial_size);
+        /** close controller */
+        void                            (*close) (void *handle);
+        /** send control message + payload */
+        int                             (*control_send) (void *handle, unsigned int message, char *payload, size_t size, unsigned int timeout);
+        /** receive payload of control message, returns bytes received */
+        int                             (*control_rcv) (void *handle, unsigned int message, char *payload, size_t size, unsigned int timeout);
+        /** write data to bulk endpoint */
+        int                             (*bulk_write) (void *handle, int ep, char *data, size_t size, unsigned int timeout);
+        /** recovery: clear halt/stall condition of endpoint */
+        int                             (*clear_halt) (void *handle, int ep);
+        /** recovery: release and re-claim interface */
+        int                             (*reclaim) (void *handle);
+        /** recovery: close handle and open controller with serial again (without reset) */
+        NftResult                       (*reopen) (void **handle, const char *serial);
+} NiftylinoTransport;
+
+
+/** real hardware through libusb */
+extern const NiftylinoTransport niftylino_transport_libusb;
+/** in-process controller emulation (id "fake[:<speed>[:<latency-us>]]") */
+extern const NiftylinoTransport niftylino_transport_fake;
+
+
+#endif /* _NIFTYLINO_TRANSPORT */
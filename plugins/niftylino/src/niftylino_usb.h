@@ -76,7 +76,9 @@ enum NIFTY_CTRL_MSG_ID
         NIFTY_GET_CHAINLENGTH,
         NIFTY_GET_GAIN,
         NIFTY_GET_GAMMA_VALUE,
-        NIFTY_GET_INPUT_BITWIDTH
+        NIFTY_GET_INPUT_BITWIDTH,
+        /** LED offset the next bulk transfer starts at (firmware extension) */
+        NIFTY_SET_WRITE_OFFSET
 };
 
 
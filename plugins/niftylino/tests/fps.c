@@ -0,0 +1,575 @@
+/*
+ * libniftyled - Interface library for LED interfaces
+ * Copyright (C) 2010-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+/**
+ * report achievable frame rates of the niftylino plugin for various chain
+ * lengths and bit widths using the fake USB transport, check what went
+ * over the wire for every frame
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <niftyled.h>
+#include "niftylino.h"
+#include "niftylino_usb.h"
+#include "niftylino_fake.h"
+
+
+/** frames to send per measurement */
+#define FRAMES  20
+
+/** plugin that contains the fake transport */
+#define PLUGIN  "usb_niftylino-hardware.so"
+
+
+/** what the controller got since the last check */
+typedef struct
+{
+        /** value of last NIFTY_SET_INPUT_BITWIDTH (-1 = none) */
+        int bitwidth;
+        /** LED offset of next bulk transfer (kept across checks) */
+        uint32_t offset;
+        /** amount of bulk transfers */
+        unsigned int transfers;
+        /** LED offset, size & payload of last bulk transfer */
+        uint32_t tx_offset;
+        size_t tx_size;
+        const uint8_t *tx_data;
+        /** controller was latched after last bulk transfer */
+        bool latched;
+} Wire;
+
+
+static NiftylinoFakeRecordsFunc _records;
+static NiftylinoFakeResetFunc _reset;
+static NiftylinoFakeFailFunc _fail;
+
+
+/** current time in seconds */
+static double _now(void)
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/** find introspection functions of fake transport in loaded plugin */
+static int _fake_lookup(void)
+{
+        if(_records && _reset && _fail)
+                return 0;
+
+        /* plugin is loaded by the library, maybe with RTLD_LOCAL */
+        void *plugin = dlopen(PLUGIN, RTLD_LAZY | RTLD_NOLOAD);
+        void *scope = plugin ? plugin : RTLD_DEFAULT;
+
+        _records = (NiftylinoFakeRecordsFunc) dlsym(scope,
+                                                    NIFTYLINO_FAKE_RECORDS);
+        _reset = (NiftylinoFakeResetFunc) dlsym(scope, NIFTYLINO_FAKE_RESET);
+        _fail = (NiftylinoFakeFailFunc) dlsym(scope, NIFTYLINO_FAKE_FAIL);
+
+        if(plugin)
+                dlclose(plugin);
+
+        if(!_records || !_reset || !_fail)
+        {
+                NFT_LOG(L_ERROR, "fake transport not found in \"%s\"",
+                        PLUGIN);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * parse messages the fake controller with id got since the last check
+ * into w and forget them. Telemetry polls are ignored.
+ */
+static void _wire(const char *id, Wire * w)
+{
+        const NiftylinoFakeRecord *r;
+        size_t n = _records(id, &r);
+
+        w->bitwidth = -1;
+        w->transfers = 0;
+        w->tx_size = 0;
+        w->latched = false;
+
+        size_t i;
+        for(i = 0; i < n; i++)
+        {
+                if(r[i].type == NIFTYLINO_FAKE_BULK_WRITE)
+                {
+                        w->transfers++;
+                        w->tx_offset = w->offset;
+                        w->tx_size = r[i].size;
+                        w->tx_data = r[i].data;
+                        w->latched = false;
+                        continue;
+                }
+
+                if(r[i].type != NIFTYLINO_FAKE_CONTROL_SEND)
+                        continue;
+
+                switch (r[i].message)
+                {
+                        case NIFTY_SET_INPUT_BITWIDTH:
+                        {
+                                w->bitwidth = (int) r[i].value;
+                                break;
+                        }
+
+                        case NIFTY_SET_WRITE_OFFSET:
+                        {
+                                w->offset = r[i].value;
+                                break;
+                        }
+
+                        case NIFTY_LATCH:
+                        {
+                                w->latched = true;
+                                break;
+                        }
+                }
+        }
+}
+
+
+/** check records of one frame: one full transfer of buf, then latch */
+static int _check_frame(const char *id, Wire * w, const void *buf,
+                        size_t size)
+{
+        _wire(id, w);
+
+        if(w->transfers != 1 || w->tx_offset != 0 || w->tx_size != size ||
+           !w->tx_data || memcmp(w->tx_data, buf, size) != 0 || !w->latched)
+        {
+                NFT_LOG(L_ERROR,
+                        "\"%s\": got %u transfers, last at LED %u with %zu bytes (expected 1 with %zu bytes)",
+                        id, w->transfers, w->tx_offset, w->tx_size, size);
+                return -1;
+        }
+
+        _reset(id);
+        return 0;
+}
+
+
+/** check records of one frame: amount of transfers & last one */
+static int _check_range(const char *id, Wire * w, unsigned int transfers,
+                        uint32_t offset, const uint8_t * buf, size_t size)
+{
+        _wire(id, w);
+
+        if(w->transfers != transfers || !w->latched ||
+           (transfers &&
+            (w->tx_offset != offset || w->tx_size != size ||
+             memcmp(w->tx_data, buf, size) != 0)))
+        {
+                NFT_LOG(L_ERROR,
+                        "\"%s\": got %u transfers, last at LED %u with %zu bytes (expected %u at LED %u with %zu bytes)",
+                        id, w->transfers, w->tx_offset, w->tx_size,
+                        transfers, offset, size);
+                return -1;
+        }
+
+        _reset(id);
+        return 0;
+}
+
+
+/**
+ * with dirty_detect & offset_writes only changed LEDs are transferred:
+ * nothing for an unchanged frame, one LED in the middle & at both ends
+ * of the chain
+ */
+static int _dirty(const char *format)
+{
+        const char *id = "fake:hs";
+        const LedCount ledcount = 96;
+        const LedCount changes[] = { 40, ledcount - 1, 0 };
+
+        LedHardware *h;
+        if(!(h = led_hardware_new("dirty", "usb_niftylino")))
+                return -1;
+
+        if(!led_hardware_init(h, id, ledcount, format) ||
+           _fake_lookup() != 0 ||
+           !led_hardware_plugin_prop_set_int(h, "telemetry_interval", 0) ||
+           !led_hardware_plugin_prop_set_int(h, "dirty_detect", 1) ||
+           !led_hardware_plugin_prop_set_int(h, "offset_writes", 1))
+        {
+                NFT_LOG(L_ERROR, "failed to initialize hardware");
+                led_hardware_destroy(h);
+                return -1;
+        }
+
+        LedChain *c = led_hardware_get_chain(h);
+        const uint8_t *buf = led_chain_get_buffer(c);
+        size_t size = led_chain_get_buffer_size(c);
+        size_t bpc = size / ledcount;
+
+        Wire w = { 0 };
+        _reset(id);
+
+        /* first frame is complete, second one unchanged */
+        int r = 0;
+        if(!led_hardware_send(h) || !led_hardware_show(h) ||
+           _check_range(id, &w, 1, 0, buf, size) != 0 ||
+           !led_hardware_send(h) || !led_hardware_show(h) ||
+           _check_range(id, &w, 0, 0, NULL, 0) != 0)
+                r = -1;
+
+        size_t i;
+        for(i = 0; r == 0 && i < sizeof(changes) / sizeof(changes[0]); i++)
+        {
+                LedCount l = changes[i];
+                led_chain_set_greyscale(c, l, 0x5a + i);
+
+                if(!led_hardware_send(h) || !led_hardware_show(h) ||
+                   _check_range(id, &w, 1, l, buf + l * bpc, bpc) != 0)
+                {
+                        NFT_LOG(L_ERROR, "\"%s\": change of LED %u",
+                                format, l);
+                        r = -1;
+                }
+        }
+
+        led_hardware_destroy(h);
+        return r;
+}
+
+
+/**
+ * target_fps: full 16 bit frames over budget fall back to 8 bit, small
+ * changes (mostly per-transfer latency) return to 16 bit
+ */
+static int _adapt(void)
+{
+        /* 1 MB/s, 1 ms latency: full frames take 7 ms at 16 bit, 4 ms at 8
+           bit, single LEDs 1 ms. Budget is 5 ms. */
+        const char *id = "fake:1000000:1000";
+        const LedCount ledcount = 3000;
+        const int fps = 200;
+
+        LedHardware *h;
+        if(!(h = led_hardware_new("adapt", "usb_niftylino")))
+                return -1;
+
+        if(!led_hardware_init(h, id, ledcount, "RGB u16") ||
+           _fake_lookup() != 0 ||
+           !led_hardware_plugin_prop_set_int(h, "telemetry_interval", 0) ||
+           !led_hardware_plugin_prop_set_int(h, "dirty_detect", 1) ||
+           !led_hardware_plugin_prop_set_int(h, "offset_writes", 1) ||
+           !led_hardware_plugin_prop_set_int(h, "target_fps", fps))
+        {
+                NFT_LOG(L_ERROR, "failed to initialize hardware");
+                led_hardware_destroy(h);
+                return -1;
+        }
+
+        LedChain *c = led_hardware_get_chain(h);
+        Wire w = { 0 };
+        _reset(id);
+
+        /* change all LEDs until we fell back, then a single one */
+        int f, down = -1, up = -1;
+        for(f = 0; f < 4 * (ADAPT_FRAMES_DOWN + ADAPT_FRAMES_UP) && up < 0;
+            f++)
+        {
+                LedCount l;
+                for(l = 0; l < (down < 0 ? ledcount : 1); l++)
+                        led_chain_set_greyscale(c, (l + f) % ledcount,
+                                                (f * 257) & 0xffff);
+
+                if(!led_hardware_send(h) || !led_hardware_show(h))
+                {
+                        NFT_LOG(L_ERROR, "failed to send frame %d", f);
+                        led_hardware_destroy(h);
+                        return -1;
+                }
+
+                /* switched frames are complete */
+                _wire(id, &w);
+                _reset(id);
+                if(w.bitwidth == 0 && down < 0 && w.tx_size == ledcount)
+                        down = f;
+                else if(w.bitwidth == 1 && down >= 0 &&
+                        w.tx_size == ledcount * 2)
+                        up = f;
+                else if(w.bitwidth != -1)
+                        break;
+        }
+
+        led_hardware_destroy(h);
+
+        if(down < ADAPT_FRAMES_DOWN || down > ADAPT_FRAMES_DOWN + 2 ||
+           up - down < ADAPT_FRAMES_UP)
+        {
+                NFT_LOG(L_ERROR,
+                        "switched to 8 bit at frame %d, back at frame %d",
+                        down, up);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * failed bulk writes are recovered by the cheapest step that works: a
+ * stalled endpoint by clearing the halt, a lost interface by re-claiming
+ * it, a vanished device by re-opening it. The frame still arrives and the
+ * controller gets its state back.
+ */
+static int _recovery(void)
+{
+        const char *id = "fake:hs";
+        const LedCount ledcount = 96;
+        const struct
+        {
+                int error;
+                const char *step;
+                bool replay;
+        } faults[] =
+        {
+                {EPIPE, "recovery_clear_halt", false},
+                {EIO, "recovery_reclaim", true},
+                {ENODEV, "recovery_reopen", true},
+        };
+
+        LedHardware *h;
+        if(!(h = led_hardware_new("recovery", "usb_niftylino")))
+                return -1;
+
+        if(!led_hardware_init(h, id, ledcount, "RGB u16") ||
+           _fake_lookup() != 0 ||
+           !led_hardware_plugin_prop_set_int(h, "telemetry_interval", 0) ||
+           !led_hardware_plugin_prop_set_int(h, "dirty_detect", 0))
+        {
+                NFT_LOG(L_ERROR, "failed to initialize hardware");
+                led_hardware_destroy(h);
+                return -1;
+        }
+
+        LedChain *c = led_hardware_get_chain(h);
+        const void *buf = led_chain_get_buffer(c);
+        size_t size = led_chain_get_buffer_size(c);
+
+        Wire w = { 0 };
+        _reset(id);
+
+        int r = 0;
+        size_t i;
+        for(i = 0; r == 0 && i <= sizeof(faults) / sizeof(faults[0]); i++)
+        {
+                /* last round checks the controller is fine again */
+                bool fault = i < sizeof(faults) / sizeof(faults[0]);
+
+                int steps = 0, recoveries = 0;
+                if((fault &&
+                    (!led_hardware_plugin_prop_get_int(h, faults[i].step,
+                                                       &steps) ||
+                     !_fail(id, 1, faults[i].error))) ||
+                   !led_hardware_plugin_prop_get_int(h, "recoveries",
+                                                     &recoveries))
+                {
+                        r = -1;
+                        break;
+                }
+
+                LedCount l;
+                for(l = 0; l < ledcount; l++)
+                        led_chain_set_greyscale(c, l, (l + i) * 0x0101);
+
+                if(!led_hardware_send(h) || !led_hardware_show(h))
+                {
+                        NFT_LOG(L_ERROR, "failed to send frame %zu", i);
+                        r = -1;
+                        break;
+                }
+
+                /* state replay must be seen before _check_frame() resets */
+                _wire(id, &w);
+                int bitwidth = w.bitwidth;
+                if(_check_frame(id, &w, buf, size) != 0)
+                {
+                        NFT_LOG(L_ERROR, "\"%s\": frame %zu didn't arrive",
+                                id, i);
+                        r = -1;
+                        break;
+                }
+
+                int after = steps, recovered = recoveries;
+                if(fault)
+                        led_hardware_plugin_prop_get_int(h, faults[i].step,
+                                                         &after);
+                led_hardware_plugin_prop_get_int(h, "recoveries", &recovered);
+
+                if(after != steps + fault || recovered != recoveries + fault ||
+                   (bitwidth == 1) != (fault && faults[i].replay))
+                {
+                        NFT_LOG(L_ERROR,
+                                "\"%s\": frame %zu: %d recoveries, %d by step, bitwidth %d",
+                                id, i, recovered - recoveries, after - steps,
+                                bitwidth);
+                        r = -1;
+                }
+        }
+
+        led_hardware_destroy(h);
+        return r;
+}
+
+
+/** measure frames/second for one configuration */
+static int _measure(const char *id, const char *format, LedCount ledcount,
+                    double *fps)
+{
+        LedHardware *h;
+        if(!(h = led_hardware_new("fps", "usb_niftylino")))
+        {
+                NFT_LOG(L_ERROR, "Hardware creation FAILED");
+                return -1;
+        }
+
+        if(!led_hardware_init(h, id, ledcount, format))
+        {
+                NFT_LOG(L_ERROR, "failed to initialize hardware");
+                led_hardware_destroy(h);
+                return -1;
+        }
+
+        LedChain *c = led_hardware_get_chain(h);
+        const void *buf = led_chain_get_buffer(c);
+        size_t size = led_chain_get_buffer_size(c);
+
+        /* controller must have been told our value width */
+        Wire w = { 0 };
+        if(_fake_lookup() != 0 ||
+           !led_hardware_plugin_prop_set_int(h, "telemetry_interval", 0))
+        {
+                led_hardware_destroy(h);
+                return -1;
+        }
+        _wire(id, &w);
+        if(w.bitwidth != (size / ledcount == 2 ? 1 : 0))
+        {
+                NFT_LOG(L_ERROR, "\"%s\": bitwidth %d for \"%s\"", id,
+                        w.bitwidth, format);
+                led_hardware_destroy(h);
+                return -1;
+        }
+        _reset(id);
+
+        double start = _now();
+
+        int f;
+        for(f = 0; f < FRAMES; f++)
+        {
+                /* change all LEDs every frame */
+                LedCount l;
+                for(l = 0; l < ledcount; l++)
+                        led_chain_set_greyscale(c, l, (l + f) & 0xff);
+
+                if(!led_hardware_send(h) || !led_hardware_show(h) ||
+                   _check_frame(id, &w, buf, size) != 0)
+                {
+                        NFT_LOG(L_ERROR, "failed to send frame %d", f);
+                        led_hardware_destroy(h);
+                        return -1;
+                }
+        }
+
+        *fps = FRAMES / (_now() - start);
+
+        led_hardware_destroy(h);
+        return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+        nft_log_level_set(L_WARNING);
+
+        const char *ids[] = { "fake:fs", "fake:hs" };
+        const char *formats[] = { "RGB u8", "RGB u16" };
+        const LedCount ledcounts[] = { 96, 768, 3072, 6144 };
+
+        if(_dirty("RGB u8") != 0 || _dirty("RGB u16") != 0 || _adapt() != 0 ||
+           _recovery() != 0)
+                return -1;
+
+        printf("%-10s %-8s %8s %10s\n", "transport", "format", "LEDs", "fps");
+
+        size_t i, j, k;
+        for(i = 0; i < sizeof(ids) / sizeof(ids[0]); i++)
+        {
+                for(j = 0; j < sizeof(formats) / sizeof(formats[0]); j++)
+                {
+                        for(k = 0; k < sizeof(ledcounts) / sizeof(ledcounts[0]);
+                            k++)
+                        {
+                                double fps;
+                                if(_measure(ids[i], formats[j], ledcounts[k],
+                                            &fps) != 0)
+                                        return -1;
+
+                                printf("%-10s %-8s %8u %10.1f\n", ids[i],
+                                       formats[j], ledcounts[k], fps);
+                        }
+                }
+        }
+
+        return 0;
+}